@@ -0,0 +1,106 @@
+# Compile the threshold maps of the textures directory into a C source file,
+# so that the library can hand them out without any file I/O.
+#
+# Usage: cmake -DTEXTURE_DIR=<dir> -DOUTPUT=<file.c> -P EmbedTextures.cmake
+#
+# The pixels of all maps go into one read-only array. Each set of maps becomes
+# a TextureSet, aligned to TEXTURE_ALIGNMENT bytes within the array, and each
+# of its slices a PgmImage view:
+#   bayer/<n>x<n>.pgm               TEXTURE_BAYER, one slice
+#   blue_noise/<n>x<n>/<slice>.pgm  TEXTURE_BLUE_NOISE, slices 0, 1, ...
+
+set(TEXTURE_ALIGNMENT 64)
+
+# A line of 16 escaped bytes
+string(REPEAT "\\\\x.." 16 TEXTURE_LINE)
+
+set(offset 0)
+set(slice_count 0)
+set(slices "")
+set(sets "")
+
+# Append the pixels of a PGM file, which are its last width * height bytes
+function(append_pixels file width height)
+  file(SIZE "${file}" size)
+  math(EXPR header "${size} - ${width} * ${height}")
+  file(READ "${file}" hex OFFSET ${header} HEX)
+  string(REGEX REPLACE "([0-9a-f][0-9a-f])" "\\\\x\\1" escaped "${hex}")
+  string(REGEX REPLACE "(${TEXTURE_LINE})" "\\1\"\n    \"" escaped
+         "${escaped}")
+  file(APPEND "${OUTPUT}" "    \"${escaped}\"\n")
+endfunction()
+
+# Append a set of maps of the same size, one slice per file
+macro(add_set kind width height)
+  set(files ${ARGN})
+  list(LENGTH files depth)
+  string(APPEND sets "    {${kind}, ${slice_count},\n"
+         "     {${width}, ${height}, ${depth}, "
+         "(uint8_t *)kPixels + ${offset}}},\n")
+  foreach(file IN LISTS files)
+    append_pixels("${file}" ${width} ${height})
+    string(APPEND slices "    {${width}, ${height}, PGM_MAX_GRAY, "
+           "(uint8_t *)kPixels + ${offset}, {NULL, 0}},\n")
+    math(EXPR offset "${offset} + ${width} * ${height}")
+    math(EXPR slice_count "${slice_count} + 1")
+  endforeach()
+
+  # Pad the pixels to the start of the next set
+  math(EXPR pad "(${TEXTURE_ALIGNMENT} - ${offset} % ${TEXTURE_ALIGNMENT}) % \
+                 ${TEXTURE_ALIGNMENT}")
+  if(pad)
+    string(REPEAT "\\x00" ${pad} zeros)
+    file(APPEND "${OUTPUT}" "    \"${zeros}\"\n")
+    math(EXPR offset "${offset} + ${pad}")
+  endif()
+endmacro()
+
+file(WRITE "${OUTPUT}"
+     "// Generated from ${TEXTURE_DIR} by EmbedTextures.cmake. Do not edit.\n"
+     "\n"
+     "#include \"texture.h\"\n"
+     "\n"
+     "// The pixels of all maps\n"
+     "static const _Alignas(${TEXTURE_ALIGNMENT}) uint8_t kPixels[] =\n")
+
+# Bayer matrices, one file per size
+file(GLOB bayer "${TEXTURE_DIR}/bayer/*.pgm")
+list(SORT bayer COMPARE NATURAL)
+foreach(file IN LISTS bayer)
+  get_filename_component(name "${file}" NAME_WE)
+  if(name MATCHES "^([0-9]+)x([0-9]+)$")
+    add_set(TEXTURE_BAYER ${CMAKE_MATCH_1} ${CMAKE_MATCH_2} "${file}")
+  endif()
+endforeach()
+
+# Blue noise, one directory of numbered slices per size
+file(GLOB blue_noise LIST_DIRECTORIES true "${TEXTURE_DIR}/blue_noise/*")
+list(SORT blue_noise COMPARE NATURAL)
+foreach(directory IN LISTS blue_noise)
+  get_filename_component(name "${directory}" NAME)
+  if(IS_DIRECTORY "${directory}" AND name MATCHES "^([0-9]+)x([0-9]+)$")
+    set(width ${CMAKE_MATCH_1})
+    set(height ${CMAKE_MATCH_2})
+    set(files "")
+    set(slice 0)
+    while(EXISTS "${directory}/${slice}.pgm")
+      list(APPEND files "${directory}/${slice}.pgm")
+      math(EXPR slice "${slice} + 1")
+    endwhile()
+    if(files)
+      add_set(TEXTURE_BLUE_NOISE ${width} ${height} ${files})
+    endif()
+  endif()
+endforeach()
+
+file(APPEND "${OUTPUT}"
+     "    ;\n"
+     "\n"
+     "// A view of each slice\n"
+     "const PgmImage kTextureSlices[] = {\n${slices}};\n"
+     "\n"
+     "// Each set of maps\n"
+     "const TextureSet kTextureSets[] = {\n${sets}};\n"
+     "\n"
+     "const uint32_t kTextureSetCount =\n"
+     "    sizeof kTextureSets / sizeof *kTextureSets;\n")
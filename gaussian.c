@@ -0,0 +1,486 @@
+#include "gaussian.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgm.h"
+#include "ppm.h"
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Rows filtered together along the rows, one per lane of each step
+#define GAUSSIAN_LANES 8
+// Columns per strip filtered together down the columns
+#define GAUSSIAN_STRIP 256
+// Steps before a row of pixels, which hold its first input for the causal
+// pass
+#define GAUSSIAN_BEFORE 3
+// Steps after a row of pixels: two of anticausal outputs past its end, then
+// its last input
+#define GAUSSIAN_AFTER 3
+// Fraction bits of the intermediate image, which fit its pixel values in an
+// int16_t
+#define GAUSSIAN_SHIFT 7
+#define GAUSSIAN_ONE (1 << GAUSSIAN_SHIFT)
+
+/**
+ * The coefficients of a recursive Gaussian filter of third order. Each pass
+ * computes out[i] = b * in[i] + a1 * out[i -+ 1] + a2 * out[i -+ 2] +
+ * a3 * out[i -+ 3]. The poles are close to 1 for large sigma, so the passes
+ * need double precision.
+ */
+typedef struct {
+    double b_;   // The gain of the input.
+    double a_[3];// The weights of the three previous outputs.
+    double m_[9];// The anticausal outputs at the last step and the two after
+                 // it, per unit of the last three causal outputs in excess of
+                 // the last input, row by row.
+} GaussianFilter;
+
+/**
+ * Compute the coefficients of the Young-van Vliet filter for a standard
+ * deviation, and the matrix of Triggs and Sdika that starts the anticausal
+ * pass as if the sequence went on forever with its last input.
+ *
+ * @param sigma     The standard deviation, at least 0.5.
+ * @param filter    The coefficients.
+ */
+static void GaussianCoefficients(double sigma, GaussianFilter *filter) {
+    double q  = sigma >= 2.5 ? 0.98711 * sigma - 0.96330
+                             : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    double q2 = q * q;
+    double q3 = q2 * q;
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+    double a1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+    double a2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+    double a3 = 0.422205 * q3 / b0;
+    double b  = 1 - (a1 + a2 + a3);
+
+    double scale = b / ((1 + a1 - a2 + a3) * (1 - a1 - a2 - a3) *
+                        (1 + a2 + (a1 - a3) * a3));
+    double m[9]  = {
+        -a3 * a1 + 1 - a3 * a3 - a2,
+        (a3 + a1) * (a2 + a3 * a1),
+        a3 * (a1 + a3 * a2),
+        a1 + a3 * a2,
+        -(a2 - 1) * (a2 + a3 * a1),
+        -(a3 * a1 + a3 * a3 + a2 - 1) * a3,
+        a3 * a1 + a2 + a1 * a1 - a2 * a2,
+        a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3,
+        a3 * (a1 + a3 * a2),
+    };
+
+    filter->b_    = b;
+    filter->a_[0] = a1;
+    filter->a_[1] = a2;
+    filter->a_[2] = a3;
+    for (int i = 0; i < 9; i++) filter->m_[i] = m[i] * scale;
+}
+
+/**
+ * Compute one step of a pass over count values.
+ *
+ * @param filter    The coefficients.
+ * @param step      The inputs, overwritten by the outputs.
+ * @param out1      The outputs of the previous step.
+ * @param out2      The outputs of the step before that.
+ * @param out3      The outputs of the step before that.
+ * @param count     The number of values.
+ */
+static inline void GaussianStep(const GaussianFilter *filter, double *step,
+                                const double *out1, const double *out2,
+                                const double *out3, uint32_t count) {
+    uint32_t i = 0;
+#if defined __SSE2__
+    const __m128d b  = _mm_set1_pd(filter->b_);
+    const __m128d a1 = _mm_set1_pd(filter->a_[0]);
+    const __m128d a2 = _mm_set1_pd(filter->a_[1]);
+    const __m128d a3 = _mm_set1_pd(filter->a_[2]);
+    for (; i + 2 <= count; i += 2) {
+        // Only the last product depends on the previous step
+        __m128d sum = _mm_add_pd(_mm_mul_pd(b, _mm_loadu_pd(step + i)),
+                                 _mm_mul_pd(a3, _mm_loadu_pd(out3 + i)));
+        sum = _mm_add_pd(sum, _mm_mul_pd(a2, _mm_loadu_pd(out2 + i)));
+        sum = _mm_add_pd(sum, _mm_mul_pd(a1, _mm_loadu_pd(out1 + i)));
+        _mm_storeu_pd(step + i, sum);
+    }
+#endif
+    for (; i < count; i++) {
+        step[i] = filter->b_ * step[i] + filter->a_[2] * out3[i] +
+                  filter->a_[1] * out2[i] + filter->a_[0] * out1[i];
+    }
+}
+
+/**
+ * Round a value to the nearest integer, without a call into the math
+ * library.
+ *
+ * @param value     The value.
+ * @return          The nearest integer.
+ */
+static inline int32_t GaussianRound(double value) {
+#if defined __SSE2__
+    return _mm_cvtsd_si32(_mm_set_sd(value));
+#else
+    return (int32_t)lrint(value);
+#endif
+}
+
+/**
+ * Start the anticausal pass as if the last input went on forever after the
+ * end, from the last three causal outputs.
+ *
+ * @param filter    The coefficients.
+ * @param input     The last inputs.
+ * @param causal1   The last causal outputs.
+ * @param causal2   The causal outputs before those.
+ * @param causal3   The causal outputs before those.
+ * @param out1      The anticausal outputs at the last step.
+ * @param out2      The anticausal outputs one step past the end.
+ * @param out3      The anticausal outputs two steps past the end.
+ * @param count     The number of values.
+ */
+static void GaussianEdge(const GaussianFilter *filter, const double *input,
+                         const double *causal1, const double *causal2,
+                         const double *causal3, double *out1, double *out2,
+                         double *out3, uint32_t count) {
+    const double *m = filter->m_;
+    for (uint32_t i = 0; i < count; i++) {
+        double u  = input[i];
+        double d1 = causal1[i] - u;
+        double d2 = causal2[i] - u;
+        double d3 = causal3[i] - u;
+        out1[i]   = u + m[0] * d1 + m[1] * d2 + m[2] * d3;
+        out2[i]   = u + m[3] * d1 + m[4] * d2 + m[5] * d3;
+        out3[i]   = u + m[6] * d1 + m[7] * d2 + m[8] * d3;
+    }
+}
+
+/**
+ * Filter up to GAUSSIAN_LANES rows along their length, and store them in
+ * fixed point. The rows are interleaved in the scratch buffer, so that each
+ * step of the filter handles the same pixel of every row at once.
+ *
+ * @param filter    The coefficients.
+ * @param in        The first row of the input.
+ * @param width     The number of pixels of each row.
+ * @param channels  The number of channels of each pixel.
+ * @param rows      The number of rows, at most GAUSSIAN_LANES.
+ * @param scratch   Room for width + GAUSSIAN_BEFORE + GAUSSIAN_AFTER pixels
+ *                  of GAUSSIAN_LANES rows.
+ * @param out       The first row of the intermediate image.
+ */
+static void GaussianRows(const GaussianFilter *filter, const uint8_t *in,
+                         uint32_t width, uint32_t channels, uint32_t rows,
+                         double *scratch, int16_t *out) {
+    size_t span    = (size_t)width * channels;
+    uint32_t count = channels * GAUSSIAN_LANES;
+    double *steps  = scratch + GAUSSIAN_BEFORE * count;
+    double *last   = steps + (size_t)(width - 1) * count;
+    double *input  = last + GAUSSIAN_AFTER * count;
+
+    // Lanes past the last row repeat it
+    const uint8_t *lanes[GAUSSIAN_LANES];
+    for (uint32_t l = 0; l < GAUSSIAN_LANES; l++)
+        lanes[l] = in + (l < rows ? l : rows - 1) * span;
+    for (size_t i = 0; i < span; i++) {
+        for (uint32_t l = 0; l < GAUSSIAN_LANES; l++)
+            steps[i * GAUSSIAN_LANES + l] = lanes[l][i];
+    }
+
+    // The causal pass starts as if the first input went on forever before
+    for (uint32_t k = 1; k <= GAUSSIAN_BEFORE; k++)
+        memcpy(steps - k * count, steps, count * sizeof(double));
+    memcpy(input, last, count * sizeof(double));
+    for (uint32_t x = 0; x < width; x++) {
+        double *step = steps + (size_t)x * count;
+        GaussianStep(filter, step, step - count, step - 2 * count,
+                     step - 3 * count, count);
+    }
+
+    GaussianEdge(filter, input, last, last - count, last - 2 * count, last,
+                 last + count, last + 2 * count, count);
+    for (uint32_t x = width - 1; x-- > 0;) {
+        double *step = steps + (size_t)x * count;
+        GaussianStep(filter, step, step + count, step + 2 * count,
+                     step + 3 * count, count);
+    }
+
+    for (uint32_t l = 0; l < rows; l++) {
+        int16_t *row = out + l * span;
+        for (size_t i = 0; i < span; i++)
+            row[i] = (int16_t)GaussianRound(steps[i * GAUSSIAN_LANES + l] *
+                                            GAUSSIAN_ONE);
+    }
+}
+
+/**
+ * Convert a row of the intermediate image from fixed point.
+ *
+ * @param row       The fixed-point values.
+ * @param count     The number of values.
+ * @param out       The values.
+ */
+static void GaussianLoad(const int16_t *row, uint32_t count, double *out) {
+    uint32_t i = 0;
+#if defined __SSE2__
+    const __m128d scale = _mm_set1_pd(1.0 / GAUSSIAN_ONE);
+    for (; i + 4 <= count; i += 4) {
+        __m128i words = _mm_loadl_epi64((const __m128i *)(row + i));
+        __m128i ints  = _mm_srai_epi32(_mm_unpacklo_epi16(words, words), 16);
+        __m128i high  = _mm_unpackhi_epi64(ints, ints);
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_cvtepi32_pd(ints), scale));
+        _mm_storeu_pd(out + i + 2, _mm_mul_pd(_mm_cvtepi32_pd(high), scale));
+    }
+#endif
+    for (; i < count; i++) out[i] = row[i] * (1.0 / GAUSSIAN_ONE);
+}
+
+/**
+ * Convert a row of values to fixed point in the intermediate image.
+ *
+ * @param row       The values.
+ * @param count     The number of values.
+ * @param out       The fixed-point values.
+ */
+static void GaussianStoreFixed(const double *row, uint32_t count,
+                               int16_t *out) {
+    uint32_t i = 0;
+#if defined __SSE2__
+    const __m128d scale = _mm_set1_pd(GAUSSIAN_ONE);
+    for (; i + 4 <= count; i += 4) {
+        __m128d first  = _mm_mul_pd(_mm_loadu_pd(row + i), scale);
+        __m128d second = _mm_mul_pd(_mm_loadu_pd(row + i + 2), scale);
+        __m128i low    = _mm_cvtpd_epi32(first);
+        __m128i high   = _mm_cvtpd_epi32(second);
+        __m128i ints   = _mm_unpacklo_epi64(low, high);
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packs_epi32(ints, ints));
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = (int16_t)GaussianRound(row[i] * GAUSSIAN_ONE);
+}
+
+/**
+ * Round a row of values to pixel values.
+ *
+ * @param row       The values.
+ * @param count     The number of values.
+ * @param out       The pixel values.
+ */
+static void GaussianStore(const double *row, uint32_t count, uint8_t *out) {
+    uint32_t i = 0;
+#if defined __SSE2__
+    for (; i + 8 <= count; i += 8) {
+        __m128i ints[2];
+        for (int half = 0; half < 2; half++) {
+            const double *values = row + i + 4 * half;
+            ints[half] =
+                _mm_unpacklo_epi64(_mm_cvtpd_epi32(_mm_loadu_pd(values)),
+                                   _mm_cvtpd_epi32(_mm_loadu_pd(values + 2)));
+        }
+        __m128i words = _mm_packs_epi32(ints[0], ints[1]);
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(words, words));
+    }
+#endif
+    for (; i < count; i++) {
+        int32_t value = GaussianRound(row[i]);
+        out[i]        = (uint8_t)(value < 0              ? 0
+                                  : value > PGM_MAX_GRAY ? PGM_MAX_GRAY
+                                                         : value);
+    }
+}
+
+/**
+ * Filter a strip of columns of the intermediate image down its length, a
+ * row at a time, and store the result. Only the last three outputs of each
+ * pass are kept in double precision; the causal outputs replace the
+ * intermediate image, in fixed point, for the anticausal pass.
+ *
+ * @param filter    The coefficients.
+ * @param blurred   The first column of the strip in the intermediate image.
+ * @param span      The number of values of each row of the image.
+ * @param height    The height of the image.
+ * @param count     The number of columns of the strip.
+ * @param rows      Room for 5 rows of GAUSSIAN_STRIP values.
+ * @param out       The first column of the strip in the output.
+ */
+static void GaussianColumns(const GaussianFilter *filter, int16_t *blurred,
+                            size_t span, uint32_t height, uint32_t count,
+                            double *rows, uint8_t *out) {
+    // The row being filtered and the outputs of the three rows before it
+    double *ring[4];
+    for (int k = 0; k < 4; k++) ring[k] = rows + k * GAUSSIAN_STRIP;
+    double *input = rows + 4 * GAUSSIAN_STRIP;
+
+    // The causal pass starts as if the first row went on forever above
+    GaussianLoad(blurred, count, ring[1]);
+    memcpy(ring[2], ring[1], count * sizeof(double));
+    memcpy(ring[3], ring[1], count * sizeof(double));
+    GaussianLoad(blurred + (height - 1) * span, count, input);
+    for (uint32_t y = 0; y < height; y++) {
+        double *step = ring[0];
+        GaussianLoad(blurred + y * span, count, step);
+        GaussianStep(filter, step, ring[1], ring[2], ring[3], count);
+        GaussianStoreFixed(step, count, blurred + y * span);
+        ring[0] = ring[3];
+        ring[3] = ring[2];
+        ring[2] = ring[1];
+        ring[1] = step;
+    }
+
+    // The anticausal pass starts as if the last row went on forever below
+    GaussianEdge(filter, input, ring[1], ring[2], ring[3], ring[1], ring[2],
+                 ring[3], count);
+    GaussianStore(ring[1], count, out + (height - 1) * span);
+    for (uint32_t y = height - 1; y-- > 0;) {
+        double *step = ring[0];
+        GaussianLoad(blurred + y * span, count, step);
+        GaussianStep(filter, step, ring[1], ring[2], ring[3], count);
+        GaussianStore(step, count, out + y * span);
+        ring[0] = ring[3];
+        ring[3] = ring[2];
+        ring[2] = ring[1];
+        ring[1] = step;
+    }
+}
+
+/**
+ * Blur interleaved channels of 8-bit pixels with a Gaussian: along the rows
+ * a group at a time into an intermediate image in fixed point, and then
+ * down the columns of that image a strip at a time, in one parallel region.
+ *
+ * @param in        The input pixels.
+ * @param width     The width of the image.
+ * @param height    The height of the image.
+ * @param channels  The number of channels of each pixel.
+ * @param sigma     The standard deviation of the Gaussian.
+ * @param out       The output pixels.
+ * @return          True if successful, false otherwise.
+ */
+static bool GaussianChannels(const uint8_t *in, uint32_t width,
+                             uint32_t height, uint32_t channels, double sigma,
+                             uint8_t *out) {
+    if (!(sigma >= 0.5)) {
+        fprintf(stderr, "Error: Gaussian sigma %g is below 0.5\n", sigma);
+        return false;
+    }
+    if (!width || !height) return true;
+
+    GaussianFilter filter;
+    GaussianCoefficients(sigma, &filter);
+
+    size_t span      = (size_t)width * channels;
+    int16_t *blurred = (int16_t *)malloc(span * height * sizeof(int16_t));
+    if (!blurred) {
+        fprintf(stderr, "Error: out of memory\n");
+        return false;
+    }
+    uint32_t groups    = (height + GAUSSIAN_LANES - 1) / GAUSSIAN_LANES;
+    uint32_t strips    = (uint32_t)((span + GAUSSIAN_STRIP - 1) /
+                                    GAUSSIAN_STRIP);
+    bool out_of_memory = false;
+
+#pragma omp parallel default(none)                                  \
+    shared(in, width, height, channels, out, filter, span, blurred, \
+               groups, strips, out_of_memory)
+    {
+        // Each thread filters in its own buffers
+        double *scratch = (double *)malloc(
+            (size_t)(width + GAUSSIAN_BEFORE + GAUSSIAN_AFTER) * channels *
+            GAUSSIAN_LANES * sizeof(double));
+        double *rows = (double *)malloc(5 * GAUSSIAN_STRIP * sizeof(double));
+        if (!scratch || !rows) {
+#pragma omp atomic write
+            out_of_memory = true;
+        }
+
+#pragma omp for
+        // Filter along the rows, a group of rows at a time
+        for (uint32_t g = 0; g < groups; g++) {
+            if (!scratch || !rows) continue;
+            uint32_t y     = g * GAUSSIAN_LANES;
+            uint32_t count = height - y < GAUSSIAN_LANES ? height - y
+                                                         : GAUSSIAN_LANES;
+            GaussianRows(&filter, in + y * span, width, channels, count,
+                         scratch, blurred + y * span);
+        }
+
+#pragma omp for
+        // Then down the columns, a strip at a time
+        for (uint32_t s = 0; s < strips; s++) {
+            if (!scratch || !rows) continue;
+            size_t x       = (size_t)s * GAUSSIAN_STRIP;
+            uint32_t count = span - x < GAUSSIAN_STRIP ? (uint32_t)(span - x)
+                                                       : GAUSSIAN_STRIP;
+            GaussianColumns(&filter, blurred + x, span, height, count, rows,
+                            out + x);
+        }
+
+        free(scratch);
+        free(rows);
+    }
+
+    free(blurred);
+    if (out_of_memory) {
+        fprintf(stderr, "Error: out of memory\n");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Blur an image with a Gaussian of standard deviation sigma, approximated by
+ * the recursive filter of Young and van Vliet: a causal and an anticausal
+ * pass of third order along each axis, so the cost per pixel does not depend
+ * on sigma. The image is extended beyond its edges by its edge pixels, using
+ * the boundary conditions of Triggs and Sdika. The rows are filtered eight
+ * at a time and the columns in strips, both vectorized and in parallel, in
+ * double precision with a 16-bit intermediate image.
+ *
+ * @param image     Image to blur
+ * @param sigma     Standard deviation of the Gaussian, at least 0.5
+ * @return          Blurred image, or NULL if an error occurred.
+ */
+PgmImage *GaussianBlur(const PgmImage *image, double sigma) {
+    PgmImage *new_image = AllocatePgm(image->width_, image->height_);
+    if (!new_image) return NULL;
+
+    if (!GaussianChannels(image->data_, image->width_, image->height_, 1,
+                          sigma, new_image->data_)) {
+        FreePgm(new_image);
+        return NULL;
+    }
+
+    return new_image;
+}
+
+/**
+ * Blur each channel of a color image with a Gaussian of standard deviation
+ * sigma, as in GaussianBlur.
+ *
+ * @param image     Image to blur
+ * @param sigma     Standard deviation of the Gaussian, at least 0.5
+ * @return          Blurred image, or NULL if an error occurred.
+ */
+PpmImage *PpmGaussianBlur(const PpmImage *image, double sigma) {
+    PpmImage *new_image = AllocatePpm(image->width_, image->height_);
+    if (!new_image) return NULL;
+
+    if (!GaussianChannels((const uint8_t *)image->data_, image->width_,
+                          image->height_, 3, sigma,
+                          (uint8_t *)new_image->data_)) {
+        FreePpm(new_image);
+        return NULL;
+    }
+
+    return new_image;
+}
@@ -0,0 +1,32 @@
+#ifndef NETPBM__GAUSSIAN_H_
+#define NETPBM__GAUSSIAN_H_
+
+#include "types/pgm.h"
+#include "types/ppm.h"
+
+/**
+ * Blur an image with a Gaussian of standard deviation sigma, approximated by
+ * the recursive filter of Young and van Vliet: a causal and an anticausal
+ * pass of third order along each axis, so the cost per pixel does not depend
+ * on sigma. The image is extended beyond its edges by its edge pixels, using
+ * the boundary conditions of Triggs and Sdika. The rows are filtered eight
+ * at a time and the columns in strips, both vectorized and in parallel, in
+ * double precision with a 16-bit intermediate image.
+ *
+ * @param image     Image to blur
+ * @param sigma     Standard deviation of the Gaussian, at least 0.5
+ * @return          Blurred image, or NULL if an error occurred.
+ */
+extern PgmImage *GaussianBlur(const PgmImage *image, double sigma);
+
+/**
+ * Blur each channel of a color image with a Gaussian of standard deviation
+ * sigma, as in GaussianBlur.
+ *
+ * @param image     Image to blur
+ * @param sigma     Standard deviation of the Gaussian, at least 0.5
+ * @return          Blurred image, or NULL if an error occurred.
+ */
+extern PpmImage *PpmGaussianBlur(const PpmImage *image, double sigma);
+
+#endif// NETPBM__GAUSSIAN_H_
@@ -0,0 +1,187 @@
+#include "linear.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pgm.h"
+#include "ppm.h"
+
+#if defined __AVX2__
+#include <immintrin.h>
+#endif
+
+// Size of the table used to encode linear values back to SRgb
+#define ENCODE_TABLE_SIZE 4096
+
+// Decoding and encoding tables, filled at load time
+static float linear_table[PPM_MAX_COLOR + 1];
+static uint8_t s_rgb_table[ENCODE_TABLE_SIZE];
+
+/**
+ * Fill the SRgb decoding and encoding tables.
+ */
+__attribute__((constructor)) static void InitLinearTables(void) {
+    for (uint32_t v = 0; v <= PPM_MAX_COLOR; v++)
+        linear_table[v] = (float)LinearRgbValue(v / PPM_MAX_COLOR_F);
+    for (uint32_t i = 0; i < ENCODE_TABLE_SIZE; i++) {
+        double s_rgb   = SRgbValue(i / (ENCODE_TABLE_SIZE - 1.0));
+        s_rgb_table[i] = (uint8_t)lround(s_rgb * PPM_MAX_COLOR_F);
+    }
+}
+
+/**
+ * Encode a linear value to SRgb through the encoding table.
+ *
+ * @param linear    The linear value, clamped to 0-1.
+ * @return          The SRgb value (0-255).
+ */
+static inline uint8_t EncodeSRgb(float linear) {
+    float clamped = fminf(fmaxf(linear, 0.f), 1.f);
+    return s_rgb_table[(uint32_t)(clamped * (ENCODE_TABLE_SIZE - 1) + .5f)];
+}
+
+/**
+ * Allocate memory for a linear-light image.
+ *
+ * @param width     The width of the image.
+ * @param height    The height of the image.
+ * @return          A pointer to the LinearImage, or NULL if an error occurred.
+ */
+LinearImage *AllocateLinear(uint32_t width, uint32_t height) {
+    // Allocate memory for image data
+    LinearImage *image = (LinearImage *)malloc(sizeof(LinearImage));
+    if (!image) {
+        fprintf(stderr, "Error: out of memory\n");
+        return NULL;
+    }
+    image->width_  = width;
+    image->height_ = height;
+    image->data_ =
+        (LinearPixel *)calloc((size_t)width * height, sizeof(LinearPixel));
+    if (!image->data_) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+/**
+ * Convert an SRgb PPM image to linear light.
+ *
+ * @param image     The SRgb image.
+ * @return          A pointer to the new image, or NULL if an error occurred.
+ */
+LinearImage *PpmToLinear(const PpmImage *image) {
+    LinearImage *linear = AllocateLinear(image->width_, image->height_);
+    if (!linear) return NULL;
+
+    // Every channel is decoded alike, so treat both images as flat arrays
+    const uint8_t *in = (const uint8_t *)image->data_;
+    float *out        = (float *)linear->data_;
+    size_t size       = (size_t)image->width_ * image->height_ * 3;
+    size_t chunk      = 1 << 16;
+
+#pragma omp parallel for default(none) \
+    shared(in, out, size, chunk, linear_table)
+    // Decode the channels in chunks through the table
+    for (size_t start = 0; start < size; start += chunk) {
+        size_t end = size - start < chunk ? size : start + chunk;
+        size_t i   = start;
+#if defined __AVX2__
+        for (; i + 8 <= end; i += 8) {
+            __m256i index = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((const __m128i *)(in + i)));
+            _mm256_storeu_ps(out + i,
+                             _mm256_i32gather_ps(linear_table, index, 4));
+        }
+#endif
+        for (; i < end; i++) out[i] = linear_table[in[i]];
+    }
+
+    return linear;
+}
+
+/**
+ * Convert a linear-light image to an SRgb PPM image.
+ * Values are clamped to 0-1 and encoded through a 4096-entry table, which is
+ * within one level of the exact conversion.
+ *
+ * @param image     The linear-light image.
+ * @return          A pointer to the new image, or NULL if an error occurred.
+ */
+PpmImage *LinearToPpm(const LinearImage *image) {
+    PpmImage *ppm = AllocatePpm(image->width_, image->height_);
+    if (!ppm) return NULL;
+
+    // Every channel is encoded alike, so treat both images as flat arrays
+    const float *in = (const float *)image->data_;
+    uint8_t *out    = (uint8_t *)ppm->data_;
+    size_t size     = (size_t)image->width_ * image->height_ * 3;
+
+#pragma omp parallel for default(none) shared(in, out, size)
+    // Encode the channels through the table
+    for (size_t i = 0; i < size; i++) out[i] = EncodeSRgb(in[i]);
+
+    return ppm;
+}
+
+/**
+ * Convert a linear-light image to a PGM image of its Rec. 709 luminance.
+ * The luminance is computed in floating point and quantized only once.
+ *
+ * @param image     The linear-light image.
+ * @param s_rgb     True to SRgb-encode the luminance, false to keep it linear
+ * (as error diffusion expects).
+ * @return          A pointer to the new image, or NULL if an error occurred.
+ */
+PgmImage *LinearToPgm(const LinearImage *image, bool s_rgb) {
+    PgmImage *pgm = AllocatePgm(image->width_, image->height_);
+    if (!pgm) return NULL;
+
+#pragma omp parallel for default(none) shared(image, pgm, s_rgb)
+    // Calculate the luminance of every pixel and quantize it
+    for (size_t i = 0; i < (size_t)image->width_ * image->height_; i++) {
+        const LinearPixel *p = &image->data_[i];
+        float y = .2126f * p->r_ + .7152f * p->g_ + .0722f * p->b_;
+        pgm->data_[i] =
+            s_rgb ? EncodeSRgb(y)
+                  : (uint8_t)(fminf(fmaxf(y, 0.f), 1.f) * PGM_MAX_GRAY + .5f);
+    }
+
+    return pgm;
+}
+
+/**
+ * Convert one row of SRgb PPM pixels to the luminance of their linear light,
+ * computed in floating point and quantized only once. With REC_709_WEIGHTS
+ * this matches LinearToPgm(PpmToLinear(image), false).
+ *
+ * @param pixels    The SRgb pixels of the row.
+ * @param width     The number of pixels in the row.
+ * @param weights   The luminance weights, e.g. REC_709_WEIGHTS
+ * @param out       The linear luminance of each pixel (0-255).
+ */
+void PpmToLinearLuminanceRow(const Pixel *pixels, uint32_t width,
+                             LuminanceWeights weights, uint8_t *out) {
+    float r = (float)weights.r_, g = (float)weights.g_, b = (float)weights.b_;
+    for (uint32_t x = 0; x < width; x++) {
+        float y = r * linear_table[pixels[x].r_] +
+                  g * linear_table[pixels[x].g_] +
+                  b * linear_table[pixels[x].b_];
+        out[x] = (uint8_t)(fminf(fmaxf(y, 0.f), 1.f) * PGM_MAX_GRAY + .5f);
+    }
+}
+
+/**
+ * Free memory used by a linear-light image.
+ *
+ * @param image     Image to free
+ */
+void FreeLinear(LinearImage *image) {
+    free(image->data_);
+    free(image);
+}
@@ -0,0 +1,69 @@
+#ifndef NETPBM__LINEAR_H_
+#define NETPBM__LINEAR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "types/linear.h"
+#include "types/pgm.h"
+#include "types/ppm.h"
+
+/**
+ * Allocate memory for a linear-light image.
+ *
+ * @param width     The width of the image.
+ * @param height    The height of the image.
+ * @return          A pointer to the LinearImage, or NULL if an error occurred.
+ */
+extern LinearImage *AllocateLinear(uint32_t width, uint32_t height);
+
+/**
+ * Convert an SRgb PPM image to linear light.
+ *
+ * @param image     The SRgb image.
+ * @return          A pointer to the new image, or NULL if an error occurred.
+ */
+extern LinearImage *PpmToLinear(const PpmImage *image);
+
+/**
+ * Convert a linear-light image to an SRgb PPM image.
+ * Values are clamped to 0-1 and encoded through a 4096-entry table, which is
+ * within one level of the exact conversion.
+ *
+ * @param image     The linear-light image.
+ * @return          A pointer to the new image, or NULL if an error occurred.
+ */
+extern PpmImage *LinearToPpm(const LinearImage *image);
+
+/**
+ * Convert a linear-light image to a PGM image of its Rec. 709 luminance.
+ * The luminance is computed in floating point and quantized only once.
+ *
+ * @param image     The linear-light image.
+ * @param s_rgb     True to SRgb-encode the luminance, false to keep it linear
+ * (as error diffusion expects).
+ * @return          A pointer to the new image, or NULL if an error occurred.
+ */
+extern PgmImage *LinearToPgm(const LinearImage *image, bool s_rgb);
+
+/**
+ * Convert one row of SRgb PPM pixels to the luminance of their linear light,
+ * computed in floating point and quantized only once. With REC_709_WEIGHTS
+ * this matches LinearToPgm(PpmToLinear(image), false).
+ *
+ * @param pixels    The SRgb pixels of the row.
+ * @param width     The number of pixels in the row.
+ * @param weights   The luminance weights, e.g. REC_709_WEIGHTS
+ * @param out       The linear luminance of each pixel (0-255).
+ */
+extern void PpmToLinearLuminanceRow(const Pixel *pixels, uint32_t width,
+                                    LuminanceWeights weights, uint8_t *out);
+
+/**
+ * Free memory used by a linear-light image.
+ *
+ * @param image     Image to free
+ */
+extern void FreeLinear(LinearImage *image);
+
+#endif// NETPBM__LINEAR_H_
@@ -2,6 +2,7 @@
 #include "pgm.h"
 #include "ppm.h"
 #include "sat.h"
+#include "texture.h"
 
 int main(void) {
     // Read the input image.
@@ -10,12 +11,12 @@ int main(void) {
     // Convert the image to grayscale.
     PgmImage *grayscale = PpmToPgm(image, SRgbLuminance);
 
-    // Read a threshold map.
-    PgmImage *map = ReadPgm("../textures/bayer/2x2.pgm");
+    // Look up a built-in threshold map.
+    const PgmImage *map = FindTexture(TEXTURE_BAYER, 2, 0);
 
     // Dither the image to 1-bit images.
     PbmImage *ditheredBayer = PgmToPbmOrdered(grayscale, map);
-    PbmImage *ditheredIgn   = PgmToPbm(grayscale, IgnThreshold);
+    PbmImage *ditheredIgn   = PgmToPbmIgn(grayscale, 0);
 
     // Write the dithered images to a file.
     WritePbm(ditheredBayer, "../output/lenna_bayer_2x2.pbm");
@@ -24,7 +25,6 @@ int main(void) {
     // Free the memory used by the images.
     FreePbm(ditheredIgn);
     FreePbm(ditheredBayer);
-    FreePgm(map);
     FreePgm(grayscale);
     FreePpm(image);
 
@@ -0,0 +1,238 @@
+#include "mapping.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined __unix__ || defined __APPLE__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Map a whole file into memory for reading.
+ * The mapping is advised for sequential access and prefetched. On platforms
+ * without mmap the file is read into an allocated buffer instead.
+ *
+ * @param filename  The name of the file to map.
+ * @param file      The mapping to fill in.
+ * @return          True if successful, false otherwise.
+ */
+bool MapFile(const char *filename, MappedFile *file) {
+    // Open file for reading
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open file '%s'\n", filename);
+        return false;
+    }
+
+    // Get the file size
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        fprintf(stderr, "Error: could not get size of file '%s'\n", filename);
+        close(fd);
+        return false;
+    }
+
+    // Map the file, the descriptor is no longer needed afterwards
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map file '%s'\n", filename);
+        return false;
+    }
+
+    // The pixels are consumed front to back, so ask for aggressive read-ahead
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+
+    file->data_ = (uint8_t *)data;
+    file->size_ = (size_t)st.st_size;
+    return true;
+}
+
+/**
+ * Release a mapping obtained from MapFile.
+ *
+ * @param file  The mapping to release.
+ */
+void UnmapFile(MappedFile *file) {
+    munmap(file->data_, file->size_);
+    file->data_ = NULL;
+    file->size_ = 0;
+}
+
+#else /* no mmap */
+
+bool MapFile(const char *filename, MappedFile *file) {
+    // Open file for reading
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: could not open file '%s'\n", filename);
+        return false;
+    }
+
+    // Get the file size
+    long size = -1;
+    if (fseek(fp, 0, SEEK_END) == 0) size = ftell(fp);
+    if (size <= 0 || fseek(fp, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Error: could not get size of file '%s'\n", filename);
+        fclose(fp);
+        return false;
+    }
+
+    // Read the whole file
+    file->data_ = (uint8_t *)malloc((size_t)size);
+    if (!file->data_) {
+        fprintf(stderr, "Error: out of memory\n");
+        fclose(fp);
+        return false;
+    }
+    if (fread(file->data_, 1, (size_t)size, fp) != (size_t)size) {
+        fprintf(stderr, "Error: could not read file '%s'\n", filename);
+        free(file->data_);
+        fclose(fp);
+        return false;
+    }
+    file->size_ = (size_t)size;
+
+    fclose(fp);
+    return true;
+}
+
+void UnmapFile(MappedFile *file) {
+    free(file->data_);
+    file->data_ = NULL;
+    file->size_ = 0;
+}
+
+#endif
+
+/**
+ * Skip whitespace and comments in a netpbm header.
+ *
+ * @param data  The file contents.
+ * @param size  The size of the file contents in bytes.
+ * @param pos   The current position, advanced past the skipped bytes.
+ */
+static void SkipHeaderSpace(const uint8_t *data, size_t size, size_t *pos) {
+    while (*pos < size) {
+        uint8_t c = data[*pos];
+        if (c == '#') {
+            while (*pos < size && data[*pos] != '\n' && data[*pos] != '\r')
+                (*pos)++;
+        } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n' ||
+                   c == '\v' || c == '\f') {
+            (*pos)++;
+        } else {
+            return;
+        }
+    }
+}
+
+/**
+ * Parse an unsigned decimal header field.
+ *
+ * @param data  The file contents.
+ * @param size  The size of the file contents in bytes.
+ * @param pos   The current position, advanced past the number.
+ * @param value The parsed value.
+ * @return      True if a number fitting in 32 bits was found.
+ */
+static bool ParseHeaderField(const uint8_t *data, size_t size, size_t *pos,
+                             uint32_t *value) {
+    SkipHeaderSpace(data, size, pos);
+    uint64_t result = 0;
+    size_t start    = *pos;
+    while (*pos < size && data[*pos] >= '0' && data[*pos] <= '9') {
+        result = result * 10 + (data[*pos] - '0');
+        if (result > UINT32_MAX) return false;
+        (*pos)++;
+    }
+    *value = (uint32_t)result;
+    return *pos > start;
+}
+
+/**
+ * Parse the header of a binary netpbm file (P4, P5 or P6) held in memory.
+ * Comments are skipped, and the header must be followed by exactly one
+ * whitespace character.
+ *
+ * @param data      The file contents.
+ * @param size      The size of the file contents in bytes.
+ * @param header    The header to fill in.
+ * @return          True if the header is valid, false otherwise.
+ */
+bool ParseNetpbmHeader(const uint8_t *data, size_t size,
+                       NetpbmHeader *header) {
+    // Magic number
+    if (size < 2 || data[0] != 'P' || data[1] < '4' || data[1] > '6')
+        return false;
+    header->magic_ = (char)data[1];
+    size_t pos     = 2;
+
+    // Width, height and (except for PBM) the maximum value
+    uint32_t max_value = 1;
+    if (!ParseHeaderField(data, size, &pos, &header->width_) ||
+        !ParseHeaderField(data, size, &pos, &header->height_))
+        return false;
+    if (header->magic_ != '4' &&
+        (!ParseHeaderField(data, size, &pos, &max_value) || max_value == 0 ||
+         max_value > UINT16_MAX))
+        return false;
+    header->max_value_ = (uint16_t)max_value;
+
+    // Exactly one whitespace character separates the header from the pixels
+    if (pos >= size || (data[pos] != ' ' && data[pos] != '\t' &&
+                        data[pos] != '\r' && data[pos] != '\n'))
+        return false;
+    header->offset_ = pos + 1;
+    return true;
+}
+
+/**
+ * Map a netpbm file and parse its header.
+ * Fails if the magic number differs from the expected one or if the file is
+ * too short to hold the pixel data.
+ *
+ * @param filename      The name of the file to map.
+ * @param magic         The expected format digit ('4', '5' or '6').
+ * @param sample_size   Bytes per pixel, or 0 for packed 1-bit rows.
+ * @param file          The mapping to fill in.
+ * @param header        The header to fill in.
+ * @return              True if successful, false otherwise.
+ */
+bool MapNetpbm(const char *filename, char magic, size_t sample_size,
+               MappedFile *file, NetpbmHeader *header) {
+    if (!MapFile(filename, file)) return false;
+
+    // Parse the header in place
+    if (!ParseNetpbmHeader(file->data_, file->size_, header)) {
+        fprintf(stderr, "Error: invalid header in file '%s'\n", filename);
+        UnmapFile(file);
+        return false;
+    }
+
+    // Make sure the magic number is the expected one
+    if (header->magic_ != magic) {
+        fprintf(stderr, "Error: unsupported file format in file '%s'\n",
+                filename);
+        UnmapFile(file);
+        return false;
+    }
+
+    // Make sure the whole payload is present
+    size_t width   = header->width_;
+    size_t payload = sample_size ? width * sample_size : (width + 7) / 8;
+    payload *= header->height_;
+    if (file->size_ - header->offset_ < payload) {
+        fprintf(stderr, "Error: could not read pixel data from file '%s'\n",
+                filename);
+        UnmapFile(file);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef NETPBM__MAPPING_H_
+#define NETPBM__MAPPING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "types/mapping.h"
+
+/**
+ * Map a whole file into memory for reading.
+ * The mapping is advised for sequential access and prefetched. On platforms
+ * without mmap the file is read into an allocated buffer instead.
+ *
+ * @param filename  The name of the file to map.
+ * @param file      The mapping to fill in.
+ * @return          True if successful, false otherwise.
+ */
+extern bool MapFile(const char *filename, MappedFile *file);
+
+/**
+ * Parse the header of a binary netpbm file (P4, P5 or P6) held in memory.
+ * Comments are skipped, and the header must be followed by exactly one
+ * whitespace character.
+ *
+ * @param data      The file contents.
+ * @param size      The size of the file contents in bytes.
+ * @param header    The header to fill in.
+ * @return          True if the header is valid, false otherwise.
+ */
+extern bool ParseNetpbmHeader(const uint8_t *data, size_t size,
+                              NetpbmHeader *header);
+
+/**
+ * Map a netpbm file and parse its header.
+ * Fails if the magic number differs from the expected one or if the file is
+ * too short to hold the pixel data.
+ *
+ * @param filename      The name of the file to map.
+ * @param magic         The expected format digit ('4', '5' or '6').
+ * @param sample_size   Bytes per pixel, or 0 for packed 1-bit rows.
+ * @param file          The mapping to fill in.
+ * @param header        The header to fill in.
+ * @return              True if successful, false otherwise.
+ */
+extern bool MapNetpbm(const char *filename, char magic, size_t sample_size,
+                      MappedFile *file, NetpbmHeader *header);
+
+/**
+ * Release a mapping obtained from MapFile.
+ *
+ * @param file  The mapping to release.
+ */
+extern void UnmapFile(MappedFile *file);
+
+#endif// NETPBM__MAPPING_H_
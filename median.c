@@ -0,0 +1,363 @@
+#include "median.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgm.h"
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Columns and rows per tile of the filter. The histograms of the columns of
+// a tile, and of r more on either side, stay in cache while it is filtered.
+#define MEDIAN_TILE_WIDTH 512
+#define MEDIAN_TILE_HEIGHT 512
+
+// Bins per segment of a histogram, and segments per histogram. The coarse
+// histograms count the pixels of each segment of the fine histograms.
+#define MEDIAN_BINS (PGM_MAX_GRAY + 1)
+#define MEDIAN_SEGMENT 16
+#define MEDIAN_SEGMENTS (MEDIAN_BINS / MEDIAN_SEGMENT)
+
+/**
+ * The histograms of the columns of a tile. Slot s holds column
+ * x0 - r - 1 + s, and the slots of columns outside the image stay empty.
+ */
+typedef struct {
+    uint16_t *fine_;  // MEDIAN_BINS bins per column.
+    uint16_t *coarse_;// MEDIAN_SEGMENTS bins per column.
+} ColumnHistograms;
+
+/**
+ * Add one segment of a histogram to another and take away a third.
+ *
+ * @param segment   The segment to update.
+ * @param add       The segment to add.
+ * @param remove    The segment to take away, or NULL.
+ */
+static inline void UpdateSegment(uint16_t *segment, const uint16_t *add,
+                                 const uint16_t *remove) {
+#if defined __SSE2__
+    for (int half = 0; half < 2; half++) {
+        __m128i *bins = (__m128i *)segment + half;
+        __m128i sum   = _mm_loadu_si128(bins);
+        sum = _mm_add_epi16(sum, _mm_loadu_si128((const __m128i *)add + half));
+        if (remove)
+            sum = _mm_sub_epi16(
+                sum, _mm_loadu_si128((const __m128i *)remove + half));
+        _mm_storeu_si128(bins, sum);
+    }
+#else
+    for (int i = 0; i < MEDIAN_SEGMENT; i++)
+        segment[i] += add[i] - (remove ? remove[i] : 0);
+#endif
+}
+
+/**
+ * Add a row of pixels to the histograms of their columns, or take it away.
+ *
+ * @param columns   The histograms of the columns.
+ * @param pixels    The pixels of the row, from column x0.
+ * @param count     The number of pixels.
+ * @param slot      The slot of column x0.
+ * @param remove    Whether to take the row away rather than add it.
+ */
+static void UpdateColumns(ColumnHistograms *columns, const uint8_t *pixels,
+                          uint32_t count, uint32_t slot, bool remove) {
+    // Adding 2^16 - 1 takes away one, as the bins wrap around modulo 2^16
+    uint16_t delta    = remove ? UINT16_MAX : 1;
+    uint16_t *fine    = columns->fine_ + (size_t)slot * MEDIAN_BINS;
+    uint16_t *coarse  = columns->coarse_ + (size_t)slot * MEDIAN_SEGMENTS;
+    for (uint32_t i = 0; i < count; i++) {
+        fine[(size_t)i * MEDIAN_BINS + pixels[i]] += delta;
+        coarse[(size_t)i * MEDIAN_SEGMENTS + pixels[i] / MEDIAN_SEGMENT] +=
+            delta;
+    }
+}
+
+/**
+ * The rank of a percentile among count pixels, counting from 1.
+ *
+ * @param fraction  Fraction of the pixels, between 0 and 1.
+ * @param count     The number of pixels.
+ * @return          The rank.
+ */
+static uint32_t PercentileRank(double fraction, uint32_t count) {
+    double rank = ceil(fraction * count);
+    if (rank < 1) return 1;
+    return rank < count ? (uint32_t)rank : count;
+}
+
+/**
+ * Find the bin of a segment in which the pixels of a given rank fall.
+ *
+ * @param segment   The bins of the segment.
+ * @param target    The rank, counting from 1, at most the sum of the bins.
+ * @param below     The number of pixels before the segment, to which the
+ *                  pixels in the bins before the one found are added.
+ * @return          The bin.
+ */
+static inline int SearchSegment(const uint16_t *segment, uint32_t target,
+                                uint32_t *below) {
+#if defined __SSE2__
+    // Sum each half into prefix sums, then count those below the rank
+    __m128i low  = _mm_loadu_si128((const __m128i *)segment);
+    __m128i high = _mm_loadu_si128((const __m128i *)segment + 1);
+    low          = _mm_add_epi16(low, _mm_slli_si128(low, 2));
+    high         = _mm_add_epi16(high, _mm_slli_si128(high, 2));
+    low          = _mm_add_epi16(low, _mm_slli_si128(low, 4));
+    high         = _mm_add_epi16(high, _mm_slli_si128(high, 4));
+    low          = _mm_add_epi16(low, _mm_slli_si128(low, 8));
+    high         = _mm_add_epi16(high, _mm_slli_si128(high, 8));
+    high = _mm_add_epi16(high, _mm_set1_epi16(_mm_extract_epi16(low, 7)));
+
+    // The sums fit in 16 bits, so compare them as signed after a bias
+    __m128i bias = _mm_set1_epi16(INT16_MIN);
+    __m128i rank = _mm_set1_epi16((int16_t)((target - *below) ^ 0x8000));
+    __m128i less =
+        _mm_packs_epi16(_mm_cmplt_epi16(_mm_xor_si128(low, bias), rank),
+                        _mm_cmplt_epi16(_mm_xor_si128(high, bias), rank));
+    // The sums only grow, so the bins below the rank are the lowest bits
+    int bin = __builtin_ctz(~(uint32_t)_mm_movemask_epi8(less));
+
+    uint16_t sums[MEDIAN_SEGMENT];
+    _mm_storeu_si128((__m128i *)sums, low);
+    _mm_storeu_si128((__m128i *)sums + 1, high);
+    if (bin > 0) *below += sums[bin - 1];
+    return bin;
+#else
+    int bin = 0;
+    while (*below + segment[bin] < target) *below += segment[bin++];
+    return bin;
+#endif
+}
+
+/**
+ * Filter a row of a tile. The histogram of the square is started from the
+ * column histograms at the first pixel, and then slid along the row. Only
+ * its coarse histogram is slid at every pixel; a segment of its fine
+ * histogram is brought up to date when the percentile falls in it, either
+ * by sliding it over the pixels it missed or, if that is dearer, by summing
+ * it anew.
+ *
+ * @param columns   The histograms of the columns, for the rows of the square.
+ * @param width     The width of the image.
+ * @param radius    The radius of the square.
+ * @param fraction  The fraction of the pixels below the percentile.
+ * @param rows      The number of rows of the square inside the image.
+ * @param x0        The first column of the tile.
+ * @param x1        The column after the tile.
+ * @param out       The output row.
+ */
+static void PercentileRow(const ColumnHistograms *columns, uint32_t width,
+                          uint32_t radius, double fraction, uint32_t rows,
+                          uint32_t x0, uint32_t x1, uint8_t *out) {
+    const uint16_t *fine   = columns->fine_;
+    const uint16_t *coarse = columns->coarse_;
+    uint32_t side          = 2 * radius + 1;
+
+    // The histogram of the square of the first pixel, slots 1 to 2r + 1
+    uint16_t kernel_coarse[MEDIAN_SEGMENTS] = {0};
+    uint16_t kernel_fine[MEDIAN_BINS];
+    int64_t updated[MEDIAN_SEGMENTS];// Column each segment was last slid to
+    for (uint32_t s = 1; s <= side; s++)
+        UpdateSegment(kernel_coarse, coarse + (size_t)s * MEDIAN_SEGMENTS,
+                      NULL);
+    for (int k = 0; k < MEDIAN_SEGMENTS; k++) updated[k] = (int64_t)x0 - side;
+
+    uint32_t span   = 0;
+    uint32_t target = 0;
+    for (uint32_t x = x0; x < x1; x++) {
+        // Slots of the columns entering and leaving the square
+        uint32_t enter = x - x0 + side;
+        uint32_t leave = x - x0;
+        if (x > x0) {
+            UpdateSegment(kernel_coarse,
+                          coarse + (size_t)enter * MEDIAN_SEGMENTS,
+                          coarse + (size_t)leave * MEDIAN_SEGMENTS);
+        }
+
+        // The rank only changes near the edges
+        uint32_t left  = x > radius ? x - radius : 0;
+        uint32_t right = width - 1 - x > radius ? x + radius : width - 1;
+        if (right - left + 1 != span) {
+            span   = right - left + 1;
+            target = PercentileRank(fraction, rows * span);
+        }
+
+        // Find the segment of the percentile
+        uint32_t below = 0;
+        int k          = SearchSegment(kernel_coarse, target, &below);
+
+        // Bring its fine histogram up to date
+        uint16_t *segment = kernel_fine + k * MEDIAN_SEGMENT;
+        int64_t behind    = (int64_t)x - updated[k];
+        if (2 * behind > (int64_t)side) {
+            memset(segment, 0, MEDIAN_SEGMENT * sizeof(uint16_t));
+            for (uint32_t s = leave + 1; s <= enter; s++)
+                UpdateSegment(segment,
+                              fine + (size_t)s * MEDIAN_BINS +
+                                  k * MEDIAN_SEGMENT,
+                              NULL);
+        } else {
+            for (uint32_t s = leave + 1 - (uint32_t)behind; s <= leave; s++)
+                UpdateSegment(segment,
+                              fine + (size_t)(s + side) * MEDIAN_BINS +
+                                  k * MEDIAN_SEGMENT,
+                              fine + (size_t)s * MEDIAN_BINS +
+                                  k * MEDIAN_SEGMENT);
+        }
+        updated[k] = x;
+
+        // Find the bin of the percentile within the segment
+        int j  = SearchSegment(segment, target, &below);
+        out[x] = (uint8_t)(k * MEDIAN_SEGMENT + j);
+    }
+}
+
+/**
+ * Filter a tile, sliding the column histograms down its rows.
+ *
+ * @param image     The image.
+ * @param radius    The radius of the square.
+ * @param fraction  The fraction of the pixels below the percentile.
+ * @param x0        The first column of the tile.
+ * @param y0        The first row of the tile.
+ * @param columns   Room for the histograms of MEDIAN_TILE_WIDTH + 2r + 1
+ *                  columns.
+ * @param out       The filtered image.
+ */
+static void PercentileTile(const PgmImage *image, uint32_t radius,
+                           double fraction, uint32_t x0, uint32_t y0,
+                           ColumnHistograms *columns, uint8_t *out) {
+    uint32_t width  = image->width_;
+    uint32_t height = image->height_;
+    uint32_t x1 =
+        width - x0 < MEDIAN_TILE_WIDTH ? width : x0 + MEDIAN_TILE_WIDTH;
+    uint32_t y1 =
+        height - y0 < MEDIAN_TILE_HEIGHT ? height : y0 + MEDIAN_TILE_HEIGHT;
+    uint32_t slots = x1 - x0 + 2 * radius + 1;
+    memset(columns->fine_, 0, (size_t)slots * MEDIAN_BINS * sizeof(uint16_t));
+    memset(columns->coarse_, 0,
+           (size_t)slots * MEDIAN_SEGMENTS * sizeof(uint16_t));
+
+    // Columns inside the image that the squares of the tile reach
+    uint32_t start = x0 > radius ? x0 - radius : 0;
+    uint32_t end   = width - x1 > radius ? x1 + radius : width;
+    uint32_t slot  = start + radius + 1 - x0;
+    const uint8_t *pixels = image->data_ + start;
+
+    // Start with the rows of the square of the first row
+    uint32_t top    = y0 > radius ? y0 - radius : 0;
+    uint32_t bottom = height - 1 - y0 > radius ? y0 + radius : height - 1;
+    for (uint32_t y = top; y <= bottom; y++)
+        UpdateColumns(columns, pixels + (size_t)y * width, end - start, slot,
+                      false);
+
+    // Then slide the square down a row at a time
+    for (uint32_t y = y0; y < y1; y++) {
+        if (y > y0) {
+            if (bottom < height - 1) {
+                bottom++;
+                UpdateColumns(columns, pixels + (size_t)bottom * width,
+                              end - start, slot, false);
+            }
+            if (y > radius) {
+                UpdateColumns(columns, pixels + (size_t)top * width,
+                              end - start, slot, true);
+                top++;
+            }
+        }
+        PercentileRow(columns, width, radius, fraction, bottom - top + 1, x0,
+                      x1, out + (size_t)y * width);
+    }
+}
+
+/**
+ * Each pixel becomes a percentile of the pixels in a square surrounding that
+ * pixel with side 2r + 1, counting only the pixels inside the image: the
+ * smallest value that at least the given fraction of them are less than or
+ * equal to. This uses the constant-time algorithm of Perreault and Hebert,
+ * which slides a histogram of the square along each row by adding and
+ * removing histograms of whole columns, so the cost per pixel does not
+ * depend on r. The image is split into tiles that are filtered in parallel,
+ * each thread keeping the column histograms of its tile in cache.
+ *
+ * @param image     Image to filter
+ * @param radius    Radius of the square
+ * @param fraction  Fraction of the pixels, between 0 and 1
+ * @return          Filtered image, or NULL if an error occurred.
+ */
+PgmImage *PercentileFilter(const PgmImage *image, int8_t radius,
+                           double fraction) {
+    if (radius < 0) {
+        fprintf(stderr, "Error: negative filter radius %d\n", radius);
+        return NULL;
+    }
+    if (!(fraction >= 0 && fraction <= 1)) {
+        fprintf(stderr, "Error: percentile fraction %g is not in [0, 1]\n",
+                fraction);
+        return NULL;
+    }
+
+    uint32_t width      = image->width_;
+    uint32_t height     = image->height_;
+    uint32_t r          = (uint32_t)radius;
+    uint32_t slots      = MEDIAN_TILE_WIDTH + 2 * r + 1;
+    bool out_of_memory  = false;
+    PgmImage *new_image = AllocatePgm(width, height);
+    if (!new_image) return NULL;
+
+#pragma omp parallel default(none) \
+    shared(image, new_image, width, height, r, slots, fraction, out_of_memory)
+    {
+        // Each thread keeps the column histograms of its tiles
+        ColumnHistograms columns = {
+            (uint16_t *)malloc((size_t)slots * MEDIAN_BINS * sizeof(uint16_t)),
+            (uint16_t *)malloc((size_t)slots * MEDIAN_SEGMENTS *
+                               sizeof(uint16_t)),
+        };
+        if (!columns.fine_ || !columns.coarse_) {
+#pragma omp atomic write
+            out_of_memory = true;
+        }
+
+#pragma omp for collapse(2)
+        // Filter a tile at a time
+        for (uint32_t y0 = 0; y0 < height; y0 += MEDIAN_TILE_HEIGHT) {
+            for (uint32_t x0 = 0; x0 < width; x0 += MEDIAN_TILE_WIDTH) {
+                if (!columns.fine_ || !columns.coarse_) continue;
+                PercentileTile(image, r, fraction, x0, y0, &columns,
+                               new_image->data_);
+            }
+        }
+
+        free(columns.fine_);
+        free(columns.coarse_);
+    }
+
+    if (out_of_memory) {
+        fprintf(stderr, "Error: out of memory\n");
+        FreePgm(new_image);
+        return NULL;
+    }
+
+    return new_image;
+}
+
+/**
+ * Each pixel becomes the median of the pixels in a square surrounding that
+ * pixel with side 2r + 1, as in PercentileFilter.
+ *
+ * @param image     Image to filter
+ * @param radius    Radius of the square
+ * @return          Filtered image, or NULL if an error occurred.
+ */
+PgmImage *MedianFilter(const PgmImage *image, int8_t radius) {
+    return PercentileFilter(image, radius, 0.5);
+}
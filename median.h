@@ -0,0 +1,36 @@
+#ifndef NETPBM__MEDIAN_H_
+#define NETPBM__MEDIAN_H_
+
+#include <stdint.h>
+
+#include "types/pgm.h"
+
+/**
+ * Each pixel becomes a percentile of the pixels in a square surrounding that
+ * pixel with side 2r + 1, counting only the pixels inside the image: the
+ * smallest value that at least the given fraction of them are less than or
+ * equal to. This uses the constant-time algorithm of Perreault and Hebert,
+ * which slides a histogram of the square along each row by adding and
+ * removing histograms of whole columns, so the cost per pixel does not
+ * depend on r. The image is split into tiles that are filtered in parallel,
+ * each thread keeping the column histograms of its tile in cache.
+ *
+ * @param image     Image to filter
+ * @param radius    Radius of the square
+ * @param fraction  Fraction of the pixels, between 0 and 1
+ * @return          Filtered image, or NULL if an error occurred.
+ */
+extern PgmImage *PercentileFilter(const PgmImage *image, int8_t radius,
+                                  double fraction);
+
+/**
+ * Each pixel becomes the median of the pixels in a square surrounding that
+ * pixel with side 2r + 1, as in PercentileFilter.
+ *
+ * @param image     Image to filter
+ * @param radius    Radius of the square
+ * @return          Filtered image, or NULL if an error occurred.
+ */
+extern PgmImage *MedianFilter(const PgmImage *image, int8_t radius);
+
+#endif// NETPBM__MEDIAN_H_
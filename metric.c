@@ -0,0 +1,414 @@
+#include "metric.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pbm.h"
+
+// Rows per band of the windowed metrics. Each band sets up its column sums
+// anew, which costs 2r + 1 rows.
+#define METRIC_BAND_ROWS 256
+
+// Stabilising constants of SSIM, for a dynamic range of PGM_MAX_GRAY
+#define SSIM_C1 (0.01 * PGM_MAX_GRAY_F * 0.01 * PGM_MAX_GRAY_F)
+#define SSIM_C2 (0.03 * PGM_MAX_GRAY_F * 0.03 * PGM_MAX_GRAY_F)
+
+/**
+ * The sums over the rows of a window of each column of two images.
+ */
+typedef struct {
+    uint32_t *a_;    // The sums of the pixels of the first image.
+    uint32_t *b_;    // The sums of the pixels of the second image.
+    uint32_t *aa_;   // The sums of the squared pixels of the first image.
+    uint32_t *bb_;   // The sums of the squared pixels of the second image.
+    uint32_t *ab_;   // The sums of the products of the pixels.
+    uint8_t *pixels_;// A row of the first image, if it must be unpacked.
+} WindowColumns;
+
+/**
+ * Two images to compare over windows: the first is either a PBM or a PGM
+ * image, the second a PGM image of the same size.
+ */
+typedef struct {
+    const PbmImage *pbm_;   // The first image if it is a PBM image, or NULL.
+    const PgmImage *pgm_;   // The first image if it is a PGM image, or NULL.
+    const PgmImage *source_;// The second image.
+    uint8_t radius_;        // The radius of the windows.
+    bool ssim_;             // Whether to calculate SSIM, not blurred error.
+} WindowMetric;
+
+/**
+ * Check that two images have the same size.
+ *
+ * @param width1    Width of the first image
+ * @param height1   Height of the first image
+ * @param image2    Second image
+ * @return          True if the sizes are equal, false otherwise
+ */
+static bool SameSize(uint32_t width1, uint32_t height1,
+                     const PgmImage *image2) {
+    if (width1 != image2->width_ || height1 != image2->height_) {
+        fprintf(stderr, "Error: images of size %ux%u and %ux%u differ\n",
+                width1, height1, image2->width_, image2->height_);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Calculate the mean squared error between two images of the same size, in
+ * one parallel pass without a difference image.
+ *
+ * @param image1    First image
+ * @param image2    Second image
+ * @return          Mean squared difference of the pixels, or NaN if the
+ *                  images differ in size
+ */
+double PgmMse(const PgmImage *image1, const PgmImage *image2) {
+    if (!SameSize(image1->width_, image1->height_, image2)) return NAN;
+
+    size_t size    = (size_t)image1->width_ * image1->height_;
+    uint64_t total = 0;
+
+#pragma omp parallel for default(none) shared(image1, image2, size) \
+    reduction(+ : total)
+    // Sum the squared differences
+    for (size_t i = 0; i < size; i++) {
+        int32_t difference = image1->data_[i] - image2->data_[i];
+        total += (uint32_t)(difference * difference);
+    }
+
+    return size ? (double)total / (double)size : 0;
+}
+
+/**
+ * Calculate the peak signal-to-noise ratio between two images of the same
+ * size, from their mean squared error.
+ *
+ * @param image1    First image
+ * @param image2    Second image
+ * @return          PSNR in decibels, infinite if the images are equal, or NaN
+ *                  if they differ in size
+ */
+double PgmPsnr(const PgmImage *image1, const PgmImage *image2) {
+    double mse = PgmMse(image1, image2);
+    if (mse == 0) return INFINITY;
+
+    return 10 * log10(PGM_MAX_GRAY_F * PGM_MAX_GRAY_F / mse);
+}
+
+/**
+ * Get a row of the first image of a metric, unpacking it if it is a PBM
+ * image.
+ *
+ * @param metric    The images to compare
+ * @param columns   The column sums, whose row buffer to unpack into
+ * @param y         The row
+ * @return          The pixels of the row
+ */
+static const uint8_t *FirstRow(const WindowMetric *metric,
+                               const WindowColumns *columns, uint32_t y) {
+    if (metric->pgm_) {
+        return metric->pgm_->data_ + (size_t)y * metric->pgm_->width_;
+    }
+
+    const PbmImage *pbm = metric->pbm_;
+    UnpackPbmRow(pbm->data_ + (size_t)y * pbm->stride_, pbm->width_,
+                 columns->pixels_);
+    for (uint32_t x = 0; x < pbm->width_; x++)
+        columns->pixels_[x] = columns->pixels_[x] ? 0 : PGM_MAX_GRAY;
+
+    return columns->pixels_;
+}
+
+/**
+ * Add a row of both images to the column sums, or take it away.
+ *
+ * @param metric    The images to compare
+ * @param columns   The column sums
+ * @param y         The row
+ * @param remove    Whether to take the row away rather than add it
+ */
+static void UpdateColumns(const WindowMetric *metric, WindowColumns *columns,
+                          uint32_t y, bool remove) {
+    uint32_t width   = metric->source_->width_;
+    const uint8_t *a = FirstRow(metric, columns, y);
+    const uint8_t *b = metric->source_->data_ + (size_t)y * width;
+
+    // Multiplying by 2^32 - 1 negates, as the sums wrap around modulo 2^32
+    uint32_t sign = remove ? UINT32_MAX : 1;
+    uint32_t *restrict sum_a = columns->a_;
+    uint32_t *restrict sum_b = columns->b_;
+    for (uint32_t x = 0; x < width; x++) {
+        sum_a[x] += sign * a[x];
+        sum_b[x] += sign * b[x];
+    }
+    if (!metric->ssim_) return;
+
+    uint32_t *restrict sum_aa = columns->aa_;
+    uint32_t *restrict sum_bb = columns->bb_;
+    uint32_t *restrict sum_ab = columns->ab_;
+    for (uint32_t x = 0; x < width; x++) {
+        sum_aa[x] += sign * a[x] * a[x];
+        sum_bb[x] += sign * b[x] * b[x];
+        sum_ab[x] += sign * a[x] * b[x];
+    }
+}
+
+/**
+ * Sum the metric over a row, sliding the window along the column sums.
+ *
+ * @param metric    The images to compare
+ * @param columns   The column sums of the rows of the window
+ * @param rows      The number of rows of the window
+ * @return          The sum of the metric over the row
+ */
+static double WindowRow(const WindowMetric *metric,
+                        const WindowColumns *columns, uint32_t rows) {
+    uint32_t width  = metric->source_->width_;
+    uint32_t radius = metric->radius_;
+    uint64_t a = 0, b = 0, aa = 0, bb = 0, ab = 0;
+    double total = 0;
+
+    // The reciprocal of the area of the window, which only changes near the
+    // edges
+    uint32_t span = 0;
+    double scale  = 0;
+
+    // Fill the window of the first pixel
+    for (uint32_t x = 0; x <= radius && x < width; x++) {
+        a += columns->a_[x];
+        b += columns->b_[x];
+        if (metric->ssim_) {
+            aa += columns->aa_[x];
+            bb += columns->bb_[x];
+            ab += columns->ab_[x];
+        }
+    }
+
+    for (uint32_t x = 0; x < width; x++) {
+        uint32_t left  = x > radius ? x - radius : 0;
+        uint32_t right = width - 1 - x > radius ? x + radius : width - 1;
+        if (right - left + 1 != span) {
+            span  = right - left + 1;
+            scale = 1 / ((double)rows * span);
+        }
+
+        if (metric->ssim_) {
+            double mean_a     = (double)a * scale;
+            double mean_b     = (double)b * scale;
+            double variance_a = (double)aa * scale - mean_a * mean_a;
+            double variance_b = (double)bb * scale - mean_b * mean_b;
+            double covariance = (double)ab * scale - mean_a * mean_b;
+            total += (2 * mean_a * mean_b + SSIM_C1) *
+                     (2 * covariance + SSIM_C2) /
+                     ((mean_a * mean_a + mean_b * mean_b + SSIM_C1) *
+                      (variance_a + variance_b + SSIM_C2));
+        } else {
+            double difference = (double)((int64_t)a - (int64_t)b) * scale;
+            total += difference * difference;
+        }
+
+        // Slide the window one column to the right
+        if (right < width - 1 && right - x == radius) {
+            a += columns->a_[right + 1];
+            b += columns->b_[right + 1];
+            if (metric->ssim_) {
+                aa += columns->aa_[right + 1];
+                bb += columns->bb_[right + 1];
+                ab += columns->ab_[right + 1];
+            }
+        }
+        if (x >= radius) {
+            a -= columns->a_[left];
+            b -= columns->b_[left];
+            if (metric->ssim_) {
+                aa -= columns->aa_[left];
+                bb -= columns->bb_[left];
+                ab -= columns->ab_[left];
+            }
+        }
+    }
+
+    return total;
+}
+
+/**
+ * Sum the metric over a band of rows, sliding the window down the rows.
+ *
+ * @param metric    The images to compare
+ * @param columns   The column sums, which the band starts by clearing
+ * @param y0        The first row of the band
+ * @param y1        The row after the band
+ * @return          The sum of the metric over the band
+ */
+static double WindowBand(const WindowMetric *metric, WindowColumns *columns,
+                         uint32_t y0, uint32_t y1) {
+    uint32_t width  = metric->source_->width_;
+    uint32_t height = metric->source_->height_;
+    uint32_t radius = metric->radius_;
+    uint32_t planes = metric->ssim_ ? 5 : 2;
+    for (size_t i = 0; i < (size_t)planes * width; i++) columns->a_[i] = 0;
+
+    // Fill the window of the first row
+    uint32_t top    = y0 > radius ? y0 - radius : 0;
+    uint32_t bottom = height - 1 - y0 > radius ? y0 + radius : height - 1;
+    for (uint32_t y = top; y <= bottom; y++)
+        UpdateColumns(metric, columns, y, false);
+
+    double total = 0;
+    for (uint32_t y = y0; y < y1; y++) {
+        if (y > y0) {
+            // Slide the window one row down
+            if (bottom < height - 1 && bottom - (y - 1) == radius) {
+                UpdateColumns(metric, columns, ++bottom, false);
+            }
+            if (y - 1 >= radius) UpdateColumns(metric, columns, top++, true);
+        }
+        total += WindowRow(metric, columns, bottom - top + 1);
+    }
+
+    return total;
+}
+
+/**
+ * Average a windowed metric over all pixels. Bands of rows are processed in
+ * parallel, each thread with its own column sums.
+ *
+ * @param metric    The images to compare
+ * @return          The mean of the metric, or NaN if an error occurred
+ */
+static double MeanWindowMetric(const WindowMetric *metric) {
+    uint32_t width     = metric->source_->width_;
+    uint32_t height    = metric->source_->height_;
+    uint32_t bands     = (height + METRIC_BAND_ROWS - 1) / METRIC_BAND_ROWS;
+    uint32_t planes    = metric->ssim_ ? 5 : 2;
+    double total       = 0;
+    bool out_of_memory = false;
+
+#pragma omp parallel default(none) \
+    shared(metric, width, height, bands, planes, total, out_of_memory)
+    {
+        // The column sums are contiguous, so that they are cleared at once
+        WindowColumns columns = {NULL};
+        columns.a_ = (uint32_t *)malloc((size_t)planes * width *
+                                        sizeof(uint32_t));
+        if (metric->pbm_) columns.pixels_ = (uint8_t *)malloc(width);
+        if (!columns.a_ || (metric->pbm_ && !columns.pixels_)) {
+#pragma omp atomic write
+            out_of_memory = true;
+        } else {
+            columns.b_ = columns.a_ + width;
+            if (metric->ssim_) {
+                columns.aa_ = columns.b_ + width;
+                columns.bb_ = columns.aa_ + width;
+                columns.ab_ = columns.bb_ + width;
+            }
+        }
+
+#pragma omp for reduction(+ : total)
+        // Sum the metric over each band
+        for (uint32_t b = 0; b < bands; b++) {
+            if (!columns.b_) continue;
+            uint32_t y0 = b * METRIC_BAND_ROWS;
+            uint32_t y1 = height - y0 < METRIC_BAND_ROWS
+                              ? height
+                              : y0 + METRIC_BAND_ROWS;
+            total += WindowBand(metric, &columns, y0, y1);
+        }
+
+        free(columns.a_);
+        free(columns.pixels_);
+    }
+
+    if (out_of_memory) {
+        fprintf(stderr, "Error: out of memory\n");
+        return NAN;
+    }
+    if (!width || !height) return metric->ssim_ ? 1 : 0;
+
+    return total / ((double)width * height);
+}
+
+/**
+ * Calculate the mean squared error between two images after blurring both
+ * with a box of side 2r + 1, clamped at the edges as in BoxBlur, which
+ * approximates how different they look from a distance. The box sums are
+ * kept as rolling sums of the columns, so neither blurred image is stored.
+ *
+ * @param image1    First image
+ * @param image2    Second image
+ * @param radius    Radius of the box
+ * @return          Mean squared difference of the blurred pixels, or NaN if
+ *                  the images differ in size or an error occurred
+ */
+double PgmBlurredError(const PgmImage *image1, const PgmImage *image2,
+                       uint8_t radius) {
+    if (!SameSize(image1->width_, image1->height_, image2)) return NAN;
+
+    WindowMetric metric = {NULL, image1, image2, radius, false};
+    return MeanWindowMetric(&metric);
+}
+
+/**
+ * Calculate the blurred error, as in PgmBlurredError, between a dithered
+ * image and its source, with black pixels taken as 0 and white pixels as
+ * PGM_MAX_GRAY. The rows of the dithered image are unpacked as they are
+ * needed.
+ *
+ * @param image     Dithered image
+ * @param source    Image it was dithered from
+ * @param radius    Radius of the box
+ * @return          Mean squared difference of the blurred pixels, or NaN if
+ *                  the images differ in size or an error occurred
+ */
+double PbmBlurredError(const PbmImage *image, const PgmImage *source,
+                       uint8_t radius) {
+    if (!SameSize(image->width_, image->height_, source)) return NAN;
+
+    WindowMetric metric = {image, NULL, source, radius, false};
+    return MeanWindowMetric(&metric);
+}
+
+/**
+ * Calculate the mean structural similarity (SSIM) of two images over a box
+ * window of side 2r + 1 around each pixel, clamped at the edges. The local
+ * means, variances and covariance come from rolling sums of the columns, so
+ * the cost per pixel does not depend on the radius and each thread needs
+ * memory only for a few rows.
+ *
+ * @param image1    First image
+ * @param image2    Second image
+ * @param radius    Radius of the window
+ * @return          Mean SSIM, 1 for equal images, or NaN if the images differ
+ *                  in size or an error occurred
+ */
+double PgmSsim(const PgmImage *image1, const PgmImage *image2,
+               uint8_t radius) {
+    if (!SameSize(image1->width_, image1->height_, image2)) return NAN;
+
+    WindowMetric metric = {NULL, image1, image2, radius, true};
+    return MeanWindowMetric(&metric);
+}
+
+/**
+ * Calculate the mean structural similarity, as in PgmSsim, between a
+ * dithered image and its source, with black pixels taken as 0 and white
+ * pixels as PGM_MAX_GRAY.
+ *
+ * @param image     Dithered image
+ * @param source    Image it was dithered from
+ * @param radius    Radius of the window
+ * @return          Mean SSIM, or NaN if the images differ in size or an error
+ *                  occurred
+ */
+double PbmSsim(const PbmImage *image, const PgmImage *source, uint8_t radius) {
+    if (!SameSize(image->width_, image->height_, source)) return NAN;
+
+    WindowMetric metric = {image, NULL, source, radius, true};
+    return MeanWindowMetric(&metric);
+}
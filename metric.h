@@ -0,0 +1,91 @@
+#ifndef NETPBM__METRIC_H_
+#define NETPBM__METRIC_H_
+
+#include <stdint.h>
+
+#include "types/pbm.h"
+#include "types/pgm.h"
+
+/**
+ * Calculate the mean squared error between two images of the same size, in
+ * one parallel pass without a difference image.
+ *
+ * @param image1    First image
+ * @param image2    Second image
+ * @return          Mean squared difference of the pixels, or NaN if the
+ *                  images differ in size
+ */
+extern double PgmMse(const PgmImage *image1, const PgmImage *image2);
+
+/**
+ * Calculate the peak signal-to-noise ratio between two images of the same
+ * size, from their mean squared error.
+ *
+ * @param image1    First image
+ * @param image2    Second image
+ * @return          PSNR in decibels, infinite if the images are equal, or NaN
+ *                  if they differ in size
+ */
+extern double PgmPsnr(const PgmImage *image1, const PgmImage *image2);
+
+/**
+ * Calculate the mean squared error between two images after blurring both
+ * with a box of side 2r + 1, clamped at the edges as in BoxBlur, which
+ * approximates how different they look from a distance. The box sums are
+ * kept as rolling sums of the columns, so neither blurred image is stored.
+ *
+ * @param image1    First image
+ * @param image2    Second image
+ * @param radius    Radius of the box
+ * @return          Mean squared difference of the blurred pixels, or NaN if
+ *                  the images differ in size or an error occurred
+ */
+extern double PgmBlurredError(const PgmImage *image1, const PgmImage *image2,
+                              uint8_t radius);
+
+/**
+ * Calculate the blurred error, as in PgmBlurredError, between a dithered
+ * image and its source, with black pixels taken as 0 and white pixels as
+ * PGM_MAX_GRAY. The rows of the dithered image are unpacked as they are
+ * needed.
+ *
+ * @param image     Dithered image
+ * @param source    Image it was dithered from
+ * @param radius    Radius of the box
+ * @return          Mean squared difference of the blurred pixels, or NaN if
+ *                  the images differ in size or an error occurred
+ */
+extern double PbmBlurredError(const PbmImage *image, const PgmImage *source,
+                              uint8_t radius);
+
+/**
+ * Calculate the mean structural similarity (SSIM) of two images over a box
+ * window of side 2r + 1 around each pixel, clamped at the edges. The local
+ * means, variances and covariance come from rolling sums of the columns, so
+ * the cost per pixel does not depend on the radius and each thread needs
+ * memory only for a few rows.
+ *
+ * @param image1    First image
+ * @param image2    Second image
+ * @param radius    Radius of the window
+ * @return          Mean SSIM, 1 for equal images, or NaN if the images differ
+ *                  in size or an error occurred
+ */
+extern double PgmSsim(const PgmImage *image1, const PgmImage *image2,
+                      uint8_t radius);
+
+/**
+ * Calculate the mean structural similarity, as in PgmSsim, between a
+ * dithered image and its source, with black pixels taken as 0 and white
+ * pixels as PGM_MAX_GRAY.
+ *
+ * @param image     Dithered image
+ * @param source    Image it was dithered from
+ * @param radius    Radius of the window
+ * @return          Mean SSIM, or NaN if the images differ in size or an error
+ *                  occurred
+ */
+extern double PbmSsim(const PbmImage *image, const PgmImage *source,
+                      uint8_t radius);
+
+#endif// NETPBM__METRIC_H_
@@ -0,0 +1,536 @@
+#include "noise.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pbm.h"
+#include "pgm.h"
+
+#if defined __unix__ || defined __APPLE__
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Standard deviation of the Gaussian energy filter, in pixels
+#define BLUE_NOISE_SIGMA 1.5
+// Distance up to which a pixel adds to the energy of the pixels around it
+#define BLUE_NOISE_RADIUS 6
+#define BLUE_NOISE_SIDE (2 * BLUE_NOISE_RADIUS + 1)
+// Fixed-point scale of the energy, so that updates are exact
+#define BLUE_NOISE_SCALE 65536.0
+// Share of the pixels set in the initial pattern, in 1/256ths
+#define BLUE_NOISE_DENSITY 26
+// Version of the generator, part of the cache key
+#define BLUE_NOISE_VERSION 1
+
+// The Gaussian energy filter, in fixed point
+static int32_t gaussian[BLUE_NOISE_SIDE * BLUE_NOISE_SIDE];
+
+/**
+ * Fill the Gaussian energy filter.
+ */
+__attribute__((constructor)) static void InitGaussian(void) {
+    for (int dy = -BLUE_NOISE_RADIUS; dy <= BLUE_NOISE_RADIUS; dy++) {
+        for (int dx = -BLUE_NOISE_RADIUS; dx <= BLUE_NOISE_RADIUS; dx++) {
+            double r2 = dx * dx + dy * dy;
+            gaussian[(dy + BLUE_NOISE_RADIUS) * BLUE_NOISE_SIDE + dx +
+                     BLUE_NOISE_RADIUS] = (int32_t)lround(
+                exp(-r2 / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA)) *
+                BLUE_NOISE_SCALE);
+        }
+    }
+}
+
+// Side of the square tiles of pixels whose leaves are kept together, so that
+// the nodes above a changed window share cache lines
+#define BLUE_NOISE_TILE 16
+// Most runs of leaves changed when a pixel is toggled: at most 4 per row, as
+// the window wraps around the right edge and crosses tiles
+#define BLUE_NOISE_RUNS (4 * BLUE_NOISE_SIDE)
+
+// A node of a tree that picks the pixel of highest key, the lowest pixel on
+// ties: the key in the high half and the complement of the pixel in the low
+// half, so that nodes compare as integers
+typedef int64_t TreeNode;
+
+// A node without a pixel
+#define NO_NODE INT64_MIN
+
+/**
+ * A binary pattern being ranked by the void-and-cluster method.
+ */
+typedef struct {
+    uint32_t width_;   // The width of the pattern.
+    uint32_t height_;  // The height of the pattern.
+    uint32_t tiles_;   // The number of tiles per row of the pattern.
+    uint32_t leaves_;  // The number of leaves of the trees, a power of two.
+    uint8_t *set_;     // 1 for the set pixels, 0 for the others.
+    int32_t *energy_;  // The energy of each pixel.
+    TreeNode *cluster_;// Tree of the set pixels, keyed on their energy.
+    TreeNode *void_;   // Tree of the unset pixels, keyed on minus their
+                       // energy.
+} BinaryPattern;
+
+/**
+ * Free a binary pattern.
+ *
+ * @param pattern   The pattern to free.
+ */
+static void FreePattern(BinaryPattern *pattern) {
+    free(pattern->set_);
+    free(pattern->energy_);
+    free(pattern->cluster_);
+    free(pattern->void_);
+}
+
+/**
+ * Allocate the arrays of a binary pattern.
+ *
+ * @param pattern   The pattern, with its width and height set.
+ * @return          True if successful, false otherwise.
+ */
+static bool AllocatePattern(BinaryPattern *pattern) {
+    size_t pixels   = (size_t)pattern->width_ * pattern->height_;
+    uint32_t rows   = (pattern->height_ + BLUE_NOISE_TILE - 1) /
+                      BLUE_NOISE_TILE;
+    pattern->tiles_ = (pattern->width_ + BLUE_NOISE_TILE - 1) /
+                      BLUE_NOISE_TILE;
+    size_t tiled    = (size_t)pattern->tiles_ * rows * BLUE_NOISE_TILE *
+                      BLUE_NOISE_TILE;
+    pattern->leaves_ = 1;
+    while (pattern->leaves_ < tiled) pattern->leaves_ *= 2;
+    pattern->set_     = (uint8_t *)malloc(pixels);
+    pattern->energy_  = (int32_t *)malloc(pixels * sizeof(int32_t));
+    pattern->cluster_ =
+        (TreeNode *)malloc(2 * (size_t)pattern->leaves_ * sizeof(TreeNode));
+    pattern->void_ =
+        (TreeNode *)malloc(2 * (size_t)pattern->leaves_ * sizeof(TreeNode));
+    if (!pattern->set_ || !pattern->energy_ || !pattern->cluster_ ||
+        !pattern->void_) {
+        fprintf(stderr, "Error: out of memory\n");
+        FreePattern(pattern);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Copy a binary pattern into one of the same size.
+ *
+ * @param dst   The pattern to copy to.
+ * @param src   The pattern to copy.
+ */
+static void CopyPattern(BinaryPattern *dst, const BinaryPattern *src) {
+    size_t pixels = (size_t)src->width_ * src->height_;
+    size_t nodes  = 2 * (size_t)src->leaves_;
+    memcpy(dst->set_, src->set_, pixels);
+    memcpy(dst->energy_, src->energy_, pixels * sizeof(int32_t));
+    memcpy(dst->cluster_, src->cluster_, nodes * sizeof(TreeNode));
+    memcpy(dst->void_, src->void_, nodes * sizeof(TreeNode));
+}
+
+/**
+ * Make the node of a pixel.
+ *
+ * @param key       The key of the pixel.
+ * @param pixel     The pixel.
+ * @return          The node.
+ */
+static inline TreeNode MakeNode(int32_t key, uint32_t pixel) {
+    return (TreeNode)((uint64_t)(int64_t)key << 32 | (uint32_t)~pixel);
+}
+
+/**
+ * Get the pixel of a node.
+ *
+ * @param node  The node.
+ * @return      The pixel.
+ */
+static inline uint32_t NodePixel(TreeNode node) {
+    return ~(uint32_t)node;
+}
+
+/**
+ * Pick the node of higher key, the one of the lower pixel on ties.
+ *
+ * @param a     A node.
+ * @param b     A node.
+ * @return      The node of higher key.
+ */
+static inline TreeNode HigherNode(TreeNode a, TreeNode b) {
+    return b > a ? b : a;
+}
+
+/**
+ * Get the leaf of a pixel, with the pixels of each tile stored together.
+ *
+ * @param pattern   The pattern.
+ * @param x         The column of the pixel.
+ * @param y         The row of the pixel.
+ * @return          The index of its leaf, from 0.
+ */
+static inline uint32_t PixelLeaf(const BinaryPattern *pattern, uint32_t x,
+                                 uint32_t y) {
+    uint32_t tile = y / BLUE_NOISE_TILE * pattern->tiles_ + x / BLUE_NOISE_TILE;
+    return tile * BLUE_NOISE_TILE * BLUE_NOISE_TILE +
+           y % BLUE_NOISE_TILE * BLUE_NOISE_TILE + x % BLUE_NOISE_TILE;
+}
+
+/**
+ * Set the leaves of a pixel in both trees.
+ *
+ * @param pattern   The pattern.
+ * @param pixel     The pixel.
+ * @param leaf      The index of its leaf, from 0.
+ */
+static inline void SetLeaves(BinaryPattern *pattern, uint32_t pixel,
+                             uint32_t leaf) {
+    int32_t energy = pattern->energy_[pixel];
+    bool set       = pattern->set_[pixel];
+    pattern->cluster_[pattern->leaves_ + leaf] =
+        set ? MakeNode(energy, pixel) : NO_NODE;
+    pattern->void_[pattern->leaves_ + leaf] =
+        set ? NO_NODE : MakeNode(-energy, pixel);
+}
+
+/**
+ * Wrap a coordinate around an edge.
+ *
+ * @param v     The coordinate, at most BLUE_NOISE_RADIUS outside the range.
+ * @param size  The size of the range.
+ * @return      The coordinate within 0 to size - 1.
+ */
+static inline uint32_t Wrap(int64_t v, uint32_t size) {
+    // Maps narrower than the filter can need more than one step
+    while (v < 0) v += size;
+    while (v >= size) v -= size;
+    return (uint32_t)v;
+}
+
+/**
+ * Set or unset a pixel, and update the energy and trees around it.
+ *
+ * @param pattern   The pattern.
+ * @param pixel     The pixel to toggle.
+ */
+static void TogglePixel(BinaryPattern *pattern, uint32_t pixel) {
+    uint32_t width  = pattern->width_;
+    uint32_t height = pattern->height_;
+    uint32_t x      = pixel % width;
+    uint32_t y      = pixel / width;
+    int32_t sign    = pattern->set_[pixel] ? -1 : 1;
+    pattern->set_[pixel] ^= 1;
+
+    uint32_t columns[BLUE_NOISE_SIDE];
+    for (int dx = -BLUE_NOISE_RADIUS; dx <= BLUE_NOISE_RADIUS; dx++)
+        columns[dx + BLUE_NOISE_RADIUS] = Wrap((int64_t)x + dx, width);
+    for (int dy = -BLUE_NOISE_RADIUS; dy <= BLUE_NOISE_RADIUS; dy++) {
+        uint32_t ty      = Wrap((int64_t)y + dy, height);
+        int32_t *energy  = pattern->energy_ + (size_t)ty * width;
+        const int32_t *g = gaussian +
+                           (dy + BLUE_NOISE_RADIUS) * BLUE_NOISE_SIDE;
+        for (int i = 0; i < BLUE_NOISE_SIDE; i++)
+            energy[columns[i]] += sign * g[i];
+    }
+
+    // Collect the changed runs of leaves of each row, which wrap around the
+    // right edge when the window does and break at the edges of tiles, and
+    // refresh them
+    uint32_t lows[BLUE_NOISE_RUNS], highs[BLUE_NOISE_RUNS], runs = 0;
+    uint32_t rows = height < BLUE_NOISE_SIDE ? height : BLUE_NOISE_SIDE;
+    uint32_t spans[2][2] = {{columns[0], columns[BLUE_NOISE_SIDE - 1]}};
+    uint32_t span_count  = 1;
+    if (width <= BLUE_NOISE_SIDE) {
+        spans[0][0] = 0;
+        spans[0][1] = width - 1;
+    } else if (spans[0][0] > spans[0][1]) {
+        spans[1][0] = spans[0][0];
+        spans[1][1] = width - 1;
+        spans[0][0] = 0;
+        span_count  = 2;
+    }
+    for (uint32_t r = 0; r < rows; r++) {
+        uint32_t ty = Wrap((int64_t)y - BLUE_NOISE_RADIUS + r, height);
+        for (uint32_t s = 0; s < span_count; s++) {
+            for (uint32_t tx = spans[s][0]; tx <= spans[s][1];) {
+                uint32_t end = tx | (BLUE_NOISE_TILE - 1);
+                if (end > spans[s][1]) end = spans[s][1];
+                lows[runs] = PixelLeaf(pattern, tx, ty);
+                for (; tx <= end; tx++) {
+                    SetLeaves(pattern, ty * width + tx,
+                              PixelLeaf(pattern, tx, ty));
+                }
+                highs[runs] = PixelLeaf(pattern, end, ty);
+                lows[runs]  += pattern->leaves_;
+                highs[runs] += pattern->leaves_;
+                runs++;
+            }
+        }
+    }
+
+    // Sort the runs, so that runs that meet on the way up share their nodes
+    for (uint32_t k = 1; k < runs; k++) {
+        uint32_t low = lows[k], high = highs[k], j = k;
+        for (; j > 0 && lows[j - 1] > low; j--) {
+            lows[j]  = lows[j - 1];
+            highs[j] = highs[j - 1];
+        }
+        lows[j]  = low;
+        highs[j] = high;
+    }
+
+    // Recompute their ancestors a level at a time, each node once
+    for (uint32_t level = pattern->leaves_; level > 1; level /= 2) {
+        uint32_t next = 0;
+        for (uint32_t k = 0; k < runs; k++) {
+            lows[k]  /= 2;
+            highs[k] /= 2;
+            for (uint32_t node = lows[k] > next ? lows[k] : next;
+                 node <= highs[k]; node++) {
+                pattern->cluster_[node] =
+                    HigherNode(pattern->cluster_[2 * node],
+                               pattern->cluster_[2 * node + 1]);
+                pattern->void_[node] = HigherNode(pattern->void_[2 * node],
+                                                  pattern->void_[2 * node + 1]);
+            }
+            if (highs[k] + 1 > next) next = highs[k] + 1;
+        }
+    }
+}
+
+/**
+ * Compute the energy of every pixel of a pattern, and build its trees.
+ *
+ * @param pattern   The pattern, with its pixels set.
+ */
+static void InitPattern(BinaryPattern *pattern) {
+    uint32_t width  = pattern->width_;
+    uint32_t height = pattern->height_;
+
+#pragma omp parallel for default(none) shared(pattern, width, height, gaussian)
+    // Gather the energy each pixel receives from the set pixels around it
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            int32_t energy = 0;
+            for (int dy = -BLUE_NOISE_RADIUS; dy <= BLUE_NOISE_RADIUS; dy++) {
+                const uint8_t *set =
+                    pattern->set_ +
+                    (size_t)Wrap((int64_t)y - dy, height) * width;
+                const int32_t *g = gaussian +
+                                   (dy + BLUE_NOISE_RADIUS) * BLUE_NOISE_SIDE +
+                                   BLUE_NOISE_RADIUS;
+                for (int dx = -BLUE_NOISE_RADIUS; dx <= BLUE_NOISE_RADIUS; dx++)
+                    energy += set[Wrap((int64_t)x - dx, width)] * g[dx];
+            }
+            pattern->energy_[(size_t)y * width + x] = energy;
+        }
+    }
+
+    // Build the trees bottom up, with the padding leaves empty
+    for (uint32_t i = 0; i < pattern->leaves_; i++) {
+        pattern->cluster_[pattern->leaves_ + i] = NO_NODE;
+        pattern->void_[pattern->leaves_ + i]    = NO_NODE;
+    }
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++)
+            SetLeaves(pattern, y * width + x, PixelLeaf(pattern, x, y));
+    }
+    for (uint32_t node = pattern->leaves_ - 1; node >= 1; node--) {
+        pattern->cluster_[node] = HigherNode(pattern->cluster_[2 * node],
+                                             pattern->cluster_[2 * node + 1]);
+        pattern->void_[node]    = HigherNode(pattern->void_[2 * node],
+                                             pattern->void_[2 * node + 1]);
+    }
+}
+
+/**
+ * Generate a blue noise threshold map with the void-and-cluster method.
+ * Pixels are ranked by repeatedly taking the tightest cluster out of, or
+ * filling the largest void in, a binary pattern, judged by its energy under a
+ * Gaussian filter that wraps around the edges. The energy is updated only
+ * around each changed pixel, and the cluster and void are found with segment
+ * trees. Ranking the pixels below and above the initial pattern runs on two
+ * threads.
+ *
+ * @param width     The width of the map.
+ * @param height    The height of the map.
+ * @param seed      The seed of the initial pattern.
+ * @return          A pointer to the map, or NULL if an error occurred.
+ */
+PgmImage *BlueNoiseMap(uint32_t width, uint32_t height, uint64_t seed) {
+    if (!width || !height || (uint64_t)width * height > UINT32_MAX / 2) {
+        fprintf(stderr, "Error: invalid blue noise size %ux%u\n", width,
+                height);
+        return NULL;
+    }
+    uint32_t pixels = width * height;
+
+    // Allocate the map, the ranks, and a pattern for each phase
+    PgmImage *map  = AllocatePgm(width, height);
+    uint32_t *rank = (uint32_t *)malloc(pixels * sizeof(uint32_t));
+    BinaryPattern below = {.width_ = width, .height_ = height};
+    BinaryPattern above = {.width_ = width, .height_ = height};
+    bool allocated      = AllocatePattern(&below);
+    if (allocated && !AllocatePattern(&above)) {
+        FreePattern(&below);
+        allocated = false;
+    }
+    if (!map || !rank || !allocated) {
+        if (!rank) fprintf(stderr, "Error: out of memory\n");
+        if (allocated) {
+            FreePattern(&below);
+            FreePattern(&above);
+        }
+        if (map) FreePgm(map);
+        free(rank);
+        return NULL;
+    }
+
+    // Start from a random pattern with about a tenth of the pixels set
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *set = below.set_ + (size_t)y * width;
+        RandomThresholdRow(set, width, 0, y, &seed);
+        for (uint32_t x = 0; x < width; x++)
+            set[x] = set[x] < BLUE_NOISE_DENSITY;
+    }
+    uint32_t ones = 0;
+    for (uint32_t i = 0; i < pixels; i++) ones += below.set_[i];
+    if (!ones) {
+        below.set_[0] = 1;
+        ones          = 1;
+    }
+    InitPattern(&below);
+
+    // Spread it out by moving the tightest cluster to the largest void, until
+    // the pixel taken out is the one that would be put back
+    for (uint32_t i = 0; i < pixels; i++) {
+        uint32_t cluster = NodePixel(below.cluster_[1]);
+        TogglePixel(&below, cluster);
+        uint32_t gap = NodePixel(below.void_[1]);
+        TogglePixel(&below, gap);
+        if (gap == cluster) break;
+    }
+    CopyPattern(&above, &below);
+
+#pragma omp parallel sections default(none) shared(below, above, rank, ones, \
+                                                    pixels)
+    {
+#pragma omp section
+        // Rank the set pixels by taking out the tightest cluster each time
+        for (uint32_t r = ones; r-- > 0;) {
+            uint32_t cluster = NodePixel(below.cluster_[1]);
+            rank[cluster]    = r;
+            TogglePixel(&below, cluster);
+        }
+#pragma omp section
+        // Rank the other pixels by filling the largest void each time
+        for (uint32_t r = ones; r < pixels; r++) {
+            uint32_t gap = NodePixel(above.void_[1]);
+            rank[gap]    = r;
+            TogglePixel(&above, gap);
+        }
+    }
+
+    // Spread the ranks evenly over the gray levels
+    for (uint32_t i = 0; i < pixels; i++)
+        map->data_[i] = (uint8_t)((uint64_t)rank[i] * 256 / pixels);
+
+    FreePattern(&below);
+    FreePattern(&above);
+    free(rank);
+    return map;
+}
+
+#if defined __unix__ || defined __APPLE__
+/**
+ * Build the path of a blue noise map in the cache, creating the cache
+ * directory if needed.
+ *
+ * @param width     The width of the map.
+ * @param height    The height of the map.
+ * @param seed      The seed of the initial pattern.
+ * @param path      The buffer to write the path to.
+ * @param size      The size of the buffer.
+ * @return          True if successful, false if there is no cache.
+ */
+static bool BlueNoiseCachePath(uint32_t width, uint32_t height, uint64_t seed,
+                               char *path, size_t size) {
+    // Name the file after a hash of everything that determines its content
+    char key[128];
+    int length = snprintf(key, sizeof key,
+                          "void-and-cluster v%d sigma %g radius %d %ux%u "
+                          "seed %016llx",
+                          BLUE_NOISE_VERSION, BLUE_NOISE_SIGMA,
+                          BLUE_NOISE_RADIUS, width, height,
+                          (unsigned long long)seed);
+    uint64_t hash = UINT64_C(0xCBF29CE484222325);
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= UINT64_C(0x100000001B3);
+    }
+
+    // Use $XDG_CACHE_HOME, or ~/.cache if it is not set
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home  = getenv("HOME");
+    int written;
+    if (cache && cache[0] == '/') {
+        written = snprintf(path, size, "%s", cache);
+    } else if (home && home[0]) {
+        written = snprintf(path, size, "%s/.cache", home);
+    } else {
+        return false;
+    }
+    if (written <= 0 || (size_t)written >= size) return false;
+    mkdir(path, 0755);
+    written = snprintf(path + written, size - written, "/netpbm-c") + written;
+    if ((size_t)written >= size) return false;
+    mkdir(path, 0755);
+
+    size_t directory = (size_t)written;
+    written = snprintf(path + directory, size - directory, "/%016llx.pgm",
+                       (unsigned long long)hash);
+    return written > 0 && (size_t)written < size - directory;
+}
+#endif
+
+/**
+ * Load a blue noise threshold map from the cache, or generate it with
+ * BlueNoiseMap and add it to the cache. The cache is the netpbm-c directory
+ * of $XDG_CACHE_HOME, or of ~/.cache, with one file per map named after a
+ * hash of the generator and its parameters.
+ *
+ * @param width     The width of the map.
+ * @param height    The height of the map.
+ * @param seed      The seed of the initial pattern.
+ * @return          A pointer to the map, or NULL if an error occurred.
+ */
+PgmImage *CachedBlueNoiseMap(uint32_t width, uint32_t height, uint64_t seed) {
+#if defined __unix__ || defined __APPLE__
+    char path[4096];
+    if (BlueNoiseCachePath(width, height, seed, path, sizeof path)) {
+        // Load the map if an earlier job generated it
+        if (access(path, R_OK) == 0) {
+            PgmImage *map = ReadPgm(path);
+            if (map && map->width_ == width && map->height_ == height)
+                return map;
+            if (map) FreePgm(map);
+        }
+
+        // Write to a file of our own first, so that concurrent jobs never see
+        // a partial map
+        PgmImage *map = BlueNoiseMap(width, height, seed);
+        if (!map) return NULL;
+        char temp[sizeof path + 32];
+        snprintf(temp, sizeof temp, "%s.%ld.tmp", path, (long)getpid());
+        if (!WritePgm(map, temp) || rename(temp, path) != 0) remove(temp);
+        return map;
+    }
+#endif
+
+    // Without a cache, generate the map every time
+    return BlueNoiseMap(width, height, seed);
+}
@@ -0,0 +1,38 @@
+#ifndef NETPBM__NOISE_H_
+#define NETPBM__NOISE_H_
+
+#include <stdint.h>
+
+#include "types/pgm.h"
+
+/**
+ * Generate a blue noise threshold map with the void-and-cluster method.
+ * Pixels are ranked by repeatedly taking the tightest cluster out of, or
+ * filling the largest void in, a binary pattern, judged by its energy under a
+ * Gaussian filter that wraps around the edges. The energy is updated only
+ * around each changed pixel, and the cluster and void are found with segment
+ * trees. Ranking the pixels below and above the initial pattern runs on two
+ * threads.
+ *
+ * @param width     The width of the map.
+ * @param height    The height of the map.
+ * @param seed      The seed of the initial pattern.
+ * @return          A pointer to the map, or NULL if an error occurred.
+ */
+extern PgmImage *BlueNoiseMap(uint32_t width, uint32_t height, uint64_t seed);
+
+/**
+ * Load a blue noise threshold map from the cache, or generate it with
+ * BlueNoiseMap and add it to the cache. The cache is the netpbm-c directory
+ * of $XDG_CACHE_HOME, or of ~/.cache, with one file per map named after a
+ * hash of the generator and its parameters.
+ *
+ * @param width     The width of the map.
+ * @param height    The height of the map.
+ * @param seed      The seed of the initial pattern.
+ * @return          A pointer to the map, or NULL if an error occurred.
+ */
+extern PgmImage *CachedBlueNoiseMap(uint32_t width, uint32_t height,
+                                    uint64_t seed);
+
+#endif// NETPBM__NOISE_H_
@@ -1,34 +1,129 @@
 #include "pbm.h"
 
 #include <math.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#if defined __GLIBC__ && defined __linux__
+#include "linear.h"
+#include "mapping.h"
+#include "pgm.h"
+#include "sat.h"
 
-#include <sys/random.h>
+#if defined __AVX2__ || defined __BMI2__
+#include <immintrin.h>
+#elif defined __SSE2__
+#include <emmintrin.h>
+#endif
 
-ssize_t MyRandom(void *buf, size_t len) { return getrandom(buf, len, 0); }
+#if defined _OPENMP
+#include <omp.h>
+#endif
 
-#else /* not linux */
+#if defined __unix__ || defined __APPLE__
+#include <sched.h>
+#endif
 
-#include <errno.h>
-#include <stdio.h>
-#include <stdlib.h>
+// Philox4x32-10 multipliers and key increments
+#define PHILOX_M0 UINT32_C(0xD2511F53)
+#define PHILOX_M1 UINT32_C(0xCD9E8D57)
+#define PHILOX_W0 UINT32_C(0x9E3779B9)
+#define PHILOX_W1 UINT32_C(0xBB67AE85)
 
-ssize_t MyRandom(void *buf, size_t len) {
-    unsigned char *buffer = (unsigned char *)buf;
-    size_t i;
+// The seed of RandomThreshold and RandomThresholdRow
+static uint64_t random_seed = 0;
 
-    for (i = 0; i < len; ++i) {
-        buffer[i] = (unsigned char)rand();
+/**
+ * Draw the 16 random bytes of a block of pixels, with the Philox4x32-10
+ * counter-based generator keyed on the seed, so that every block can be
+ * drawn independently of all others.
+ *
+ * @param block     The block of 16 pixels of the row, x / 16.
+ * @param y         The row.
+ * @param seed      The seed.
+ * @param bytes     The 16 output bytes, one per pixel of the block.
+ */
+static void PhiloxBlock(uint32_t block, uint32_t y, uint64_t seed,
+                        uint8_t *bytes) {
+    uint32_t counter[4] = {block, y, 0, 0};
+    uint32_t key[2]     = {(uint32_t)seed, (uint32_t)(seed >> 32)};
+    for (int round = 0; round < 10; round++) {
+        uint64_t product0 = (uint64_t)PHILOX_M0 * counter[0];
+        uint64_t product1 = (uint64_t)PHILOX_M1 * counter[2];
+        uint32_t next[4]  = {(uint32_t)(product1 >> 32) ^ counter[1] ^ key[0],
+                             (uint32_t)product1,
+                             (uint32_t)(product0 >> 32) ^ counter[3] ^ key[1],
+                             (uint32_t)product0};
+        memcpy(counter, next, sizeof(counter));
+        key[0] += PHILOX_W0;
+        key[1] += PHILOX_W1;
     }
+    for (int i = 0; i < 16; i++)
+        bytes[i] = (uint8_t)(counter[i / 4] >> (8 * (i % 4)));
+}
 
-    return (ssize_t)len;
+#if defined __SSE2__
+/**
+ * Multiply each 32-bit lane by a constant, into the high and low halves of the
+ * 64-bit products.
+ *
+ * @param a         The lanes to multiply.
+ * @param m         The constant.
+ * @param hi        The high halves of the products.
+ * @param lo        The low halves of the products.
+ */
+static inline void MulHiLo(__m128i a, __m128i m, __m128i *hi, __m128i *lo) {
+    const __m128i low = _mm_set1_epi64x(0xFFFFFFFF);
+    __m128i even      = _mm_mul_epu32(a, m);
+    __m128i odd       = _mm_mul_epu32(_mm_srli_epi64(a, 32), m);
+    *lo = _mm_or_si128(_mm_and_si128(even, low), _mm_slli_epi64(odd, 32));
+    *hi = _mm_or_si128(_mm_srli_epi64(even, 32), _mm_andnot_si128(low, odd));
 }
 
+/**
+ * Draw the random bytes of 4 consecutive blocks of pixels at once, as
+ * PhiloxBlock, with one block per 32-bit lane.
+ *
+ * @param block     The first block of 16 pixels of the row, x / 16.
+ * @param y         The row.
+ * @param seed      The seed.
+ * @param bytes     The 64 output bytes, one per pixel of the blocks.
+ */
+static void PhiloxBlocks4(uint32_t block, uint32_t y, uint64_t seed,
+                          uint8_t *bytes) {
+    const __m128i m0 = _mm_set1_epi32((int32_t)PHILOX_M0);
+    const __m128i m1 = _mm_set1_epi32((int32_t)PHILOX_M1);
+    __m128i c0       = _mm_add_epi32(_mm_set1_epi32((int32_t)block),
+                                     _mm_setr_epi32(0, 1, 2, 3));
+    __m128i c1       = _mm_set1_epi32((int32_t)y);
+    __m128i c2       = _mm_setzero_si128();
+    __m128i c3       = _mm_setzero_si128();
+    uint32_t key[2]  = {(uint32_t)seed, (uint32_t)(seed >> 32)};
+    for (int round = 0; round < 10; round++) {
+        __m128i hi0, lo0, hi1, lo1;
+        MulHiLo(c0, m0, &hi0, &lo0);
+        MulHiLo(c2, m1, &hi1, &lo1);
+        c0 = _mm_xor_si128(_mm_xor_si128(hi1, c1),
+                           _mm_set1_epi32((int32_t)key[0]));
+        c2 = _mm_xor_si128(_mm_xor_si128(hi0, c3),
+                           _mm_set1_epi32((int32_t)key[1]));
+        c1 = lo1;
+        c3 = lo0;
+        key[0] += PHILOX_W0;
+        key[1] += PHILOX_W1;
+    }
+
+    // Transpose so that each block's 4 words are contiguous
+    __m128i t0 = _mm_unpacklo_epi32(c0, c1), t1 = _mm_unpackhi_epi32(c0, c1);
+    __m128i t2 = _mm_unpacklo_epi32(c2, c3), t3 = _mm_unpackhi_epi32(c2, c3);
+    _mm_storeu_si128((__m128i *)bytes, _mm_unpacklo_epi64(t0, t2));
+    _mm_storeu_si128((__m128i *)(bytes + 16), _mm_unpackhi_epi64(t0, t2));
+    _mm_storeu_si128((__m128i *)(bytes + 32), _mm_unpacklo_epi64(t1, t3));
+    _mm_storeu_si128((__m128i *)(bytes + 48), _mm_unpackhi_epi64(t1, t3));
+}
 #endif
 
 /**
@@ -45,9 +140,11 @@ PbmImage *AllocatePbm(uint32_t width, uint32_t height) {
         fprintf(stderr, "Error: out of memory\n");
         return NULL;
     }
-    image->width_  = width;
-    image->height_ = height;
-    image->data_   = (uint8_t *)calloc(width * height, sizeof(uint8_t));
+    image->width_   = width;
+    image->height_  = height;
+    image->stride_  = (width + 7) / 8;
+    image->mapping_ = (MappedFile){NULL, 0};
+    image->data_ = (uint8_t *)calloc((size_t)image->stride_ * height, 1);
     if (!image->data_) {
         fprintf(stderr, "Error: out of memory\n");
         free(image);
@@ -56,6 +153,111 @@ PbmImage *AllocatePbm(uint32_t width, uint32_t height) {
     return image;
 }
 
+#if defined __AVX2__
+/**
+ * Pack 32 pixels into 4 PBM bytes, most significant bit first.
+ *
+ * @param white     The pixels, with the top bit of each set for white.
+ * @return          The packed bytes, in memory order, 1 for black.
+ */
+static inline uint32_t PackBlack256(__m256i white) {
+    // Reverse each group of 8 pixels so movemask puts the first one in bit 7
+    const __m256i reverse = _mm256_setr_epi8(
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2,
+        1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    white = _mm256_shuffle_epi8(white, reverse);
+    return ~(uint32_t)_mm256_movemask_epi8(white);
+}
+#endif
+
+#if defined __SSE2__
+/**
+ * Pack 16 pixels into 2 PBM bytes, most significant bit first.
+ *
+ * @param white     The pixels, with the top bit of each set for white.
+ * @return          The packed bytes, in memory order, 1 for black.
+ */
+static inline uint16_t PackBlack128(__m128i white) {
+    // Reverse each group of 8 pixels: swap bytes, then reverse words
+    white = _mm_or_si128(_mm_slli_epi16(white, 8), _mm_srli_epi16(white, 8));
+    white = _mm_shufflelo_epi16(white, _MM_SHUFFLE(0, 1, 2, 3));
+    white = _mm_shufflehi_epi16(white, _MM_SHUFFLE(0, 1, 2, 3));
+    return (uint16_t)~_mm_movemask_epi8(white);
+}
+#endif
+
+/**
+ * Pack one row of PBM pixels into bits, most significant bit first.
+ * The last byte is padded with zero bits, as in the PBM file format.
+ *
+ * @param pixels    The pixels of the row, one byte per pixel, nonzero for
+ * black.
+ * @param width     The number of pixels in the row.
+ * @param bits      The (width + 7) / 8 output bytes.
+ */
+void PackPbmRow(const uint8_t *pixels, uint32_t width, uint8_t *bits) {
+    uint32_t x = 0;
+#if defined __AVX2__
+    for (; x + 32 <= width; x += 32) {
+        __m256i v      = _mm256_loadu_si256((const __m256i *)(pixels + x));
+        uint32_t black = PackBlack256(
+            _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        memcpy(bits + x / 8, &black, sizeof(black));
+    }
+#endif
+#if defined __SSE2__
+    for (; x + 16 <= width; x += 16) {
+        __m128i v      = _mm_loadu_si128((const __m128i *)(pixels + x));
+        uint16_t black =
+            PackBlack128(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        memcpy(bits + x / 8, &black, sizeof(black));
+    }
+#endif
+    // Remaining pixels, including the padded last byte
+    for (; x < width; x += 8) {
+        uint8_t byte = 0;
+        for (uint32_t j = 0; j < 8 && x + j < width; j++)
+            byte |= (uint8_t)((pixels[x + j] != 0) << (7 - j));
+        bits[x / 8] = byte;
+    }
+}
+
+/**
+ * Unpack one row of PBM bits into pixels, one byte per pixel.
+ *
+ * @param bits      The (width + 7) / 8 packed bytes, most significant bit
+ * first.
+ * @param width     The number of pixels in the row.
+ * @param pixels    The output pixels, each 0 (white) or 1 (black).
+ */
+void UnpackPbmRow(const uint8_t *bits, uint32_t width, uint8_t *pixels) {
+    uint32_t x = 0;
+#if defined __BMI2__
+    // Deposit each bit in its own byte, then put the first pixel first
+    for (; x + 8 <= width; x += 8) {
+        uint64_t bytes =
+            __builtin_bswap64(_pdep_u64(bits[x / 8], 0x0101010101010101ULL));
+        memcpy(pixels + x, &bytes, sizeof(bytes));
+    }
+#elif defined __SSE2__
+    // Broadcast two bytes over 8 lanes each and test one bit per lane
+    const __m128i select = _mm_setr_epi8(
+        (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01, (char)0x80, 0x40,
+        0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+    const __m128i one = _mm_set1_epi8(1);
+    for (; x + 16 <= width; x += 16) {
+        __m128i v = _mm_set_epi64x(
+            (long long)(bits[x / 8 + 1] * 0x0101010101010101ULL),
+            (long long)(bits[x / 8] * 0x0101010101010101ULL));
+        v = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v, select), select),
+                          one);
+        _mm_storeu_si128((__m128i *)(pixels + x), v);
+    }
+#endif
+    // Remaining pixels
+    for (; x < width; x++) pixels[x] = (bits[x / 8] >> (7 - x % 8)) & 1;
+}
+
 /**
  * Read a PBM image from a file.
  *
@@ -89,46 +291,54 @@ PbmImage *ReadPbm(const char *filename) {
         return NULL;
     }
 
-    // Allocate memory for buffer
-    size_t buffer_size = (size_t)((width * height + 7) / 8);
-    uint8_t *buffer    = (uint8_t *)calloc(1, buffer_size);
-    if (!buffer) {
-        fprintf(stderr, "Error: out of memory\n");
+    // Allocate memory for image data
+    PbmImage *image = AllocatePbm(width, height);
+    if (!image) {
         fclose(fp);
         return NULL;
     }
 
-    // Read pixel data into buffer
-    if (fread(buffer, sizeof(uint8_t), buffer_size, fp) != buffer_size) {
+    // Read pixel data, which is stored exactly as in the file
+    size_t size = (size_t)image->stride_ * height;
+    if (fread(image->data_, sizeof(uint8_t), size, fp) != size) {
         fprintf(stderr, "Error: failed to read pixel data from file '%s'\n",
                 filename);
-        free(buffer);
+        FreePbm(image);
         fclose(fp);
         return NULL;
     }
 
-    // Close file
     fclose(fp);
+    return image;
+}
 
-    // Allocate memory for image data
-    PbmImage *image = AllocatePbm(width, height);
+/**
+ * Map a PBM image from a file without copying its pixel data.
+ * The returned image points into a read-only mapping of the file, so its
+ * pixels must not be modified. It is released with FreePbm as usual.
+ *
+ * @param filename  The name of the file to map.
+ * @return          A pointer to the image data, or NULL if an error occurred.
+ */
+PbmImage *MapPbm(const char *filename) {
+    // Map the file and parse the header in place
+    MappedFile file;
+    NetpbmHeader header;
+    if (!MapNetpbm(filename, '4', 0, &file, &header)) return NULL;
 
-#pragma omp parallel for default(none) shared(image, buffer, width, height)
-    // Decode the pixel data from the buffer
-    for (size_t i = 0; i < width * height; i += 8) {
-        // Read the next byte from the buffer
-        uint8_t byte = buffer[i / 8];
-
-        // Decode the byte into the image data (loop through the 8 bits)
-        for (size_t j = 0; j < 8; j++) {
-            size_t index = i + j;
-            if (index < width * height) {
-                image->data_[index] = (byte & (1 << (7 - j))) >> (7 - j);
-            }
-        }
+    // Allocate the image header only, the pixels stay in the mapping
+    PbmImage *image = (PbmImage *)malloc(sizeof(PbmImage));
+    if (!image) {
+        fprintf(stderr, "Error: out of memory\n");
+        UnmapFile(&file);
+        return NULL;
     }
+    image->width_   = header.width_;
+    image->height_  = header.height_;
+    image->stride_  = (header.width_ + 7) / 8;
+    image->mapping_ = file;
+    image->data_    = file.data_ + header.offset_;
 
-    free(buffer);
     return image;
 }
 
@@ -160,18 +370,26 @@ uint8_t MiddleThreshold(__attribute__((unused)) uint32_t x,
     return 128;
 }
 
+/**
+ * Set the seed of RandomThreshold and RandomThresholdRow.
+ *
+ * @param seed  The seed.
+ */
+void SeedRandomThreshold(uint64_t seed) { random_seed = seed; }
+
 /**
  * Threshold function that returns a random value between 0 and 255.
+ * The value only depends on the seed and the coordinates, so the same seed
+ * gives the same image whatever the number of threads.
  *
- * @param x Unused
- * @param y Unused
+ * @param x X coordinate
+ * @param y Y coordinate
  * @return Random value between 0 and 255
  */
-uint8_t RandomThreshold(__attribute__((unused)) uint32_t x,
-                        __attribute__((unused)) uint32_t y) {
-    uint8_t random;
-    MyRandom(&random, sizeof(uint8_t));
-    return random;
+uint8_t RandomThreshold(uint32_t x, uint32_t y) {
+    uint8_t bytes[16];
+    PhiloxBlock(x / 16, y, random_seed, bytes);
+    return bytes[x % 16];
 }
 
 /**
@@ -189,6 +407,208 @@ uint8_t IgnThreshold(uint32_t x, uint32_t y) {
                      255.f);
 }
 
+#if defined __SSE2__
+/**
+ * Fractional part of non-negative floats below 2^31, exact like fmodf(x, 1).
+ *
+ * @param x The values.
+ * @return  x minus its integer part.
+ */
+static inline __m128 FractionalPart(__m128 x) {
+    return _mm_sub_ps(x, _mm_cvtepi32_ps(_mm_cvttps_epi32(x)));
+}
+#endif
+
+#if defined __AVX2__
+/**
+ * Fractional part of non-negative floats, exact like fmodf(x, 1).
+ *
+ * @param x The values.
+ * @return  x minus its floor.
+ */
+static inline __m256 FractionalPart256(__m256 x) {
+    return _mm256_sub_ps(x, _mm256_floor_ps(x));
+}
+#endif
+
+#if defined __AVX512F__
+/**
+ * Fractional part of non-negative floats, exact like fmodf(x, 1).
+ *
+ * @param x The values.
+ * @return  x minus its floor.
+ */
+static inline __m512 FractionalPart512(__m512 x) {
+    return _mm512_sub_ps(
+        x, _mm512_roundscale_ps(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+}
+#endif
+
+/**
+ * Span threshold function that always returns 128, as MiddleThreshold.
+ *
+ * @param thresholds    The thresholds of the span.
+ * @param count         The number of pixels in the span.
+ * @param x0            Unused
+ * @param y             Unused
+ * @param context       Unused
+ */
+void MiddleThresholdRow(uint8_t *thresholds, uint32_t count,
+                        __attribute__((unused)) uint32_t x0,
+                        __attribute__((unused)) uint32_t y,
+                        __attribute__((unused)) void *context) {
+    memset(thresholds, 128, count);
+}
+
+/**
+ * Span threshold function that returns random values between 0 and 255,
+ * equal to RandomThreshold at every pixel for the same seed.
+ *
+ * @param thresholds    The thresholds of the span.
+ * @param count         The number of pixels in the span.
+ * @param x0            X coordinate of the first pixel
+ * @param y             Y coordinate
+ * @param context       A pointer to the uint64_t seed, or NULL for the one set
+ * by SeedRandomThreshold.
+ */
+void RandomThresholdRow(uint8_t *thresholds, uint32_t count, uint32_t x0,
+                        uint32_t y, void *context) {
+    uint64_t seed = context ? *(const uint64_t *)context : random_seed;
+    uint64_t end  = (uint64_t)x0 + count;
+
+    // Draw whole blocks of 16 pixels, and keep the part within the span
+    for (uint64_t block = x0 / 16; block * 16 < end;) {
+        uint8_t bytes[64];
+        uint64_t blocks = 1;
+#if defined __SSE2__
+        if (block * 16 + 48 < end) {
+            PhiloxBlocks4((uint32_t)block, y, seed, bytes);
+            blocks = 4;
+        } else
+#endif
+            PhiloxBlock((uint32_t)block, y, seed, bytes);
+        uint64_t first = block * 16 < x0 ? x0 : block * 16;
+        uint64_t last  = (block + blocks) * 16 < end ? (block + blocks) * 16
+                                                     : end;
+        memcpy(thresholds + (first - x0), bytes + (first - block * 16),
+               last - first);
+        block += blocks;
+    }
+}
+
+/**
+ * Span threshold function based on IGN (Interleaved Gradient Noise), equal to
+ * IgnThreshold at every pixel.
+ *
+ * @param thresholds    The thresholds of the span.
+ * @param count         The number of pixels in the span.
+ * @param x0            X coordinate of the first pixel
+ * @param y             Y coordinate
+ * @param context       Unused
+ */
+void IgnThresholdRow(uint8_t *thresholds, uint32_t count, uint32_t x0,
+                     uint32_t y, __attribute__((unused)) void *context) {
+    uint32_t i = 0;
+    // Coordinates below 2^31 convert exactly as in IgnThreshold, and so does
+    // the product with y, which is the same for the whole span
+    bool exact = y <= INT32_MAX && x0 <= INT32_MAX - count;
+#if defined __AVX512F__
+    if (exact) {
+        const __m512 y_term  = _mm512_set1_ps(.00583715f * (float)y);
+        const __m512 x_scale = _mm512_set1_ps(.06711056f);
+        const __m512 magic   = _mm512_set1_ps(52.9829189f);
+        const __m512 scale   = _mm512_set1_ps(255.f);
+        __m512i x            = _mm512_add_epi32(
+            _mm512_set1_epi32((int32_t)x0),
+            _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+                              15));
+        for (; i + 16 <= count; i += 16) {
+            __m512 inner = _mm512_add_ps(
+                _mm512_mul_ps(x_scale, _mm512_cvtepi32_ps(x)), y_term);
+            __m512 outer = _mm512_mul_ps(magic, FractionalPart512(inner));
+            _mm_storeu_si128((__m128i *)(thresholds + i),
+                             _mm512_cvtepi32_epi8(_mm512_cvttps_epi32(
+                                 _mm512_mul_ps(FractionalPart512(outer),
+                                               scale))));
+            x = _mm512_add_epi32(x, _mm512_set1_epi32(16));
+        }
+    }
+#endif
+#if defined __AVX2__
+    if (exact) {
+        const __m256 y_term  = _mm256_set1_ps(.00583715f * (float)y);
+        const __m256 x_scale = _mm256_set1_ps(.06711056f);
+        const __m256 magic   = _mm256_set1_ps(52.9829189f);
+        const __m256 scale   = _mm256_set1_ps(255.f);
+        const __m256i step   = _mm256_set1_epi32(8);
+        // Undo the per-lane interleaving of the packs
+        const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        __m256i x           = _mm256_add_epi32(
+            _mm256_set1_epi32((int32_t)(x0 + i)),
+            _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        for (; i + 32 <= count; i += 32) {
+            __m256i quarters[4];
+            for (int q = 0; q < 4; q++) {
+                __m256 inner = _mm256_add_ps(
+                    _mm256_mul_ps(x_scale, _mm256_cvtepi32_ps(x)), y_term);
+                __m256 outer = _mm256_mul_ps(magic, FractionalPart256(inner));
+                quarters[q]  = _mm256_cvttps_epi32(
+                    _mm256_mul_ps(FractionalPart256(outer), scale));
+                x = _mm256_add_epi32(x, step);
+            }
+            __m256i bytes = _mm256_packus_epi16(
+                _mm256_packs_epi32(quarters[0], quarters[1]),
+                _mm256_packs_epi32(quarters[2], quarters[3]));
+            _mm256_storeu_si256((__m256i *)(thresholds + i),
+                                _mm256_permutevar8x32_epi32(bytes, order));
+        }
+    }
+#endif
+#if defined __SSE2__
+    if (exact) {
+        const __m128 y_term  = _mm_set1_ps(.00583715f * (float)y);
+        const __m128 x_scale = _mm_set1_ps(.06711056f);
+        const __m128 magic   = _mm_set1_ps(52.9829189f);
+        const __m128 scale   = _mm_set1_ps(255.f);
+        const __m128i step   = _mm_set1_epi32(4);
+        __m128i x = _mm_add_epi32(_mm_set1_epi32((int32_t)(x0 + i)),
+                                  _mm_setr_epi32(0, 1, 2, 3));
+        for (; i + 16 <= count; i += 16) {
+            __m128i quarters[4];
+            for (int q = 0; q < 4; q++) {
+                __m128 inner =
+                    _mm_add_ps(_mm_mul_ps(x_scale, _mm_cvtepi32_ps(x)), y_term);
+                __m128 outer = _mm_mul_ps(magic, FractionalPart(inner));
+                quarters[q] = _mm_cvttps_epi32(
+                    _mm_mul_ps(FractionalPart(outer), scale));
+                x = _mm_add_epi32(x, step);
+            }
+            _mm_storeu_si128(
+                (__m128i *)(thresholds + i),
+                _mm_packus_epi16(_mm_packs_epi32(quarters[0], quarters[1]),
+                                 _mm_packs_epi32(quarters[2], quarters[3])));
+        }
+    }
+#endif
+    for (; i < count; i++) thresholds[i] = IgnThreshold(x0 + i, y);
+}
+
+/**
+ * Adapter that evaluates a per-pixel threshold function over a span.
+ *
+ * @param thresholds    The thresholds of the span.
+ * @param count         The number of pixels in the span.
+ * @param x0            X coordinate of the first pixel
+ * @param y             Y coordinate
+ * @param context       A pointer to the ThresholdFn to evaluate.
+ */
+void ThresholdFnRow(uint8_t *thresholds, uint32_t count, uint32_t x0,
+                    uint32_t y, void *context) {
+    ThresholdFn threshold = *(ThresholdFn *)context;
+    for (uint32_t i = 0; i < count; i++)
+        thresholds[i] = threshold(x0 + i, y);
+}
+
 /**
  * Convert a PGM image to a PBM image.
  *
@@ -200,280 +620,1601 @@ uint8_t IgnThreshold(uint32_t x, uint32_t y) {
 PbmImage *PgmToPbm(const PgmImage *image, ThresholdFn threshold) {
     // Allocate memory for new image data
     PbmImage *pbm_image = AllocatePbm(image->width_, image->height_);
+    if (!pbm_image) return NULL;
 
-#pragma omp parallel for default(none) shared(image, pbm_image, threshold) \
-    collapse(2)
-    // Convert pixel data using the threshold function
-    for (uint32_t y = 0; y < pbm_image->height_; y++) {
-        for (uint32_t x = 0; x < pbm_image->width_; x++) {
-            uint32_t pos          = y * pbm_image->width_ + x;
-            pbm_image->data_[pos] = image->data_[pos] < threshold(x, y);
-        }
-    }
+    // Convert the whole image as a single band
+    PgmToPbmBand(image, 0, threshold, pbm_image);
     return pbm_image;
 }
 
 /**
- * Convert a PGM image to a PBM image using Atkinson dithering.
+ * Convert a band of rows of a PGM image to PBM.
+ * The built-in threshold functions are recognised and computed a span at a
+ * time.
+ *
+ * @param band      The rows of the PGM image to convert.
+ * @param y_offset  The row of the whole image the band starts at.
+ * @param threshold The threshold function (0-255) to use for the conversion.
+ * @param out       The PBM band to write to, with room for as many rows as the
+ * PGM band. Its height is set to that of the PGM band.
+ */
+void PgmToPbmBand(const PgmImage *band, uint32_t y_offset,
+                  ThresholdFn threshold, PbmImage *out) {
+    // The built-in thresholds have span versions, anything else goes through
+    // the adapter
+    ThresholdRowFn row_fn = threshold == MiddleThreshold   ? MiddleThresholdRow
+                            : threshold == RandomThreshold ? RandomThresholdRow
+                            : threshold == IgnThreshold    ? IgnThresholdRow
+                                                           : ThresholdFnRow;
+    PgmToPbmRowsBand(band, y_offset, row_fn,
+                     row_fn == ThresholdFnRow ? &threshold : NULL, out);
+}
+
+// Pixels per span of thresholds computed at once
+#define THRESHOLD_SPAN 256
+
+/**
+ * Compare a span of pixels against their thresholds and pack the result
+ * straight into PBM bytes, black where the pixel lies below its threshold.
+ *
+ * @param pixels        The gray values of the span.
+ * @param thresholds    The thresholds of the span.
+ * @param count         The number of pixels in the span.
+ * @param bits          The (count + 7) / 8 output bytes.
+ */
+static void PackBelow(const uint8_t *pixels, const uint8_t *thresholds,
+                      uint32_t count, uint8_t *bits) {
+    uint32_t x = 0;
+#if defined __AVX512BW__
+    // Reverse each group of 8 pixels so the first one lands in bit 7
+    const __m512i reverse = _mm512_broadcast_i32x4(_mm_setr_epi8(
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8));
+    for (; x + 64 <= count; x += 64) {
+        __m512i v = _mm512_loadu_si512((const void *)(pixels + x));
+        __m512i h = _mm512_loadu_si512((const void *)(thresholds + x));
+        uint64_t black =
+            _mm512_cmplt_epu8_mask(_mm512_shuffle_epi8(v, reverse),
+                                   _mm512_shuffle_epi8(h, reverse));
+        memcpy(bits + x / 8, &black, sizeof(black));
+    }
+#endif
+#if defined __AVX2__
+    for (; x + 32 <= count; x += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(pixels + x));
+        __m256i h = _mm256_loadu_si256((const __m256i *)(thresholds + x));
+        // Pixels at or above their threshold are white
+        uint32_t black =
+            PackBlack256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, h), v));
+        memcpy(bits + x / 8, &black, sizeof(black));
+    }
+#endif
+#if defined __SSE2__
+    for (; x + 16 <= count; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(pixels + x));
+        __m128i h = _mm_loadu_si128((const __m128i *)(thresholds + x));
+        // Pixels at or above their threshold are white
+        uint16_t black = PackBlack128(_mm_cmpeq_epi8(_mm_max_epu8(v, h), v));
+        memcpy(bits + x / 8, &black, sizeof(black));
+    }
+#endif
+    // Remaining pixels, including the padded last byte
+    for (; x < count; x += 8) {
+        uint8_t byte = 0;
+        for (uint32_t j = 0; j < 8 && x + j < count; j++)
+            byte |= (uint8_t)((pixels[x + j] < thresholds[x + j]) << (7 - j));
+        bits[x / 8] = byte;
+    }
+}
+
+/**
+ * Convert a PGM image to a PBM image using the given span threshold function,
+ * called for every row in parallel.
  *
  * @param image     The PGM image to convert.
+ * @param threshold The span threshold function (0-255) to use.
+ * @param context   Passed on to every call of threshold.
  * @return          A pointer to the new PBM image, or NULL if an error
  * occurred.
  */
-PbmImage *PgmToPbmAtkinson(const PgmImage *image) {
+PbmImage *PgmToPbmRows(const PgmImage *image, ThresholdRowFn threshold,
+                       void *context) {
     // Allocate memory for new image data
     PbmImage *pbm_image = AllocatePbm(image->width_, image->height_);
+    if (!pbm_image) return NULL;
 
-    // Normalize pixel data to [0, 1] double values
-    double *double_data = NormalizePgm(image);
-
-    // Convert pixel data using Atkinson dithering
-    for (uint32_t y = 0; y < pbm_image->height_; y++) {
-        for (uint32_t x = 0; x < pbm_image->width_; x++) {
-            uint32_t pos     = y * pbm_image->width_ + x;
-            double old_pixel = double_data[pos];
-            double new_pixel = round(old_pixel);
-
-            // Invert pixel value (PBM is white 0 and black 1)
-            pbm_image->data_[pos] = new_pixel == 0;
+    // Convert the whole image as a single band
+    PgmToPbmRowsBand(image, 0, threshold, context, pbm_image);
+    return pbm_image;
+}
 
-            // Calculate error
-            double error = old_pixel - new_pixel;
+/**
+ * Convert a band of rows of a PGM image to PBM using the given span threshold
+ * function.
+ *
+ * @param band      The rows of the PGM image to convert.
+ * @param y_offset  The row of the whole image the band starts at.
+ * @param threshold The span threshold function (0-255) to use.
+ * @param context   Passed on to every call of threshold.
+ * @param out       The PBM band to write to, with room for as many rows as the
+ * PGM band. Its height is set to that of the PGM band.
+ */
+void PgmToPbmRowsBand(const PgmImage *band, uint32_t y_offset,
+                      ThresholdRowFn threshold, void *context, PbmImage *out) {
+    out->height_ = band->height_;
 
-            // Propagate error
-            if (x < pbm_image->width_ - 1) {
-                double_data[pos + 1] += error * 1 / 8;
-            }
-            if (y < pbm_image->height_ - 1) {
-                if (x > 0) {
-                    double_data[pos + pbm_image->width_ - 1] += error * 1 / 8;
-                }
-                double_data[pos + pbm_image->width_] += error * 1 / 8;
-                if (x < pbm_image->width_ - 1) {
-                    double_data[pos + pbm_image->width_ + 1] += error * 1 / 8;
-                }
-                if (x < pbm_image->width_ - 2) {
-                    double_data[pos + pbm_image->width_ + 2] += error * 1 / 8;
-                }
-            }
-            if (y < pbm_image->height_ - 2) {
-                if (x > 0) {
-                    double_data[pos + 2 * pbm_image->width_ - 1] +=
-                        error * 1 / 8;
-                }
-                double_data[pos + 2 * pbm_image->width_] += error * 1 / 8;
-                if (x < pbm_image->width_ - 1) {
-                    double_data[pos + 2 * pbm_image->width_ + 1] +=
-                        error * 1 / 8;
-                }
-            }
+#pragma omp parallel for default(none) \
+    shared(band, y_offset, threshold, context, out)
+    // Convert each row a span at a time, comparing and packing whole spans
+    for (uint32_t y = 0; y < band->height_; y++) {
+        const uint8_t *row = band->data_ + (size_t)y * band->width_;
+        uint8_t *bits      = out->data_ + (size_t)y * out->stride_;
+        uint8_t span[THRESHOLD_SPAN];
+        for (uint32_t x0 = 0; x0 < band->width_; x0 += THRESHOLD_SPAN) {
+            uint32_t count = band->width_ - x0 < THRESHOLD_SPAN
+                                 ? band->width_ - x0
+                                 : THRESHOLD_SPAN;
+            threshold(span, count, x0, y_offset + y, context);
+            PackBelow(row + x0, span, count, bits + x0 / 8);
         }
     }
-
-    free(double_data);
-    return pbm_image;
 }
 
 /**
- * Convert a PGM image to a PBM image using Ordered Dithering.
+ * Convert a PGM image to a PBM image using random thresholds drawn from the
+ * given seed. The same seed gives the same image whatever the number of
+ * threads.
  *
  * @param image     The PGM image to convert.
+ * @param seed      The seed of the random thresholds.
  * @return          A pointer to the new PBM image, or NULL if an error
  * occurred.
  */
-PbmImage *PgmToPbmOrdered(const PgmImage *image, const PgmImage *map) {
-    // Allocate memory for new image data
-    PbmImage *pbm_image = AllocatePbm(image->width_, image->height_);
+PbmImage *PgmToPbmRandom(const PgmImage *image, uint64_t seed) {
+    return PgmToPbmRows(image, RandomThresholdRow, &seed);
+}
 
-#pragma omp parallel for default(none) shared(map, pbm_image, image) collapse(2)
-    // Convert using Bayer (Ordered) Dithering
-    for (uint32_t y = 0; y < pbm_image->height_; y++) {
-        for (uint32_t x = 0; x < pbm_image->width_; x++) {
-            uint32_t pos = y * pbm_image->width_ + x;
-            pbm_image->data_[pos] =
-                image->data_[pos] <
-                map->data_[(y % map->height_) * map->width_ +
-                           (x % map->width_)];
-        }
+/**
+ * Create a threshold map of IGN (Interleaved Gradient Noise), equal to
+ * IgnThreshold at every pixel of the map.
+ *
+ * @param width     The width of the map.
+ * @param height    The height of the map.
+ * @return          A pointer to the map, or NULL if an error occurred.
+ */
+PgmImage *IgnThresholdMap(uint32_t width, uint32_t height) {
+    PgmImage *map = AllocatePgm(width, height);
+    if (!map) return NULL;
+
+#pragma omp parallel for default(none) shared(map)
+    // Compute each row of the map
+    for (uint32_t y = 0; y < map->height_; y++) {
+        IgnThresholdRow(map->data_ + (size_t)y * map->width_, map->width_, 0,
+                        y, NULL);
     }
+    return map;
+}
 
-    return pbm_image;
+/**
+ * Create a threshold map of a Bayer matrix, the same as the map of that size
+ * in textures/bayer. The rank of a pixel takes the bits of x ^ y and y as
+ * base 4 digits, the lowest bits of the coordinates being the highest digits.
+ *
+ * @param size      The width and height of the map, a power of 2.
+ * @return          A pointer to the map, or NULL if an error occurred.
+ */
+PgmImage *BayerMap(uint32_t size) {
+    if (!size || size & (size - 1)) {
+        fprintf(stderr, "Error: Bayer map size %u is not a power of 2\n",
+                size);
+        return NULL;
+    }
+    PgmImage *map = AllocatePgm(size, size);
+    if (!map) return NULL;
+
+    uint32_t bits = 0;
+    while (UINT32_C(1) << bits < size) bits++;
+
+#pragma omp parallel for default(none) shared(map, size, bits)
+    // Rank each pixel, and scale the ranks to gray values
+    for (uint32_t y = 0; y < size; y++) {
+        uint8_t *row = map->data_ + (size_t)y * size;
+        for (uint32_t x = 0; x < size; x++) {
+            uint64_t rank = 0;
+            for (uint32_t b = 0; b < bits; b++)
+                rank = rank << 2 | ((x ^ y) >> b & 1) << 1 | (y >> b & 1);
+            row[x] = (uint8_t)(bits > 4 ? rank >> (2 * bits - 8)
+                                        : rank << (8 - 2 * bits));
+        }
+    }
+    return map;
 }
 
 /**
- * Convert a PGM image to a PBM image using Floyd–Steinberg dithering.
+ * Convert a PGM image to a PBM image using IGN (Interleaved Gradient Noise).
+ * Without a tile, the thresholds are computed a span at a time, as
+ * PgmToPbm(image, IgnThreshold). With one, a tile x tile map of IGN is
+ * computed once and repeated over the image with Ordered Dithering, which is
+ * faster but repeats the pattern.
  *
  * @param image     The PGM image to convert.
+ * @param tile      The size of the repeated tile, or 0 for none.
  * @return          A pointer to the new PBM image, or NULL if an error
  * occurred.
  */
-PbmImage *PgmToPbmFloydSteinberg(const PgmImage *image) {
-    // Allocate memory for new image data
-    PbmImage *pbm_image = AllocatePbm(image->width_, image->height_);
+PbmImage *PgmToPbmIgn(const PgmImage *image, uint32_t tile) {
+    if (!tile) return PgmToPbmRows(image, IgnThresholdRow, NULL);
 
-    // Normalize pixel data to [0, 1] double values
-    double *double_data = NormalizePgm(image);
+    PgmImage *map = IgnThresholdMap(tile, tile);
+    if (!map) return NULL;
+    PbmImage *pbm_image = PgmToPbmOrdered(image, map);
+    FreePgm(map);
+    return pbm_image;
+}
 
-    // Convert pixel data using Floyd-Steinberg dithering
-    for (uint32_t y = 0; y < pbm_image->height_; y++) {
-        for (uint32_t x = 0; x < pbm_image->width_; x++) {
-            uint32_t pos     = y * pbm_image->width_ + x;
-            double old_pixel = double_data[pos];
-            double new_pixel = round(old_pixel);
+// The dynamic range of the standard deviation in Sauvola's threshold
+#define SAUVOLA_RANGE 128.0
 
-            // Invert pixel value (PBM is white 0 and black 1)
-            pbm_image->data_[pos] = new_pixel == 0;
+/**
+ * The sum of a span of columns between two rows of a summed area table.
+ *
+ * @param top       The sums of the row above the window, or NULL if the
+ * window starts at the first row.
+ * @param bottom    The sums of the last row of the window.
+ * @param left      The first column of the window.
+ * @param right     The last column of the window.
+ * @return          The sum of the window.
+ */
+static inline uint64_t WindowSum(const uint64_t *top, const uint64_t *bottom,
+                                 uint32_t left, uint32_t right) {
+    uint64_t sum = bottom[right] - (left ? bottom[left - 1] : 0);
+    if (top) sum -= top[right] - (left ? top[left - 1] : 0);
+    return sum;
+}
 
-            // Calculate error
-            double error = old_pixel - new_pixel;
+/**
+ * Threshold one row of a PGM image adaptively.
+ *
+ * @param image     The PGM image.
+ * @param sat       The summed area tables of the image, with squares_ set
+ * unless the method is BRADLEY.
+ * @param method    The adaptive thresholding method.
+ * @param radius    The radius of the window.
+ * @param k         The parameter of the method.
+ * @param y         The row.
+ * @param bits      The output bytes of the row, zeroed beforehand.
+ */
+static void AdaptiveRow(const PgmImage *image, const SummedAreaTable *sat,
+                        AdaptiveMethod method, uint32_t radius, double k,
+                        uint32_t y, uint8_t *bits) {
+    uint32_t width  = image->width_;
+    uint32_t top    = y > radius ? y - radius : 0;
+    uint32_t bottom = image->height_ - 1 - y > radius ? y + radius
+                                                      : image->height_ - 1;
 
-            // Propagate error
-            if (x < pbm_image->width_ - 1) {
-                double_data[pos + 1] += error * 7 / 16;
-            }
-            if (y < pbm_image->height_ - 1) {
-                if (x > 0) {
-                    double_data[pos + pbm_image->width_ - 1] += error * 3 / 16;
-                }
-                double_data[pos + pbm_image->width_] += error * 5 / 16;
-                if (x < pbm_image->width_ - 1) {
-                    double_data[pos + pbm_image->width_ + 1] += error * 1 / 16;
-                }
-            }
-        }
+    // The rows of the tables above and at the bottom of the windows
+    const uint8_t *row           = image->data_ + (size_t)y * width;
+    const uint64_t *sums_top     = NULL;
+    const uint64_t *sums_last    = sat->data_ + (size_t)bottom * width;
+    const uint64_t *squares_top  = NULL;
+    const uint64_t *squares_last = NULL;
+    if (top) sums_top = sat->data_ + (size_t)(top - 1) * width;
+    if (method != BRADLEY) {
+        squares_top  = top ? sat->squares_ + (size_t)(top - 1) * width : NULL;
+        squares_last = sat->squares_ + (size_t)bottom * width;
     }
 
-    free(double_data);
-    return pbm_image;
+    for (uint32_t x = 0; x < width; x++) {
+        uint32_t left  = x > radius ? x - radius : 0;
+        uint32_t right = width - 1 - x > radius ? x + radius : width - 1;
+        double area    = (double)(bottom - top + 1) * (right - left + 1);
+        double sum     = (double)WindowSum(sums_top, sums_last, left, right);
+
+        bool black;
+        if (method == BRADLEY) {
+            black = row[x] * area < sum * (1 - k);
+        } else {
+            double mean      = sum / area;
+            double squares   = (double)WindowSum(squares_top, squares_last,
+                                                 left, right);
+            double variance  = squares / area - mean * mean;
+            double deviation = variance > 0 ? sqrt(variance) : 0;
+            double threshold =
+                method == SAUVOLA
+                    ? mean * (1 + k * (deviation / SAUVOLA_RANGE - 1))
+                    : mean + k * deviation;
+            black = row[x] < threshold;
+        }
+        bits[x / 8] |= (uint8_t)(black << (7 - x % 8));
+    }
 }
 
 /**
- * Convert a PGM image to a PBM image using Jarvis, Judice, and Ninke dithering.
+ * Convert a PGM image to a PBM image using adaptive thresholding, as for
+ * scanned documents under uneven lighting. Each pixel is compared with a
+ * threshold from the statistics of the (2 radius + 1)^2 window around it,
+ * clipped to the image. These come from summed area tables of the pixels and,
+ * for SAUVOLA and NIBLACK, of their squares, so the cost per pixel does not
+ * depend on the radius. The rows are thresholded in parallel.
  *
  * @param image     The PGM image to convert.
+ * @param method    The adaptive thresholding method.
+ * @param radius    The radius of the window.
+ * @param k         The parameter of the method, typically 0.15 for BRADLEY,
+ * 0.34 for SAUVOLA and -0.2 for NIBLACK.
  * @return          A pointer to the new PBM image, or NULL if an error
  * occurred.
  */
-PbmImage *PgmToPbmJarvisJudiceNinke(const PgmImage *image) {
+PbmImage *PgmToPbmAdaptive(const PgmImage *image, AdaptiveMethod method,
+                           uint32_t radius, double k) {
     // Allocate memory for new image data
     PbmImage *pbm_image = AllocatePbm(image->width_, image->height_);
+    if (!pbm_image) return NULL;
 
-    // Normalize pixel data to [0, 1] double values
-    double *double_data = NormalizePgm(image);
+    // Sum the pixels, and their squares for the standard deviation
+    SummedAreaTable *sat =
+        method == BRADLEY ? PgmToSat(image) : PgmToSatSquared(image);
+    if (!sat) {
+        FreePbm(pbm_image);
+        return NULL;
+    }
+
+#pragma omp parallel for default(none) \
+    shared(image, method, radius, k, sat, pbm_image)
+    // Threshold each row against the statistics of its windows
+    for (uint32_t y = 0; y < image->height_; y++) {
+        AdaptiveRow(image, sat, method, radius, k, y,
+                    pbm_image->data_ + (size_t)y * pbm_image->stride_);
+    }
 
-    // Convert pixel data using Jarvis, Judice, and Ninke dithering
-    for (uint32_t y = 0; y < pbm_image->height_; y++) {
-        for (uint32_t x = 0; x < pbm_image->width_; x++) {
-            uint32_t pos     = y * pbm_image->width_ + x;
-            double old_pixel = double_data[pos];
-            double new_pixel = round(old_pixel);
+    FreeSat(sat);
+    return pbm_image;
+}
 
-            // Invert pixel value (PBM is white 0 and black 1)
-            pbm_image->data_[pos] = new_pixel == 0;
+/**
+ * Convert a PGM image to a PBM image using Atkinson dithering.
+ *
+ * @param image     The PGM image to convert.
+ * @return          A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+PbmImage *PgmToPbmAtkinson(const PgmImage *image) {
+    return PgmToPbmDiffusion(image, ATKINSON, false);
+}
 
-            // Calculate error
-            double error = old_pixel - new_pixel;
+// Pixels per block of the vectorized ordered dithering loop
+#define ORDERED_BLOCK 64
 
-            // Propagate error
-            if (x < pbm_image->width_ - 1) {
-                double_data[pos + 1] += error * 7 / 48;
-            }
-            if (x < pbm_image->width_ - 2) {
-                double_data[pos + 2] += error * 5 / 48;
-            }
-            if (y < pbm_image->height_ - 1) {
-                if (x > 0) {
-                    double_data[pos + pbm_image->width_ - 1] += error * 3 / 48;
-                }
-                double_data[pos + pbm_image->width_] += error * 5 / 48;
-                if (x < pbm_image->width_ - 1) {
-                    double_data[pos + pbm_image->width_ + 1] += error * 7 / 48;
-                }
-                if (x < pbm_image->width_ - 2) {
-                    double_data[pos + pbm_image->width_ + 2] += error * 5 / 48;
-                }
-            }
-            if (y < pbm_image->height_ - 2) {
-                if (x > 0) {
-                    double_data[pos + 2 * pbm_image->width_ - 1] +=
-                        error * 1 / 48;
-                }
-                double_data[pos + 2 * pbm_image->width_] += error * 3 / 48;
-                if (x < pbm_image->width_ - 1) {
-                    double_data[pos + 2 * pbm_image->width_ + 1] +=
-                        error * 5 / 48;
-                }
-                if (x < pbm_image->width_ - 2) {
-                    double_data[pos + 2 * pbm_image->width_ + 2] +=
-                        error * 3 / 48;
-                }
-            }
-        }
+/**
+ * Tile a row of a threshold map over a span of pixels.
+ *
+ * @param thresholds    The thresholds of the span.
+ * @param count         The number of pixels in the span.
+ * @param x0            The column the span starts at.
+ * @param map_row       The row of the threshold map.
+ * @param map_width     The width of the threshold map.
+ */
+static void TileMapRow(uint8_t *thresholds, uint32_t count, uint32_t x0,
+                       const uint8_t *map_row, uint32_t map_width) {
+    uint32_t offset = x0 % map_width;
+    for (uint32_t i = 0; i < count;) {
+        uint32_t n = map_width - offset < count - i ? map_width - offset
+                                                    : count - i;
+        memcpy(thresholds + i, map_row + offset, n);
+        i      += n;
+        offset  = 0;
     }
-
-    free(double_data);
-    return pbm_image;
 }
 
 /**
- * Write a PBM image to a file.
+ * Dither one row of gray values against a threshold map.
+ * The row of the map is tiled to a multiple of ORDERED_BLOCK pixels once, and
+ * compared and packed straight into PBM bytes a period at a time. Maps whose
+ * width neither divides nor is a multiple of ORDERED_BLOCK are tiled a span
+ * at a time instead.
  *
- * @param filename  The name of the file to write.
- * @param image     The image data to write.
- * @return          True if successful, false otherwise.
+ * @param row       The gray values of the row.
+ * @param width     The number of pixels in the row.
+ * @param map       The threshold map, tiled over the whole image.
+ * @param y         The row of the whole image.
+ * @param bits      The (width + 7) / 8 output bytes.
  */
-bool WritePbm(const PbmImage *image, const char *filename) {
-    // Open file for writing
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        fprintf(stderr, "Error: could not open file '%s' for writing\n",
-                filename);
-        return false;
+static void OrderedRow(const uint8_t *row, uint32_t width, const PgmImage *map,
+                       uint32_t y, uint8_t *bits) {
+    const uint8_t *map_row =
+        map->data_ + (size_t)(y % map->height_) * map->width_;
+    if (map->width_ % ORDERED_BLOCK && ORDERED_BLOCK % map->width_) {
+        uint8_t span[THRESHOLD_SPAN];
+        for (uint32_t x0 = 0; x0 < width; x0 += THRESHOLD_SPAN) {
+            uint32_t count =
+                width - x0 < THRESHOLD_SPAN ? width - x0 : THRESHOLD_SPAN;
+            TileMapRow(span, count, x0, map_row, map->width_);
+            PackBelow(row + x0, span, count, bits + x0 / 8);
+        }
+        return;
     }
 
-    // Write header (magic number, width, height)
-    if (fprintf(fp, "P4\n%u\n%u\n", image->width_, image->height_) < 0) {
-        fprintf(stderr, "Error: could not write header to file '%s'\n",
-                filename);
+    // Tile a narrow map up to a whole span, the period of the thresholds
+    uint8_t tiled[THRESHOLD_SPAN];
+    const uint8_t *thresholds = map_row;
+    uint32_t period           = map->width_;
+    if (period < ORDERED_BLOCK) {
+        TileMapRow(tiled, THRESHOLD_SPAN, 0, map_row, map->width_);
+        thresholds = tiled;
+        period     = THRESHOLD_SPAN;
+    }
+
+    // Compare a period of the thresholds at a time
+    for (uint32_t x = 0; x < width; x += period) {
+        PackBelow(row + x, thresholds, width - x < period ? width - x : period,
+                  bits + x / 8);
+    }
+}
+
+/**
+ * Convert a PGM image to a PBM image using Ordered Dithering.
+ *
+ * @param image     The PGM image to convert.
+ * @return          A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+PbmImage *PgmToPbmOrdered(const PgmImage *image, const PgmImage *map) {
+    // Allocate memory for new image data
+    PbmImage *pbm_image = AllocatePbm(image->width_, image->height_);
+    if (!pbm_image) return NULL;
+
+    // Convert the whole image as a single band
+    PgmToPbmOrderedBand(image, 0, map, pbm_image);
+    return pbm_image;
+}
+
+/**
+ * Convert a band of rows of a PGM image to PBM using Ordered Dithering.
+ *
+ * @param band      The rows of the PGM image to convert.
+ * @param y_offset  The row of the whole image the band starts at.
+ * @param map       The threshold map, tiled over the whole image.
+ * @param out       The PBM band to write to, with room for as many rows as the
+ * PGM band. Its height is set to that of the PGM band.
+ */
+void PgmToPbmOrderedBand(const PgmImage *band, uint32_t y_offset,
+                         const PgmImage *map, PbmImage *out) {
+    out->height_ = band->height_;
+
+#pragma omp parallel for default(none) shared(map, out, band, y_offset)
+    // Convert using Bayer (Ordered) Dithering, a row at a time
+    for (uint32_t y = 0; y < band->height_; y++) {
+        OrderedRow(band->data_ + (size_t)y * band->width_, band->width_, map,
+                   y_offset + y, out->data_ + (size_t)y * out->stride_);
+    }
+}
+
+/**
+ * Read the slices of a threshold volume from the files 0.pgm, 1.pgm, and so
+ * on of a directory, up to the first one that does not exist.
+ *
+ * @param directory The directory of the slices.
+ * @return          A pointer to the volume, or NULL if an error occurred.
+ */
+ThresholdVolume *ReadThresholdVolume(const char *directory) {
+    // Count the slices
+    char path[4096];
+    uint32_t depth = 0;
+    for (;; depth++) {
+        snprintf(path, sizeof path, "%s/%u.pgm", directory, depth);
+        FILE *fp = fopen(path, "rb");
+        if (!fp) break;
         fclose(fp);
+    }
+    if (!depth) {
+        fprintf(stderr, "Error: no threshold maps in directory '%s'\n",
+                directory);
+        return NULL;
+    }
+
+    ThresholdVolume *volume = (ThresholdVolume *)calloc(1, sizeof *volume);
+    if (!volume) {
+        fprintf(stderr, "Error: out of memory\n");
+        return NULL;
+    }
+    volume->depth_ = depth;
+
+    // Copy each slice into place, so that the files are read only once
+    for (uint32_t k = 0; k < depth; k++) {
+        snprintf(path, sizeof path, "%s/%u.pgm", directory, k);
+        PgmImage *slice = MapPgm(path);
+        if (!slice) {
+            FreeThresholdVolume(volume);
+            return NULL;
+        }
+        if (!k) {
+            volume->width_  = slice->width_;
+            volume->height_ = slice->height_;
+            volume->data_   = (uint8_t *)malloc((size_t)slice->width_ *
+                                                slice->height_ * depth);
+            if (!volume->data_) fprintf(stderr, "Error: out of memory\n");
+        } else if (slice->width_ != volume->width_ ||
+                   slice->height_ != volume->height_) {
+            fprintf(stderr, "Error: threshold map '%s' is %ux%u, not %ux%u\n",
+                    path, slice->width_, slice->height_, volume->width_,
+                    volume->height_);
+            FreePgm(slice);
+            FreeThresholdVolume(volume);
+            return NULL;
+        }
+        if (!volume->data_) {
+            FreePgm(slice);
+            FreeThresholdVolume(volume);
+            return NULL;
+        }
+
+        size_t size = (size_t)volume->width_ * volume->height_;
+        memcpy(volume->data_ + k * size, slice->data_, size);
+        FreePgm(slice);
+    }
+
+    return volume;
+}
+
+// The golden ratio conjugate, in units of 2^-32
+#define GOLDEN_RATIO_FRACTION UINT32_C(0x9E3779B9)
+
+/**
+ * Free the PBM images of a sequence and clear their pointers.
+ *
+ * @param images    The PBM images, some of which may be NULL.
+ * @param count     The number of images.
+ */
+static void FreePbmSequence(PbmImage **images, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (images[i]) FreePbm(images[i]);
+        images[i] = NULL;
+    }
+}
+
+/**
+ * Convert a sequence of PGM frames to PBM images using Ordered Dithering, with
+ * the slices of a threshold volume as the maps. Frames are dithered in
+ * parallel.
+ *
+ * @param frames    The PGM frames to convert.
+ * @param count     The number of frames.
+ * @param first     The index of the first frame in the whole sequence.
+ * @param volume    The threshold volume.
+ * @param order     How each frame picks its thresholds from the volume.
+ * @param out       The count PBM images to write to, set to NULL on error.
+ * @return          Whether all frames were converted.
+ */
+bool PgmToPbmSequence(const PgmImage *const *frames, uint32_t count,
+                      uint32_t first, const ThresholdVolume *volume,
+                      SequenceOrder order, PbmImage **out) {
+    // Allocate all frames up front
+    bool ok = true;
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = ok ? AllocatePbm(frames[i]->width_, frames[i]->height_) : NULL;
+        ok     = ok && out[i];
+    }
+    if (!ok) {
+        FreePbmSequence(out, count);
         return false;
     }
 
-    // Allocate buffer for encoded pixel data
-    size_t buffer_size = (image->width_ * image->height_ + 7) / 8;
-    uint8_t *buffer    = (uint8_t *)calloc(1, buffer_size);
-    if (!buffer) {
+    size_t size        = (size_t)volume->width_ * volume->height_;
+    bool out_of_memory = false;
+#pragma omp parallel for default(none) if (count > 1) \
+    shared(frames, count, first, volume, order, out, size, out_of_memory)
+    // Dither a frame per thread. A lone frame is dithered a row per thread.
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t frame = first + i;
+        PgmImage map   = {volume->width_, volume->height_, PGM_MAX_GRAY,
+                          volume->data_ + frame % volume->depth_ * size,
+                          {NULL, 0}};
+
+        // Rotate the thresholds by the fractional part of frame / phi
+        uint8_t *rotated = NULL;
+        if (order == SEQUENCE_GOLDEN_RATIO) {
+            rotated = (uint8_t *)malloc(size);
+            if (!rotated) {
+#pragma omp atomic write
+                out_of_memory = true;
+                continue;
+            }
+            uint8_t shift = (uint8_t)(frame * GOLDEN_RATIO_FRACTION >> 24);
+            for (size_t j = 0; j < size; j++)
+                rotated[j] = (uint8_t)(map.data_[j] + shift);
+            map.data_ = rotated;
+        }
+
+        PgmToPbmOrderedBand(frames[i], 0, &map, out[i]);
+        free(rotated);
+    }
+
+    if (out_of_memory) {
         fprintf(stderr, "Error: out of memory\n");
-        fclose(fp);
+        FreePbmSequence(out, count);
         return false;
     }
+    return true;
+}
+
+/**
+ * Free the memory used by a threshold volume.
+ *
+ * @param volume    The volume to free.
+ */
+void FreeThresholdVolume(ThresholdVolume *volume) {
+    free(volume->data_);
+    free(volume);
+}
+
+/**
+ * Convert a PGM image to a PBM image using Floyd–Steinberg dithering.
+ *
+ * @param image     The PGM image to convert.
+ * @return          A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+PbmImage *PgmToPbmFloydSteinberg(const PgmImage *image) {
+    return PgmToPbmDiffusion(image, FLOYD_STEINBERG, false);
+}
+
+/**
+ * Convert a PGM image to a PBM image using Jarvis, Judice, and Ninke dithering.
+ *
+ * @param image     The PGM image to convert.
+ * @return          A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+PbmImage *PgmToPbmJarvisJudiceNinke(const PgmImage *image) {
+    return PgmToPbmDiffusion(image, JARVIS_JUDICE_NINKE, false);
+}
+
+// Fixed-point precision of diffused error
+#define DIFFUSION_SHIFT 8
+
+// The taps of each error diffusion kernel, as TAP(dx, dy, weight) in scan
+// order. The weights are in units of the divisor in DIFFUSION_KERNELS.
+#define FLOYD_STEINBERG_TAPS(TAP) \
+    TAP(1, 0, 7) TAP(-1, 1, 3) TAP(0, 1, 5) TAP(1, 1, 1)
+#define ATKINSON_TAPS(TAP)                                       \
+    TAP(1, 0, 1) TAP(-1, 1, 1) TAP(0, 1, 1) TAP(1, 1, 1)         \
+    TAP(2, 1, 1) TAP(-1, 2, 1) TAP(0, 2, 1) TAP(1, 2, 1)
+#define JARVIS_JUDICE_NINKE_TAPS(TAP)                            \
+    TAP(1, 0, 7) TAP(2, 0, 5) TAP(-1, 1, 3) TAP(0, 1, 5)         \
+    TAP(1, 1, 7) TAP(2, 1, 5) TAP(-1, 2, 1) TAP(0, 2, 3)         \
+    TAP(1, 2, 5) TAP(2, 2, 3)
+#define STUCKI_TAPS(TAP)                                         \
+    TAP(1, 0, 8) TAP(2, 0, 4) TAP(-2, 1, 2) TAP(-1, 1, 4)        \
+    TAP(0, 1, 8) TAP(1, 1, 4) TAP(2, 1, 2) TAP(-2, 2, 1)         \
+    TAP(-1, 2, 2) TAP(0, 2, 4) TAP(1, 2, 2) TAP(2, 2, 1)
+#define BURKES_TAPS(TAP)                                         \
+    TAP(1, 0, 8) TAP(2, 0, 4) TAP(-2, 1, 2) TAP(-1, 1, 4)        \
+    TAP(0, 1, 8) TAP(1, 1, 4) TAP(2, 1, 2)
+#define SIERRA_TAPS(TAP)                                         \
+    TAP(1, 0, 5) TAP(2, 0, 3) TAP(-2, 1, 2) TAP(-1, 1, 4)        \
+    TAP(0, 1, 5) TAP(1, 1, 4) TAP(2, 1, 2) TAP(-1, 2, 2)         \
+    TAP(0, 2, 3) TAP(1, 2, 2)
+#define TWO_ROW_SIERRA_TAPS(TAP)                                 \
+    TAP(1, 0, 4) TAP(2, 0, 3) TAP(-2, 1, 1) TAP(-1, 1, 2)        \
+    TAP(0, 1, 3) TAP(1, 1, 2) TAP(2, 1, 1)
+#define SIERRA_LITE_TAPS(TAP) TAP(1, 0, 2) TAP(-1, 1, 1) TAP(0, 1, 1)
+
+// Every error diffusion kernel, as KERNEL(enum, name, divisor)
+#define DIFFUSION_KERNELS(KERNEL)                      \
+    KERNEL(FLOYD_STEINBERG, FloydSteinberg, 16)        \
+    KERNEL(ATKINSON, Atkinson, 8)                      \
+    KERNEL(JARVIS_JUDICE_NINKE, JarvisJudiceNinke, 48) \
+    KERNEL(STUCKI, Stucki, 42)                         \
+    KERNEL(BURKES, Burkes, 32)                         \
+    KERNEL(SIERRA, Sierra, 32)                         \
+    KERNEL(TWO_ROW_SIERRA, TwoRowSierra, 16)           \
+    KERNEL(SIERRA_LITE, SierraLite, 4)
+
+/**
+ * A single tap of an error diffusion kernel.
+ */
+typedef struct {
+    int8_t dx_;     // Column offset from the current pixel.
+    int8_t dy_;     // Row offset from the current pixel.
+    uint8_t weight_;// Share of the error, in units of the kernel divisor.
+} DiffusionTap;
+
+// Error diffusion of the pixels begin to end - 1 of a row, whose taps all
+// land within the row, from right to left if reverse is set
+typedef void (*DiffuseSpanFn)(const uint8_t *row, int32_t *const errors[3],
+                              uint8_t *bits, int64_t begin, int64_t end,
+                              bool reverse);
+
+/**
+ * The taps and divisor of an error diffusion kernel.
+ */
+typedef struct {
+    const DiffusionTap *taps_;// The taps, in scan order.
+    uint8_t tap_count_;       // The number of taps.
+    uint8_t divisor_;         // The divisor of the tap weights.
+    DiffuseSpanFn interior_;  // The kernel's unrolled loop, away from edges.
+} DiffusionKernelInfo;
+
+/**
+ * Dither one pixel using error diffusion.
+ * Values are kept in units of 2^-DIFFUSION_SHIFT / divisor gray levels, so
+ * spreading the error over the taps is exact.
+ *
+ * @param row       The gray values of the row.
+ * @param errors    The error diffused into the row.
+ * @param bits      The output bytes of the row, zeroed beforehand.
+ * @param x         The column of the pixel.
+ * @param divisor   The divisor of the kernel's tap weights.
+ * @return          The error to spread, rounded to units of
+ * 2^-DIFFUSION_SHIFT gray levels.
+ */
+static inline int32_t DiffusePixel(const uint8_t *row, const int32_t *errors,
+                                   uint8_t *bits, int64_t x, int32_t divisor) {
+    int32_t white      = (PGM_MAX_GRAY << DIFFUSION_SHIFT) * divisor;
+    int64_t reciprocal = ((INT64_C(1) << 32) + divisor / 2) / divisor;
+    int32_t value      = (row[x] << DIFFUSION_SHIFT) * divisor + errors[x];
+
+    // Invert pixel value (PBM is white 0 and black 1)
+    bool black = value < white / 2;
+    bits[x / 8] |= (uint8_t)(black << (7 - x % 8));
+
+    // Calculate error
+    int64_t scaled = (int64_t)(black ? value : value - white) * reciprocal;
+    return (int32_t)((scaled + (INT64_C(1) << 31)) >> 32);
+}
+
+// Stamp out each kernel's tap table and its loop over the interior of a row,
+// with the taps unrolled and the divisor a constant. Odd rows of a serpentine
+// scan run from right to left with the taps mirrored.
+#define DIFFUSION_TAP(dx, dy, weight) {dx, dy, weight},
+#define DIFFUSION_SPREAD(dx, dy, weight) \
+    errors[dy][x + (dx)] += error * (weight);
+#define DIFFUSION_SPREAD_MIRRORED(dx, dy, weight) \
+    errors[dy][x - (dx)] += error * (weight);
+#define DEFINE_DIFFUSION_KERNEL(kernel, name, divisor)                         \
+    static const DiffusionTap k##name##Taps[] = {                             \
+        kernel##_TAPS(DIFFUSION_TAP)};                                        \
+    static void Diffuse##name(const uint8_t *row, int32_t *const errors[3],   \
+                              uint8_t *bits, int64_t begin, int64_t end,      \
+                              bool reverse) {                                 \
+        if (!reverse) {                                                       \
+            for (int64_t x = begin; x < end; x++) {                           \
+                int32_t error = DiffusePixel(row, errors[0], bits, x,         \
+                                             divisor);                        \
+                kernel##_TAPS(DIFFUSION_SPREAD)                               \
+            }                                                                 \
+        } else {                                                              \
+            for (int64_t x = end - 1; x >= begin; x--) {                      \
+                int32_t error = DiffusePixel(row, errors[0], bits, x,         \
+                                             divisor);                        \
+                kernel##_TAPS(DIFFUSION_SPREAD_MIRRORED)                      \
+            }                                                                 \
+        }                                                                     \
+    }
+DIFFUSION_KERNELS(DEFINE_DIFFUSION_KERNEL)
+
+#define DIFFUSION_KERNEL_INFO(kernel, name, divisor)                         \
+    [kernel] = {k##name##Taps, sizeof k##name##Taps / sizeof(DiffusionTap), \
+                divisor, Diffuse##name},
+static const DiffusionKernelInfo kDiffusionKernels[] = {
+    DIFFUSION_KERNELS(DIFFUSION_KERNEL_INFO)};
+
+/**
+ * Get the largest column offset of the taps of an error diffusion kernel.
+ *
+ * @param kernel    The error diffusion kernel.
+ * @return          The largest |dx| of its taps.
+ */
+static uint32_t DiffusionReach(const DiffusionKernelInfo *kernel) {
+    uint32_t reach = 0;
+    for (uint8_t i = 0; i < kernel->tap_count_; i++) {
+        uint32_t dx = (uint32_t)abs(kernel->taps_[i].dx_);
+        if (dx > reach) reach = dx;
+    }
+    return reach;
+}
+
+/**
+ * Create the state of a band-by-band error diffusion ditherer.
+ *
+ * @param kernel        The error diffusion kernel to use.
+ * @param serpentine    True to scan odd rows from right to left.
+ * @param width         The width of the image.
+ * @return              A pointer to the state, or NULL if an error occurred.
+ */
+DiffusionState *CreateDiffusionState(DiffusionKernel kernel, bool serpentine,
+                                     uint32_t width) {
+    DiffusionState *state = (DiffusionState *)malloc(sizeof(DiffusionState));
+    if (!state) {
+        fprintf(stderr, "Error: out of memory\n");
+        return NULL;
+    }
+    state->kernel_     = kernel;
+    state->serpentine_ = serpentine;
+    state->width_      = width;
+    state->row_        = 0;
+    state->errors_ = (int32_t *)calloc(3 * (size_t)width, sizeof(int32_t));
+    if (!state->errors_) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(state);
+        return NULL;
+    }
+    return state;
+}
+
+/**
+ * Wait until a row of an error diffusion wavefront has progressed far enough.
+ *
+ * @param progress  The number of pixels of the row that are done.
+ * @param needed    The number of pixels that must be done.
+ */
+static void AwaitProgress(const _Atomic uint32_t *progress, uint32_t needed) {
+    for (uint32_t spins = 0;
+         atomic_load_explicit(progress, memory_order_acquire) < needed;
+         spins++) {
+#if defined __unix__ || defined __APPLE__
+        // Let the thread we wait for run if the cores are oversubscribed
+        if (spins % 1024 == 1023) sched_yield();
+#endif
+#if defined __SSE2__
+        _mm_pause();
+#endif
+    }
+}
+
+/**
+ * Dither a span of pixels of a row using error diffusion. The pixels whose
+ * taps all land within the row go through the kernel's unrolled loop, those
+ * near the edges through its tap table.
+ *
+ * @param kernel    The error diffusion kernel.
+ * @param row       The gray values of the row.
+ * @param width     The width of the row.
+ * @param errors    The error of this row and of the two rows below it.
+ * @param bits      The output bytes of the row, zeroed beforehand.
+ * @param begin     The first column of the span.
+ * @param end       The column after the last one of the span.
+ * @param reverse   True to scan from right to left, with the taps mirrored.
+ */
+static void DiffuseSpan(const DiffusionKernelInfo *kernel, const uint8_t *row,
+                        uint32_t width, int32_t *const errors[3],
+                        uint8_t *bits, int64_t begin, int64_t end,
+                        bool reverse) {
+    // Split the span into the parts before, within, and after the interior
+    int64_t reach = DiffusionReach(kernel);
+    int64_t low   = reach < begin ? begin : reach > end ? end : reach;
+    int64_t high  = (int64_t)width - reach;
+    high          = high < low ? low : high > end ? end : high;
+
+    int64_t parts[3][2] = {{begin, low}, {low, high}, {high, end}};
+    for (int part = 0; part < 3; part++) {
+        const int64_t *bounds = parts[reverse ? 2 - part : part];
+        if (bounds[0] == bounds[1]) continue;
+        if (bounds == parts[1]) {
+            kernel->interior_(row, errors, bits, bounds[0], bounds[1],
+                              reverse);
+            continue;
+        }
+
+        // Near an edge, drop the taps that fall outside the row
+        for (int64_t i = 0; i < bounds[1] - bounds[0]; i++) {
+            int64_t x     = reverse ? bounds[1] - 1 - i : bounds[0] + i;
+            int32_t error = DiffusePixel(row, errors[0], bits, x,
+                                         kernel->divisor_);
+            for (uint8_t t = 0; t < kernel->tap_count_; t++) {
+                const DiffusionTap *tap = &kernel->taps_[t];
+                int64_t tx = reverse ? x - tap->dx_ : x + tap->dx_;
+                if (tx < 0 || tx >= width) continue;
+                errors[tap->dy_][tx] += error * tap->weight_;
+            }
+        }
+    }
+}
+
+/**
+ * Dither one row using error diffusion, then clear its error.
+ * In a wavefront, the row only reads and writes error that the row above is
+ * done with, by trailing it by at least lag pixels.
+ *
+ * @param kernel    The error diffusion kernel.
+ * @param row       The gray values of the row.
+ * @param width     The width of the row.
+ * @param errors    The error of this row and of the two rows below it.
+ * @param bits      The (width + 7) / 8 output bytes.
+ * @param reverse   True to scan from right to left, not in a wavefront.
+ * @param above     The progress of the row above, or NULL if it is done.
+ * @param progress  The progress of this row, or NULL if not in a wavefront.
+ * @param lag       The number of pixels to trail the row above by.
+ */
+static void DiffuseRow(const DiffusionKernelInfo *kernel, const uint8_t *row,
+                       uint32_t width, int32_t *const errors[3], uint8_t *bits,
+                       bool reverse, const _Atomic uint32_t *above,
+                       _Atomic uint32_t *progress, uint32_t lag) {
+    memset(bits, 0, (width + 7) / 8);
+    if (!progress) {
+        DiffuseSpan(kernel, row, width, errors, bits, 0, width, reverse);
+    } else {
+        // Publish every finished byte, except the last one
+        for (uint32_t x = 0; x < width; x += 8) {
+            uint32_t end = width - x < 8 ? width : x + 8;
+            if (above) {
+                uint64_t needed = (uint64_t)x + 7 + lag;
+                AwaitProgress(above, needed < width ? (uint32_t)needed : width);
+            }
+            DiffuseSpan(kernel, row, width, errors, bits, x, end, false);
+            if (end < width)
+                atomic_store_explicit(progress, end, memory_order_release);
+        }
+    }
+
+    // This row is done, its slot can now hold a row further down
+    memset(errors[0], 0, width * sizeof(int32_t));
+    if (progress) atomic_store_explicit(progress, width, memory_order_release);
+}
+
+/**
+ * Dither the next band of rows of a PGM image using error diffusion.
+ * Error diffused past the bottom of the band is carried in the state and
+ * applied to the next band.
+ *
+ * @param state     The state of the ditherer.
+ * @param band      The next rows of the PGM image.
+ * @param out       The PBM band to write to, with room for as many rows as the
+ * PGM band. Its height is set to that of the PGM band.
+ */
+void PgmToPbmDiffusionBand(DiffusionState *state, const PgmImage *band,
+                           PbmImage *out) {
+    const DiffusionKernelInfo *kernel = &kDiffusionKernels[state->kernel_];
+    uint32_t width                    = state->width_;
+    out->height_                      = band->height_;
+
+    for (uint32_t y = 0; y < band->height_; y++) {
+        int32_t *const errors[3] = {
+            state->errors_ + (size_t)(state->row_ % 3) * width,
+            state->errors_ + (size_t)((state->row_ + 1) % 3) * width,
+            state->errors_ + (size_t)((state->row_ + 2) % 3) * width};
+        bool reverse = state->serpentine_ && state->row_ % 2;
+        DiffuseRow(kernel, band->data_ + (size_t)y * width, width, errors,
+                   out->data_ + (size_t)y * out->stride_, reverse, NULL, NULL,
+                   0);
+        state->row_++;
+    }
+}
+
+/**
+ * Free the state of a band-by-band error diffusion ditherer.
+ *
+ * @param state     The state to free.
+ */
+void FreeDiffusionState(DiffusionState *state) {
+    free(state->errors_);
+    free(state);
+}
+
+/**
+ * Dither a whole image using error diffusion, with the rows spread over the
+ * threads as a diagonal wavefront. Each row trails the row above it by
+ * 2 * max |dx| + 1 pixels of the kernel, so that no two rows touch the same
+ * error at the same time. The error is added up in a different order than in
+ * a single thread, which gives the same result since it is integer.
+ *
+ * @param image     The PGM image to dither.
+ * @param kernel    The error diffusion kernel.
+ * @param threads   The number of threads.
+ * @param out       The PBM image to write to.
+ * @return          True if successful, false otherwise.
+ */
+static bool DiffuseWavefront(const PgmImage *image,
+                             const DiffusionKernelInfo *kernel,
+                             uint32_t threads, PbmImage *out) {
+    uint32_t width  = image->width_;
+    uint32_t height = image->height_;
+
+    // Derive the lag from the footprint of the kernel
+    uint32_t lag = 2 * DiffusionReach(kernel) + 1;
 
-#pragma omp parallel for default(none) shared(image, buffer)
-    // Encode pixel data
-    for (size_t i = 0; i < image->width_ * image->height_; i++) {
-        buffer[i / 8] |= (image->data_[i] << (7 - i % 8));
+    // A thread only starts a row once its previous row is done, so the rows
+    // below that one are the only ones that can hold error
+    uint32_t ring   = threads + 2;
+    int32_t *errors = (int32_t *)calloc((size_t)ring * width, sizeof(int32_t));
+    _Atomic uint32_t *progress =
+        (_Atomic uint32_t *)calloc(height, sizeof(_Atomic uint32_t));
+    if (!errors || !progress) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(errors);
+        free(progress);
+        return false;
+    }
+
+#pragma omp parallel for default(none) schedule(static, 1) \
+    shared(image, kernel, out, width, height, lag, ring, errors, progress)
+    // Hand the rows out round-robin, each trailing the row above
+    for (uint32_t y = 0; y < height; y++) {
+        int32_t *const row_errors[3] = {
+            errors + (size_t)(y % ring) * width,
+            errors + (size_t)((y + 1) % ring) * width,
+            errors + (size_t)((y + 2) % ring) * width};
+        DiffuseRow(kernel, image->data_ + (size_t)y * width, width, row_errors,
+                   out->data_ + (size_t)y * out->stride_, false,
+                   y ? &progress[y - 1] : NULL, &progress[y], lag);
+    }
+
+    free(errors);
+    free(progress);
+    return true;
+}
+
+/**
+ * Convert a PGM image to a PBM image using error diffusion.
+ * The error is carried in fixed point, in a ring of three rows, and rounded
+ * to 2^-8 of a gray level once per pixel. A pixel whose diffused value lands
+ * within that rounding of the threshold can come out differently than with
+ * exact arithmetic, and the pattern after it then shifts. The tone does not:
+ * averages over 16x16 blocks stay within about 2.5 gray levels of those of a
+ * double-precision ditherer, and as close to the source.
+ * With several threads, the rows are dithered in parallel as a diagonal
+ * wavefront, with the same result as in a single thread. A serpentine scan
+ * runs odd rows from right to left, which breaks up the directional
+ * artifacts of a raster scan but dithers in a single thread.
+ *
+ * @param image         The PGM image to convert.
+ * @param kernel        The error diffusion kernel to use.
+ * @param serpentine    True to scan odd rows from right to left.
+ * @return              A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+PbmImage *PgmToPbmDiffusion(const PgmImage *image, DiffusionKernel kernel,
+                             bool serpentine) {
+    // Allocate memory for new image data
+    PbmImage *pbm_image = AllocatePbm(image->width_, image->height_);
+    if (!pbm_image) return NULL;
+
+#if defined _OPENMP
+    // Spread the rows over the threads if there is more than one. A row
+    // scanned from right to left waits on the whole row above, so serpentine
+    // scans stay in a single thread.
+    uint32_t threads = (uint32_t)omp_get_max_threads();
+    if (threads > 1 && image->height_ > 1 && !serpentine) {
+        if (!DiffuseWavefront(image, &kDiffusionKernels[kernel], threads,
+                              pbm_image)) {
+            FreePbm(pbm_image);
+            return NULL;
+        }
+        return pbm_image;
+    }
+#endif
+
+    // Otherwise dither the whole image as a single band
+    DiffusionState *state =
+        CreateDiffusionState(kernel, serpentine, image->width_);
+    if (!state) {
+        FreePbm(pbm_image);
+        return NULL;
+    }
+    PgmToPbmDiffusionBand(state, image, pbm_image);
+    FreeDiffusionState(state);
+    return pbm_image;
+}
+
+// Knuth's 8x8 class matrix for dot diffusion
+static const uint8_t kKnuthClassMatrix[8 * 8] = {
+    34, 48, 40, 32, 29, 15, 23, 31,
+    42, 58, 56, 53, 21,  5,  7, 10,
+    50, 62, 61, 45, 13,  1,  2, 18,
+    38, 46, 54, 37, 25, 17,  9, 26,
+    28, 14, 22, 30, 35, 49, 41, 33,
+    20,  4,  6, 11, 43, 59, 57, 52,
+    12,  0,  3, 19, 51, 63, 60, 44,
+    24, 16,  8, 27, 39, 47, 55, 36};
+
+// A 16x16 class matrix for dot diffusion, annealed first for few barons and
+// near-barons, then for the Gaussian-blurred error of dithered ramps and flat
+// patches, as a perceptual proxy
+static const uint8_t kClassMatrix16[16 * 16] = {
+    122, 188, 136, 143, 210,  82, 115,  77,
+    240, 246, 113, 139, 245, 165, 150,  94,
+     20, 149, 124, 172, 221, 170,   3, 141,
+    220,  58, 250,  19, 253, 118, 216,  33,
+     31,  85,  30,  64, 174, 234, 148, 251,
+    158, 209, 219, 226,  42, 231, 107, 134,
+     76,  38, 111, 146,  73, 192, 242,  83,
+     74, 181, 132, 211, 169, 197, 130, 182,
+    203,  96,   1,   9,  48,  60, 238, 241,
+    196, 198,  62, 126,  80,  63,  75, 177,
+    223, 214,  59,   2, 166, 168, 129,  10,
+    228, 109, 162,  34,  97,  78, 106,  54,
+     15,  23, 206, 233, 224,   4, 152,  27,
+    180, 110,  45, 184, 179, 255,  46, 235,
+     90, 205,  39,  99, 200, 108, 160, 187,
+     87, 175,  41, 133,  32, 230, 252, 249,
+    227, 116,  14,  22,  91,  29, 215, 237,
+     40,  51,   8,  81,  84, 101, 218, 204,
+    207,  16, 145,   6,  79,  25,  36,   0,
+     24,  55, 135, 157, 189, 193, 212,  93,
+     92,  86, 119, 156, 140,  13,  89,  61,
+     57,  56,  71, 217, 163, 167, 208,  44,
+    195, 202, 225,  35, 222, 154,  47,  98,
+    142,  21,  70, 173,  11,  52, 201,  18,
+     69, 183, 103, 229,  12, 199,  67,   5,
+    121, 144, 161,  17,  88, 104, 147, 159,
+    151, 254, 247, 105, 194,  26, 191,  95,
+    155, 213,  50, 176, 153,  68,   7,  28,
+    186, 178, 248, 243, 190,  66, 127, 102,
+    100, 120, 131, 239, 123, 128, 125, 164,
+    114, 185, 232, 236,  53, 171,  43,  72,
+    138, 137, 117, 244,  37, 112,  49,  65};
+
+/**
+ * A neighbor that takes a share of the error of a dot diffusion class.
+ */
+typedef struct {
+    int8_t dx_;      // Column offset from the pixel.
+    int8_t dy_;      // Row offset from the pixel.
+    int8_t tile_dx_; // Offset of the tile of the neighbor, -1, 0 or 1.
+    int8_t tile_dy_; // Offset of the tile row of the neighbor, -1, 0 or 1.
+    uint16_t class_; // The class of the neighbor.
+    int64_t share_;  // The share of the error away from the image edges, in
+                     // units of 2^-32.
+} DotNeighbor;
+
+/**
+ * The pixel of a dot diffusion class within its tile, and the neighbors that
+ * take its error.
+ */
+typedef struct {
+    uint8_t x_;                 // The column of the pixel in its tile.
+    uint8_t y_;                 // The row of the pixel in its tile.
+    uint8_t count_;             // The number of neighbors of higher classes.
+    DotNeighbor neighbors_[8];  // The neighbors of higher classes.
+} DotClass;
+
+/**
+ * A class matrix for dot diffusion and its classes in order.
+ */
+typedef struct {
+    uint8_t size_;          // The width and height of the matrix.
+    const uint8_t *matrix_; // The class of each pixel, in row-major order.
+    DotClass *classes_;     // The pixel and neighbors of each class.
+} ClassMatrixInfo;
+
+static DotClass kKnuthClasses[8 * 8];
+static DotClass kClasses16[16 * 16];
+
+// Indexed by ClassMatrix
+static const ClassMatrixInfo kClassMatrices[] = {
+    {8, kKnuthClassMatrix, kKnuthClasses},
+    {16, kClassMatrix16, kClasses16}};
+
+/**
+ * The share of the error of a pixel that a neighbor takes.
+ *
+ * @param weight    The weight of the neighbor, 2 beside or 1 diagonal.
+ * @param total     The total weight of the neighbors taking the error.
+ * @return          The share, in units of 2^-32.
+ */
+static inline int64_t DotShare(int32_t weight, int32_t total) {
+    return weight * (((INT64_C(1) << 32) + total / 2) / total);
+}
+
+/**
+ * The weight of a neighbor in the error spread by dot diffusion.
+ *
+ * @param dx        The column offset of the neighbor.
+ * @param dy        The row offset of the neighbor.
+ * @return          2 for a neighbor beside the pixel, 1 for a diagonal one.
+ */
+static inline int32_t DotWeight(int32_t dx, int32_t dy) {
+    return dx && dy ? 1 : 2;
+}
+
+/**
+ * Find the pixel and the neighbors of higher classes of each class of the
+ * class matrices. The matrices wrap around, as they are tiled.
+ */
+__attribute__((constructor)) static void InitClassMatrices(void) {
+    for (size_t m = 0; m < sizeof kClassMatrices / sizeof *kClassMatrices;
+         m++) {
+        const ClassMatrixInfo *info = &kClassMatrices[m];
+        int32_t size                = info->size_;
+        for (int32_t y = 0; y < size; y++) {
+            for (int32_t x = 0; x < size; x++) {
+                uint16_t c    = info->matrix_[y * size + x];
+                DotClass *dot = &info->classes_[c];
+                dot->x_       = (uint8_t)x;
+                dot->y_       = (uint8_t)y;
+                dot->count_   = 0;
+
+                // Weigh the neighbors of higher classes, then share the
+                // error among them
+                uint16_t classes[9];
+                int32_t total = 0;
+                for (int32_t i = 0; i < 9; i++) {
+                    int32_t nx = (x + i % 3 - 1 + size) % size;
+                    int32_t ny = (y + i / 3 - 1 + size) % size;
+                    classes[i] = info->matrix_[ny * size + nx];
+                    if (classes[i] > c)
+                        total += DotWeight(i % 3 - 1, i / 3 - 1);
+                }
+                for (int32_t i = 0; i < 9; i++) {
+                    int32_t dx = i % 3 - 1;
+                    int32_t dy = i / 3 - 1;
+                    if (classes[i] <= c) continue;
+                    dot->neighbors_[dot->count_++] = (DotNeighbor){
+                        (int8_t)dx, (int8_t)dy,
+                        (int8_t)(x + dx < 0 ? -1 : x + dx >= size),
+                        (int8_t)(y + dy < 0 ? -1 : y + dy >= size),
+                        classes[i], DotShare(DotWeight(dx, dy), total)};
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Dither one pixel using dot diffusion.
+ *
+ * @param value     The gray value of the pixel plus the error spread into it,
+ * in units of 2^-DIFFUSION_SHIFT gray levels.
+ * @param bits      The output bytes of the row, zeroed beforehand.
+ * @param x         The column of the pixel.
+ * @return          The error to spread.
+ */
+static inline int32_t DotPixel(int32_t value, uint8_t *bits, uint32_t x) {
+    int32_t white = PGM_MAX_GRAY << DIFFUSION_SHIFT;
+
+    // Invert pixel value (PBM is white 0 and black 1)
+    bool black = value < white / 2;
+    bits[x / 8] |= (uint8_t)(black << (7 - x % 8));
+    return black ? value : value - white;
+}
+
+/**
+ * The share of an error that a neighbor takes.
+ *
+ * @param error     The error of the pixel.
+ * @param share     The share of the neighbor, in units of 2^-32.
+ * @return          The error to add to the neighbor.
+ */
+static inline int32_t DotSpread(int32_t error, int64_t share) {
+    return (int32_t)((error * share + (INT64_C(1) << 31)) >> 32);
+}
+
+/**
+ * Dither the pixel of a dot diffusion class in one tile at an edge of the
+ * image, sharing its error among the neighbors within the image.
+ *
+ * @param dot       The class.
+ * @param value     The value of the pixel, in the plane of its class.
+ * @param offsets   The offset of the value of each neighbor from value.
+ * @param x         The column of the pixel.
+ * @param y         The row of the pixel.
+ * @param width     The width of the image.
+ * @param height    The height of the image.
+ * @param bits      The output bytes of the row, zeroed beforehand.
+ */
+static void DotDiffuseEdge(const DotClass *dot, int32_t *value,
+                           const ptrdiff_t *offsets, uint32_t x, uint32_t y,
+                           uint32_t width, uint32_t height, uint8_t *bits) {
+    int32_t error = DotPixel(*value, bits, x);
+    int32_t weights[8];
+    int32_t total = 0;
+    for (uint8_t i = 0; i < dot->count_; i++) {
+        const DotNeighbor *n = &dot->neighbors_[i];
+        bool inside = (int64_t)x + n->dx_ >= 0 &&
+                      (int64_t)x + n->dx_ < width &&
+                      (int64_t)y + n->dy_ >= 0 && (int64_t)y + n->dy_ < height;
+        weights[i]  = inside ? DotWeight(n->dx_, n->dy_) : 0;
+        total      += weights[i];
+    }
+    for (uint8_t i = 0; i < dot->count_; i++) {
+        if (weights[i])
+            value[offsets[i]] += DotSpread(error, DotShare(weights[i], total));
+    }
+}
+
+/**
+ * Dither the pixels of a dot diffusion class in one row of tiles.
+ * Pixels away from the image edges spread their error with the shares of the
+ * class. Those at an edge share it among the neighbors within the image.
+ *
+ * @param info      The class matrix.
+ * @param c         The class.
+ * @param values    The values of the pixels, one plane per class, each with
+ * one value per tile.
+ * @param tiles_x   The number of tiles in a row.
+ * @param plane     The distance between planes.
+ * @param ty        The row of tiles.
+ * @param image     The PGM image, for its size.
+ * @param out       The PBM image to write to, zeroed beforehand.
+ */
+static void DotDiffuseTiles(const ClassMatrixInfo *info, uint16_t c,
+                            int32_t *values, uint32_t tiles_x, size_t plane,
+                            uint32_t ty, const PgmImage *image,
+                            PbmImage *out) {
+    const DotClass *dot = &info->classes_[c];
+    uint32_t size       = info->size_;
+    uint32_t width      = image->width_;
+    uint32_t height     = image->height_;
+    uint32_t x0         = dot->x_;
+    uint32_t y          = ty * size + dot->y_;
+    if (y >= height || x0 >= width) return;
+    int32_t *value = values + c * plane + (size_t)ty * tiles_x;
+    uint8_t *bits  = out->data_ + (size_t)y * out->stride_;
+
+    // Keep the neighbors in locals, which the output bytes cannot alias
+    uint8_t count = dot->count_;
+    ptrdiff_t offsets[8];
+    int64_t shares[8];
+    for (uint8_t i = 0; i < count; i++) {
+        const DotNeighbor *n = &dot->neighbors_[i];
+        offsets[i] = ((ptrdiff_t)n->class_ - c) * (ptrdiff_t)plane +
+                     (ptrdiff_t)n->tile_dy_ * tiles_x + n->tile_dx_;
+        shares[i]  = n->share_;
+    }
+
+    // The tiles whose pixel of the class has all its neighbors in the image
+    uint32_t tiles_in = (width - 1 - x0) / size + 1;
+    uint32_t begin    = 0;
+    uint32_t end      = 0;
+    if (y > 0 && y + 1 < height && width > x0 + 1) {
+        begin = x0 ? 0 : 1;
+        end   = (width - 2 - x0) / size + 1;
+    }
+
+    for (uint32_t tx = 0; tx < begin; tx++) {
+        DotDiffuseEdge(dot, value + tx, offsets, tx * size + x0, y, width,
+                       height, bits);
+    }
+    for (uint32_t tx = begin; tx < end; tx++) {
+        int32_t error = DotPixel(value[tx], bits, tx * size + x0);
+        for (uint8_t i = 0; i < count; i++)
+            value[(ptrdiff_t)tx + offsets[i]] += DotSpread(error, shares[i]);
+    }
+    for (uint32_t tx = end > begin ? end : begin; tx < tiles_in; tx++) {
+        DotDiffuseEdge(dot, value + tx, offsets, tx * size + x0, y, width,
+                       height, bits);
+    }
+}
+
+/**
+ * Convert a PGM image to a PBM image using Knuth's dot diffusion.
+ * The image is tiled with a class matrix, and the pixels are dithered a class
+ * at a time, each spreading its error over the neighbors of higher classes,
+ * twice as much to those beside it as to those diagonal to it. A pixel with
+ * no such neighbor, a baron, drops its error. All tiles dither their pixel of
+ * a class at once, in parallel, so unlike error diffusion this scales with
+ * the number of threads. The error is carried in fixed point, in one plane
+ * per class, so that each class streams through memory.
+ *
+ * @param image     The PGM image to convert.
+ * @param matrix    The class matrix to use.
+ * @return          A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+PbmImage *PgmToPbmDotDiffusion(const PgmImage *image, ClassMatrix matrix) {
+    // Allocate memory for new image data
+    PbmImage *pbm_image = AllocatePbm(image->width_, image->height_);
+    if (!pbm_image) return NULL;
+
+    const ClassMatrixInfo *info = &kClassMatrices[matrix];
+    uint32_t size               = info->size_;
+    uint32_t classes            = size * size;
+    uint32_t tiles_x            = (image->width_ + size - 1) / size;
+    uint32_t tiles_y            = (image->height_ + size - 1) / size;
+
+    // Pad the planes by a cache line past a multiple of 4 KiB, so that the
+    // values a pixel spreads its error to do not alias in the store buffer
+    size_t plane    = ((size_t)tiles_x * tiles_y + 1023) / 1024 * 1024 + 16;
+    int32_t *values = (int32_t *)malloc(plane * classes * sizeof(int32_t));
+    if (!values) {
+        fprintf(stderr, "Error: out of memory\n");
+        FreePbm(pbm_image);
+        return NULL;
+    }
+
+#pragma omp parallel default(none) \
+    shared(image, pbm_image, info, size, classes, tiles_x, tiles_y, plane, \
+               values)
+    {
+#pragma omp for
+        // Gather the pixels into the plane of their class, in fixed point, a
+        // column of the class matrix at a time
+        for (uint32_t y = 0; y < image->height_; y++) {
+            const uint8_t *row = image->data_ + (size_t)y * image->width_;
+            const uint8_t *classes_row = info->matrix_ + y % size * size;
+            for (uint32_t i = 0; i < size && i < image->width_; i++) {
+                int32_t *value = values + classes_row[i] * plane +
+                                 (size_t)(y / size) * tiles_x;
+                uint32_t count = (image->width_ - 1 - i) / size + 1;
+                for (uint32_t tx = 0; tx < count; tx++)
+                    value[tx] = row[(size_t)tx * size + i] << DIFFUSION_SHIFT;
+            }
+        }
+
+        // Dither a class at a time, all tiles at once
+        for (uint32_t c = 0; c < classes; c++) {
+#pragma omp for
+            for (uint32_t ty = 0; ty < tiles_y; ty++) {
+                DotDiffuseTiles(info, (uint16_t)c, values, tiles_x, plane, ty,
+                                image, pbm_image);
+            }
+        }
+    }
+
+    free(values);
+    return pbm_image;
+}
+
+// Rows of luminance buffered at a time by the fused PPM to PBM conversions
+#define FUSED_BAND_ROWS 32
+
+/**
+ * Convert one row of PPM pixels to luminance, optionally of linear light.
+ *
+ * @param pixels    The pixels of the row.
+ * @param width     The number of pixels in the row.
+ * @param weights   The luminance weights.
+ * @param linearize True for the luminance of the linear light.
+ * @param out       The luminance of each pixel.
+ */
+static void LuminanceRow(const Pixel *pixels, uint32_t width,
+                         LuminanceWeights weights, bool linearize,
+                         uint8_t *out) {
+    if (linearize)
+        PpmToLinearLuminanceRow(pixels, width, weights, out);
+    else
+        PpmToPgmWeightedRow(pixels, width, weights, out);
+}
+
+/**
+ * Convert a PPM image straight to a PBM image using Ordered Dithering.
+ * Each row's luminance is computed into a small buffer and dithered at once,
+ * so no intermediate PGM image is allocated. The result equals that of
+ * PgmToPbmOrdered on PpmToPgmWeighted, or with linearize on
+ * LinearToPgm(PpmToLinear(image), false) for REC_709_WEIGHTS.
+ *
+ * @param image     The SRgb PPM image to convert.
+ * @param weights   The luminance weights, e.g. REC_709_WEIGHTS
+ * @param linearize True to dither the luminance of the linear light.
+ * @param map       The threshold map, tiled over the whole image.
+ * @return          A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+PbmImage *PpmToPbmOrdered(const PpmImage *image, LuminanceWeights weights,
+                          bool linearize, const PgmImage *map) {
+    // Allocate memory for new image data and the luminance of a band
+    PbmImage *pbm_image = AllocatePbm(image->width_, image->height_);
+    if (!pbm_image) return NULL;
+    PgmImage *gray = AllocatePgm(image->width_, FUSED_BAND_ROWS);
+    if (!gray) {
+        FreePbm(pbm_image);
+        return NULL;
+    }
+
+    for (uint32_t y0 = 0; y0 < image->height_; y0 += FUSED_BAND_ROWS) {
+        uint32_t rows = image->height_ - y0 < FUSED_BAND_ROWS
+                            ? image->height_ - y0
+                            : FUSED_BAND_ROWS;
+
+#pragma omp parallel for default(none) \
+    shared(image, weights, linearize, map, pbm_image, gray, y0, rows)
+        // Dither each row while its luminance is still in cache
+        for (uint32_t y = 0; y < rows; y++) {
+            uint8_t *row  = gray->data_ + (size_t)y * gray->width_;
+            uint8_t *bits = pbm_image->data_ + (size_t)(y0 + y) *
+                                                   pbm_image->stride_;
+            LuminanceRow(image->data_ + (size_t)(y0 + y) * image->width_,
+                         image->width_, weights, linearize, row);
+            OrderedRow(row, image->width_, map, y0 + y, bits);
+        }
+    }
+
+    FreePgm(gray);
+    return pbm_image;
+}
+
+/**
+ * Convert a PPM image straight to a PBM image using error diffusion.
+ * The luminance is computed a band of rows at a time, in parallel, and fed to
+ * the band-by-band ditherer, so no intermediate PGM image is allocated. The
+ * result equals that of PgmToPbmDiffusionBand on the whole luminance image.
+ *
+ * @param image         The SRgb PPM image to convert.
+ * @param weights       The luminance weights, e.g. REC_709_WEIGHTS
+ * @param linearize     True to diffuse the luminance of the linear light.
+ * @param kernel        The error diffusion kernel to use.
+ * @param serpentine    True to scan odd rows from right to left.
+ * @return              A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+PbmImage *PpmToPbmDiffusion(const PpmImage *image, LuminanceWeights weights,
+                            bool linearize, DiffusionKernel kernel,
+                            bool serpentine) {
+    // Allocate memory for new image data, the luminance of a band and the
+    // ditherer
+    PbmImage *pbm_image = AllocatePbm(image->width_, image->height_);
+    if (!pbm_image) return NULL;
+    PgmImage *gray        = AllocatePgm(image->width_, FUSED_BAND_ROWS);
+    DiffusionState *state =
+        CreateDiffusionState(kernel, serpentine, image->width_);
+    if (!gray || !state) {
+        if (gray) FreePgm(gray);
+        if (state) FreeDiffusionState(state);
+        FreePbm(pbm_image);
+        return NULL;
+    }
+
+    for (uint32_t y0 = 0; y0 < image->height_; y0 += FUSED_BAND_ROWS) {
+        gray->height_ = image->height_ - y0 < FUSED_BAND_ROWS
+                            ? image->height_ - y0
+                            : FUSED_BAND_ROWS;
+
+#pragma omp parallel for default(none) \
+    shared(image, weights, linearize, gray, y0)
+        // Calculate the luminance of the band
+        for (uint32_t y = 0; y < gray->height_; y++) {
+            LuminanceRow(image->data_ + (size_t)(y0 + y) * image->width_,
+                         image->width_, weights, linearize,
+                         gray->data_ + (size_t)y * gray->width_);
+        }
+
+        // Diffuse it into the matching rows of the PBM image
+        PbmImage out = {.width_   = pbm_image->width_,
+                        .stride_  = pbm_image->stride_,
+                        .data_    = pbm_image->data_ +
+                                    (size_t)y0 * pbm_image->stride_,
+                        .mapping_ = {NULL, 0}};
+        PgmToPbmDiffusionBand(state, gray, &out);
+    }
+
+    FreeDiffusionState(state);
+    FreePgm(gray);
+    return pbm_image;
+}
+
+/**
+ * Write a PBM image to a file.
+ *
+ * @param filename  The name of the file to write.
+ * @param image     The image data to write.
+ * @return          True if successful, false otherwise.
+ */
+bool WritePbm(const PbmImage *image, const char *filename) {
+    // Open file for writing
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error: could not open file '%s' for writing\n",
+                filename);
+        return false;
+    }
+
+    // Write header (magic number, width, height)
+    if (fprintf(fp, "P4\n%u\n%u\n", image->width_, image->height_) < 0) {
+        fprintf(stderr, "Error: could not write header to file '%s'\n",
+                filename);
+        fclose(fp);
+        return false;
     }
 
-    // Write encoded pixel data to file
-    if (fwrite(buffer, 1, buffer_size, fp) != buffer_size) {
+    // Write pixel data, which is stored exactly as in the file
+    size_t size = (size_t)image->stride_ * image->height_;
+    if (fwrite(image->data_, 1, size, fp) != size) {
         fprintf(stderr, "Error: could not write pixel data to file '%s'\n",
                 filename);
-        free(buffer);
         fclose(fp);
         return false;
     }
 
-    free(buffer);
     fclose(fp);
     return true;
 }
 
 /**
- * Free memory used by a PBM image
+ * Free memory used by a PBM image, unmapping it if it was mapped
  *
  * @param image     Image to free
  */
 void FreePbm(PbmImage *image) {
-    free(image->data_);
+    if (image->mapping_.data_) UnmapFile(&image->mapping_);
+    else free(image->data_);
     free(image);
 }
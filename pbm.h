@@ -6,6 +6,7 @@
 
 #include "types/pbm.h"
 #include "types/pgm.h"
+#include "types/ppm.h"
 
 /**
  * Allocate memory for a PBM image.
@@ -16,6 +17,58 @@
  */
 extern PbmImage *AllocatePbm(uint32_t width, uint32_t height);
 
+/**
+ * Get a pixel of a PBM image.
+ *
+ * @param image     The image.
+ * @param x         X coordinate
+ * @param y         Y coordinate
+ * @return          1 if the pixel is black, 0 if it is white.
+ */
+static inline uint8_t PbmGetPixel(const PbmImage *image, uint32_t x,
+                                  uint32_t y) {
+    return (image->data_[(size_t)y * image->stride_ + x / 8] >> (7 - x % 8)) &
+           1;
+}
+
+/**
+ * Set a pixel of a PBM image.
+ * Pixels sharing a byte must not be set concurrently.
+ *
+ * @param image     The image.
+ * @param x         X coordinate
+ * @param y         Y coordinate
+ * @param black     Nonzero to make the pixel black, 0 to make it white.
+ */
+static inline void PbmSetPixel(PbmImage *image, uint32_t x, uint32_t y,
+                               uint8_t black) {
+    uint8_t *byte = &image->data_[(size_t)y * image->stride_ + x / 8];
+    uint8_t mask  = (uint8_t)(0x80 >> (x % 8));
+    *byte         = black ? *byte | mask : *byte & (uint8_t)~mask;
+}
+
+/**
+ * Pack one row of PBM pixels into bits, most significant bit first.
+ * The last byte is padded with zero bits, as in the PBM file format.
+ *
+ * @param pixels    The pixels of the row, one byte per pixel, nonzero for
+ * black.
+ * @param width     The number of pixels in the row.
+ * @param bits      The (width + 7) / 8 output bytes.
+ */
+extern void PackPbmRow(const uint8_t *pixels, uint32_t width, uint8_t *bits);
+
+/**
+ * Unpack one row of PBM bits into pixels, one byte per pixel.
+ *
+ * @param bits      The (width + 7) / 8 packed bytes, most significant bit
+ * first.
+ * @param width     The number of pixels in the row.
+ * @param pixels    The output pixels, each 0 (white) or 1 (black).
+ */
+extern void UnpackPbmRow(const uint8_t *bits, uint32_t width,
+                         uint8_t *pixels);
+
 /**
  * Read a PBM image from a file.
  *
@@ -24,6 +77,16 @@ extern PbmImage *AllocatePbm(uint32_t width, uint32_t height);
  */
 extern PbmImage *ReadPbm(const char *filename);
 
+/**
+ * Map a PBM image from a file without copying its pixel data.
+ * The returned image points into a read-only mapping of the file, so its
+ * pixels must not be modified. It is released with FreePbm as usual.
+ *
+ * @param filename  The name of the file to map.
+ * @return          A pointer to the image data, or NULL if an error occurred.
+ */
+extern PbmImage *MapPbm(const char *filename);
+
 /**
  * Normalizes pixel values from 0-255 to double 0-1.
  *
@@ -42,15 +105,23 @@ extern double *NormalizePgm(const PgmImage *image);
 extern uint8_t MiddleThreshold(__attribute__((unused)) uint32_t x,
                                __attribute__((unused)) uint32_t y);
 
+/**
+ * Set the seed of RandomThreshold and RandomThresholdRow.
+ *
+ * @param seed  The seed.
+ */
+extern void SeedRandomThreshold(uint64_t seed);
+
 /**
  * Threshold function that returns a random value between 0 and 255.
+ * The value only depends on the seed and the coordinates, so the same seed
+ * gives the same image whatever the number of threads.
  *
- * @param x Unused
- * @param y Unused
+ * @param x X coordinate
+ * @param y Y coordinate
  * @return Random value between 0 and 255
  */
-extern uint8_t RandomThreshold(__attribute__((unused)) uint32_t x,
-                               __attribute__((unused)) uint32_t y);
+extern uint8_t RandomThreshold(uint32_t x, uint32_t y);
 
 /**
  * Threshold function based on IGN (Interleaved Gradient Noise)
@@ -61,6 +132,59 @@ extern uint8_t RandomThreshold(__attribute__((unused)) uint32_t x,
  */
 extern uint8_t IgnThreshold(uint32_t x, uint32_t y);
 
+/**
+ * Span threshold function that always returns 128, as MiddleThreshold.
+ *
+ * @param thresholds    The thresholds of the span.
+ * @param count         The number of pixels in the span.
+ * @param x0            Unused
+ * @param y             Unused
+ * @param context       Unused
+ */
+extern void MiddleThresholdRow(uint8_t *thresholds, uint32_t count,
+                               __attribute__((unused)) uint32_t x0,
+                               __attribute__((unused)) uint32_t y,
+                               __attribute__((unused)) void *context);
+
+/**
+ * Span threshold function that returns random values between 0 and 255,
+ * equal to RandomThreshold at every pixel for the same seed.
+ *
+ * @param thresholds    The thresholds of the span.
+ * @param count         The number of pixels in the span.
+ * @param x0            X coordinate of the first pixel
+ * @param y             Y coordinate
+ * @param context       A pointer to the uint64_t seed, or NULL for the one set
+ * by SeedRandomThreshold.
+ */
+extern void RandomThresholdRow(uint8_t *thresholds, uint32_t count,
+                               uint32_t x0, uint32_t y, void *context);
+
+/**
+ * Span threshold function based on IGN (Interleaved Gradient Noise), equal to
+ * IgnThreshold at every pixel.
+ *
+ * @param thresholds    The thresholds of the span.
+ * @param count         The number of pixels in the span.
+ * @param x0            X coordinate of the first pixel
+ * @param y             Y coordinate
+ * @param context       Unused
+ */
+extern void IgnThresholdRow(uint8_t *thresholds, uint32_t count, uint32_t x0,
+                            uint32_t y, __attribute__((unused)) void *context);
+
+/**
+ * Adapter that evaluates a per-pixel threshold function over a span.
+ *
+ * @param thresholds    The thresholds of the span.
+ * @param count         The number of pixels in the span.
+ * @param x0            X coordinate of the first pixel
+ * @param y             Y coordinate
+ * @param context       A pointer to the ThresholdFn to evaluate.
+ */
+extern void ThresholdFnRow(uint8_t *thresholds, uint32_t count, uint32_t x0,
+                           uint32_t y, void *context);
+
 /**
  * Convert a PGM image to a PBM image.
  *
@@ -71,6 +195,114 @@ extern uint8_t IgnThreshold(uint32_t x, uint32_t y);
  */
 extern PbmImage *PgmToPbm(const PgmImage *image, ThresholdFn threshold);
 
+/**
+ * Convert a band of rows of a PGM image to PBM.
+ * The built-in threshold functions are recognised and computed a span at a
+ * time.
+ *
+ * @param band      The rows of the PGM image to convert.
+ * @param y_offset  The row of the whole image the band starts at.
+ * @param threshold The threshold function (0-255) to use for the conversion.
+ * @param out       The PBM band to write to, with room for as many rows as the
+ * PGM band. Its height is set to that of the PGM band.
+ */
+extern void PgmToPbmBand(const PgmImage *band, uint32_t y_offset,
+                         ThresholdFn threshold, PbmImage *out);
+
+/**
+ * Convert a PGM image to a PBM image using the given span threshold function,
+ * called for every row in parallel.
+ *
+ * @param image     The PGM image to convert.
+ * @param threshold The span threshold function (0-255) to use.
+ * @param context   Passed on to every call of threshold.
+ * @return          A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+extern PbmImage *PgmToPbmRows(const PgmImage *image, ThresholdRowFn threshold,
+                              void *context);
+
+/**
+ * Convert a band of rows of a PGM image to PBM using the given span threshold
+ * function.
+ *
+ * @param band      The rows of the PGM image to convert.
+ * @param y_offset  The row of the whole image the band starts at.
+ * @param threshold The span threshold function (0-255) to use.
+ * @param context   Passed on to every call of threshold.
+ * @param out       The PBM band to write to, with room for as many rows as the
+ * PGM band. Its height is set to that of the PGM band.
+ */
+extern void PgmToPbmRowsBand(const PgmImage *band, uint32_t y_offset,
+                             ThresholdRowFn threshold, void *context,
+                             PbmImage *out);
+
+/**
+ * Convert a PGM image to a PBM image using random thresholds drawn from the
+ * given seed. The same seed gives the same image whatever the number of
+ * threads.
+ *
+ * @param image     The PGM image to convert.
+ * @param seed      The seed of the random thresholds.
+ * @return          A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+extern PbmImage *PgmToPbmRandom(const PgmImage *image, uint64_t seed);
+
+/**
+ * Create a threshold map of IGN (Interleaved Gradient Noise), equal to
+ * IgnThreshold at every pixel of the map.
+ *
+ * @param width     The width of the map.
+ * @param height    The height of the map.
+ * @return          A pointer to the map, or NULL if an error occurred.
+ */
+extern PgmImage *IgnThresholdMap(uint32_t width, uint32_t height);
+
+/**
+ * Create a threshold map of a Bayer matrix, the same as the map of that size
+ * in textures/bayer. The rank of a pixel takes the bits of x ^ y and y as
+ * base 4 digits, the lowest bits of the coordinates being the highest digits.
+ *
+ * @param size      The width and height of the map, a power of 2.
+ * @return          A pointer to the map, or NULL if an error occurred.
+ */
+extern PgmImage *BayerMap(uint32_t size);
+
+/**
+ * Convert a PGM image to a PBM image using IGN (Interleaved Gradient Noise).
+ * Without a tile, the thresholds are computed a span at a time, as
+ * PgmToPbm(image, IgnThreshold). With one, a tile x tile map of IGN is
+ * computed once and repeated over the image with Ordered Dithering, which is
+ * faster but repeats the pattern.
+ *
+ * @param image     The PGM image to convert.
+ * @param tile      The size of the repeated tile, or 0 for none.
+ * @return          A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+extern PbmImage *PgmToPbmIgn(const PgmImage *image, uint32_t tile);
+
+/**
+ * Convert a PGM image to a PBM image using adaptive thresholding, as for
+ * scanned documents under uneven lighting. Each pixel is compared with a
+ * threshold from the statistics of the (2 radius + 1)^2 window around it,
+ * clipped to the image. These come from summed area tables of the pixels and,
+ * for SAUVOLA and NIBLACK, of their squares, so the cost per pixel does not
+ * depend on the radius. The rows are thresholded in parallel.
+ *
+ * @param image     The PGM image to convert.
+ * @param method    The adaptive thresholding method.
+ * @param radius    The radius of the window.
+ * @param k         The parameter of the method, typically 0.15 for BRADLEY,
+ * 0.34 for SAUVOLA and -0.2 for NIBLACK.
+ * @return          A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+extern PbmImage *PgmToPbmAdaptive(const PgmImage *image,
+                                 AdaptiveMethod method, uint32_t radius,
+                                 double k);
+
 /**
  * Convert a PGM image to a PBM image using Atkinson dithering.
  *
@@ -89,6 +321,51 @@ extern PbmImage *PgmToPbmAtkinson(const PgmImage *image);
  */
 extern PbmImage *PgmToPbmOrdered(const PgmImage *image, const PgmImage *map);
 
+/**
+ * Convert a band of rows of a PGM image to PBM using Ordered Dithering.
+ *
+ * @param band      The rows of the PGM image to convert.
+ * @param y_offset  The row of the whole image the band starts at.
+ * @param map       The threshold map, tiled over the whole image.
+ * @param out       The PBM band to write to, with room for as many rows as the
+ * PGM band. Its height is set to that of the PGM band.
+ */
+extern void PgmToPbmOrderedBand(const PgmImage *band, uint32_t y_offset,
+                                const PgmImage *map, PbmImage *out);
+
+/**
+ * Read the slices of a threshold volume from the files 0.pgm, 1.pgm, and so
+ * on of a directory, up to the first one that does not exist.
+ *
+ * @param directory The directory of the slices.
+ * @return          A pointer to the volume, or NULL if an error occurred.
+ */
+extern ThresholdVolume *ReadThresholdVolume(const char *directory);
+
+/**
+ * Convert a sequence of PGM frames to PBM images using Ordered Dithering, with
+ * the slices of a threshold volume as the maps. Frames are dithered in
+ * parallel.
+ *
+ * @param frames    The PGM frames to convert.
+ * @param count     The number of frames.
+ * @param first     The index of the first frame in the whole sequence.
+ * @param volume    The threshold volume.
+ * @param order     How each frame picks its thresholds from the volume.
+ * @param out       The count PBM images to write to, set to NULL on error.
+ * @return          Whether all frames were converted.
+ */
+extern bool PgmToPbmSequence(const PgmImage *const *frames, uint32_t count,
+                             uint32_t first, const ThresholdVolume *volume,
+                             SequenceOrder order, PbmImage **out);
+
+/**
+ * Free the memory used by a threshold volume.
+ *
+ * @param volume    The volume to free.
+ */
+extern void FreeThresholdVolume(ThresholdVolume *volume);
+
 /**
  * Convert a PGM image to a PBM image using Floyd–Steinberg dithering.
  *
@@ -107,6 +384,113 @@ extern PbmImage *PgmToPbmFloydSteinberg(const PgmImage *image);
  */
 extern PbmImage *PgmToPbmJarvisJudiceNinke(const PgmImage *image);
 
+/**
+ * Create the state of a band-by-band error diffusion ditherer.
+ *
+ * @param kernel        The error diffusion kernel to use.
+ * @param serpentine    True to scan odd rows from right to left.
+ * @param width         The width of the image.
+ * @return              A pointer to the state, or NULL if an error occurred.
+ */
+extern DiffusionState *CreateDiffusionState(DiffusionKernel kernel,
+                                            bool serpentine, uint32_t width);
+
+/**
+ * Dither the next band of rows of a PGM image using error diffusion.
+ * Error diffused past the bottom of the band is carried in the state and
+ * applied to the next band.
+ *
+ * @param state     The state of the ditherer.
+ * @param band      The next rows of the PGM image.
+ * @param out       The PBM band to write to, with room for as many rows as the
+ * PGM band. Its height is set to that of the PGM band.
+ */
+extern void PgmToPbmDiffusionBand(DiffusionState *state, const PgmImage *band,
+                                  PbmImage *out);
+
+/**
+ * Free the state of a band-by-band error diffusion ditherer.
+ *
+ * @param state     The state to free.
+ */
+extern void FreeDiffusionState(DiffusionState *state);
+
+/**
+ * Convert a PGM image to a PBM image using error diffusion.
+ * The error is carried in fixed point, in a ring of three rows, and rounded
+ * to 2^-8 of a gray level once per pixel. A pixel whose diffused value lands
+ * within that rounding of the threshold can come out differently than with
+ * exact arithmetic, and the pattern after it then shifts. The tone does not:
+ * averages over 16x16 blocks stay within about 2.5 gray levels of those of a
+ * double-precision ditherer, and as close to the source.
+ * With several threads, the rows are dithered in parallel as a diagonal
+ * wavefront, with the same result as in a single thread. A serpentine scan
+ * runs odd rows from right to left, which breaks up the directional
+ * artifacts of a raster scan but dithers in a single thread.
+ *
+ * @param image         The PGM image to convert.
+ * @param kernel        The error diffusion kernel to use.
+ * @param serpentine    True to scan odd rows from right to left.
+ * @return              A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+extern PbmImage *PgmToPbmDiffusion(const PgmImage *image,
+                                   DiffusionKernel kernel, bool serpentine);
+
+/**
+ * Convert a PGM image to a PBM image using Knuth's dot diffusion.
+ * The image is tiled with a class matrix, and the pixels are dithered a class
+ * at a time, each spreading its error over the neighbors of higher classes,
+ * twice as much to those beside it as to those diagonal to it. A pixel with
+ * no such neighbor, a baron, drops its error. All tiles dither their pixel of
+ * a class at once, in parallel, so unlike error diffusion this scales with
+ * the number of threads. The error is carried in fixed point, in one plane
+ * per class, so that each class streams through memory.
+ *
+ * @param image     The PGM image to convert.
+ * @param matrix    The class matrix to use.
+ * @return          A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+extern PbmImage *PgmToPbmDotDiffusion(const PgmImage *image,
+                                     ClassMatrix matrix);
+
+/**
+ * Convert a PPM image straight to a PBM image using Ordered Dithering.
+ * Each row's luminance is computed into a small buffer and dithered at once,
+ * so no intermediate PGM image is allocated. The result equals that of
+ * PgmToPbmOrdered on PpmToPgmWeighted, or with linearize on
+ * LinearToPgm(PpmToLinear(image), false) for REC_709_WEIGHTS.
+ *
+ * @param image     The SRgb PPM image to convert.
+ * @param weights   The luminance weights, e.g. REC_709_WEIGHTS
+ * @param linearize True to dither the luminance of the linear light.
+ * @param map       The threshold map, tiled over the whole image.
+ * @return          A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+extern PbmImage *PpmToPbmOrdered(const PpmImage *image,
+                                 LuminanceWeights weights, bool linearize,
+                                 const PgmImage *map);
+
+/**
+ * Convert a PPM image straight to a PBM image using error diffusion.
+ * The luminance is computed a band of rows at a time, in parallel, and fed to
+ * the band-by-band ditherer, so no intermediate PGM image is allocated. The
+ * result equals that of PgmToPbmDiffusionBand on the whole luminance image.
+ *
+ * @param image         The SRgb PPM image to convert.
+ * @param weights       The luminance weights, e.g. REC_709_WEIGHTS
+ * @param linearize     True to diffuse the luminance of the linear light.
+ * @param kernel        The error diffusion kernel to use.
+ * @param serpentine    True to scan odd rows from right to left.
+ * @return              A pointer to the new PBM image, or NULL if an error
+ * occurred.
+ */
+extern PbmImage *PpmToPbmDiffusion(const PpmImage *image,
+                                   LuminanceWeights weights, bool linearize,
+                                   DiffusionKernel kernel, bool serpentine);
+
 /**
  * Write a PBM image to a file.
  *
@@ -117,7 +501,7 @@ extern PbmImage *PgmToPbmJarvisJudiceNinke(const PgmImage *image);
 extern bool WritePbm(const PbmImage *image, const char *filename);
 
 /**
- * Free memory used by a PBM image
+ * Free memory used by a PBM image, unmapping it if it was mapped
  *
  * @param image     Image to free
  */
@@ -5,8 +5,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "mapping.h"
+#include "pbm.h"
 #include "sat.h"
 
+#if defined __SSSE3__
+#include <tmmintrin.h>
+#elif defined __SSE2__
+#include <emmintrin.h>
+#endif
+
 /**
  * Allocate memory for a PGM image.
  *
@@ -24,6 +32,7 @@ PgmImage *AllocatePgm(uint32_t width, uint32_t height) {
     image->width_    = width;
     image->height_   = height;
     image->max_gray_ = PGM_MAX_GRAY;
+    image->mapping_  = (MappedFile){NULL, 0};
     image->data_     = (uint8_t *)calloc(width * height, sizeof(uint8_t));
     if (!image->data_) {
         fprintf(stderr, "Error: out of memory\n");
@@ -93,6 +102,44 @@ PgmImage *ReadPgm(const char *filename) {
     return image;
 }
 
+/**
+ * Map a PGM image from a file without copying its pixel data.
+ * The returned image points into a read-only mapping of the file, so its
+ * pixels must not be modified. It is released with FreePgm as usual.
+ *
+ * @param filename  The name of the file to map.
+ * @return          A pointer to the image data, or NULL if an error occurred.
+ */
+PgmImage *MapPgm(const char *filename) {
+    // Map the file and parse the header in place
+    MappedFile file;
+    NetpbmHeader header;
+    if (!MapNetpbm(filename, '5', sizeof(uint8_t), &file, &header))
+        return NULL;
+
+    // Make sure the max gray value is PGM_MAX_GRAY
+    if (header.max_value_ != PGM_MAX_GRAY) {
+        fprintf(stderr, "Error: max gray value must be PGM_MAX_GRAY\n");
+        UnmapFile(&file);
+        return NULL;
+    }
+
+    // Allocate the image header only, the pixels stay in the mapping
+    PgmImage *image = (PgmImage *)malloc(sizeof(PgmImage));
+    if (!image) {
+        fprintf(stderr, "Error: out of memory\n");
+        UnmapFile(&file);
+        return NULL;
+    }
+    image->width_    = header.width_;
+    image->height_   = header.height_;
+    image->max_gray_ = header.max_value_;
+    image->mapping_  = file;
+    image->data_     = file.data_ + header.offset_;
+
+    return image;
+}
+
 /**
  * Convert an image to a new image using the given pixel conversion function.
  *
@@ -108,22 +155,289 @@ PgmImage *PpmToPgm(const PpmImage *image, LuminanceFn luminance) {
         return NULL;
     }
 
-#pragma omp parallel for default(none) shared(pgm_image, image, luminance)
-    // Convert pixel data from PPM image to PGM image
-    for (uint32_t i = 0; i < pgm_image->height_ * pgm_image->width_; i++) {
-        // Get pixel from PPM image
-        Pixel p = image->data_[i];
+    // Convert the whole image as a single band
+    PpmToPgmBand(image, luminance, pgm_image);
+    return pgm_image;
+}
 
-        // Calculate luminance of pixel
-        uint8_t y = (uint8_t)luminance(&p);
+/**
+ * Convert a band of rows of a PPM image to PGM.
+ *
+ * @param band      The rows of the PPM image to convert.
+ * @param luminance Reference to the luminance function
+ * @param out       The PGM band to write to, with room for as many rows as the
+ * PPM band. Its height is set to that of the PPM band.
+ */
+void PpmToPgmBand(const PpmImage *band, LuminanceFn luminance,
+                  PgmImage *out) {
+    // Go through the span adapter, a row at a time
+    PpmToPgmRowsBand(band, 0, LuminanceFnRow, &luminance, out);
+}
+
+// Fixed-point precision of the luminance weights
+#define LUMINANCE_SHIFT 15
+
+/**
+ * Quantize a luminance weight to fixed point, clamped to [0, 1).
+ *
+ * @param weight    The weight.
+ * @return          The weight in units of 2^-LUMINANCE_SHIFT.
+ */
+static int16_t QuantizeWeight(double weight) {
+    double scaled = round(weight * (1 << LUMINANCE_SHIFT));
+    if (!(scaled > 0)) return 0;
+    return scaled < INT16_MAX ? (int16_t)scaled : INT16_MAX;
+}
 
-        // Set luminance value in PGM image
-        pgm_image->data_[i] = y;
+/**
+ * Calculate the fixed-point luminance of consecutive pixels.
+ *
+ * @param pixels    The pixels.
+ * @param count     The number of pixels.
+ * @param weights   The red, green and blue weights in fixed point.
+ * @param out       The luminance of each pixel.
+ */
+static void WeightedLuminance(const Pixel *pixels, size_t count,
+                              const int16_t weights[3], uint8_t *out) {
+    const int32_t half = 1 << (LUMINANCE_SHIFT - 1);
+    size_t i           = 0;
+#if defined __SSSE3__
+    // Shuffles gathering the red, green and blue bytes of 16 pixels from each
+    // of the three 16-byte blocks they span
+    const __m128i r0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1,
+                                     -1, -1, -1, -1, -1);
+    const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14,
+                                     -1, -1, -1, -1, -1);
+    const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                     -1, 1, 4, 7, 10, 13);
+    const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1,
+                                     -1, -1, -1, -1, -1);
+    const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15,
+                                     -1, -1, -1, -1, -1);
+    const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                     -1, 2, 5, 8, 11, 14);
+    const __m128i b0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1,
+                                     -1, -1, -1, -1, -1);
+    const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1,
+                                     -1, -1, -1, -1, -1);
+    const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                     0, 3, 6, 9, 12, 15);
+
+    // Weights and rounding term paired up for multiply-add: (r, g) and (b, 1)
+    const __m128i rg_weights = _mm_set1_epi32(
+        (int32_t)((uint32_t)(uint16_t)weights[1] << 16 | (uint16_t)weights[0]));
+    const __m128i b_weights =
+        _mm_set1_epi32((int32_t)((uint32_t)half << 16 | (uint16_t)weights[2]));
+    const __m128i one  = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= count; i += 16) {
+        // Deinterleave 16 RGB pixels into red, green and blue vectors
+        const uint8_t *bytes = (const uint8_t *)(pixels + i);
+        __m128i a = _mm_loadu_si128((const __m128i *)bytes);
+        __m128i b = _mm_loadu_si128((const __m128i *)(bytes + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(bytes + 32));
+        __m128i red =
+            _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, r0),
+                                      _mm_shuffle_epi8(b, r1)),
+                         _mm_shuffle_epi8(c, r2));
+        __m128i green =
+            _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, g0),
+                                      _mm_shuffle_epi8(b, g1)),
+                         _mm_shuffle_epi8(c, g2));
+        __m128i blue =
+            _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, b0),
+                                      _mm_shuffle_epi8(b, b1)),
+                         _mm_shuffle_epi8(c, b2));
+
+        // Weighted sums of 4 pixels at a time, in 32-bit lanes
+        __m128i sums[4];
+        for (int half_index = 0; half_index < 2; half_index++) {
+            __m128i r = half_index ? _mm_unpackhi_epi8(red, zero)
+                                   : _mm_unpacklo_epi8(red, zero);
+            __m128i g = half_index ? _mm_unpackhi_epi8(green, zero)
+                                   : _mm_unpacklo_epi8(green, zero);
+            __m128i bl = half_index ? _mm_unpackhi_epi8(blue, zero)
+                                    : _mm_unpacklo_epi8(blue, zero);
+            for (int quarter = 0; quarter < 2; quarter++) {
+                __m128i rg = quarter ? _mm_unpackhi_epi16(r, g)
+                                     : _mm_unpacklo_epi16(r, g);
+                __m128i b_one = quarter ? _mm_unpackhi_epi16(bl, one)
+                                      : _mm_unpacklo_epi16(bl, one);
+                __m128i sum = _mm_add_epi32(_mm_madd_epi16(rg, rg_weights),
+                                            _mm_madd_epi16(b_one, b_weights));
+                sums[2 * half_index + quarter] =
+                    _mm_srli_epi32(sum, LUMINANCE_SHIFT);
+            }
+        }
+
+        // Narrow back to bytes, saturating at PGM_MAX_GRAY
+        __m128i y = _mm_packus_epi16(_mm_packs_epi32(sums[0], sums[1]),
+                                     _mm_packs_epi32(sums[2], sums[3]));
+        _mm_storeu_si128((__m128i *)(out + i), y);
     }
+#endif
+    for (; i < count; i++) {
+        int32_t y = (pixels[i].r_ * weights[0] + pixels[i].g_ * weights[1] +
+                     pixels[i].b_ * weights[2] + half) >>
+                    LUMINANCE_SHIFT;
+        out[i] = y > PGM_MAX_GRAY ? PGM_MAX_GRAY : (uint8_t)y;
+    }
+}
 
+/**
+ * Convert a PPM image to a PGM image using built-in luminance weights.
+ * Each weight is rounded to a multiple of 2^-15 in [0, 1), and the luminance
+ * is computed in fixed point with SIMD where available. The result is
+ * bit-identical to evaluating the rounded weights in double precision and
+ * rounding half up.
+ *
+ * @param image     Pointer to the original image
+ * @param weights   The luminance weights, e.g. REC_709_WEIGHTS
+ * @return          Pointer to the new image
+ */
+PgmImage *PpmToPgmWeighted(const PpmImage *image, LuminanceWeights weights) {
+    PgmImage *pgm_image = AllocatePgm(image->width_, image->height_);
+    if (!pgm_image) {
+        fprintf(stderr, "Error: could not allocate memory for PGM image\n");
+        return NULL;
+    }
+
+    // Convert the whole image as a single band
+    PpmToPgmWeightedBand(image, weights, pgm_image);
     return pgm_image;
 }
 
+/**
+ * Convert a band of rows of a PPM image to PGM using built-in luminance
+ * weights, as in PpmToPgmWeighted.
+ *
+ * @param band      The rows of the PPM image to convert.
+ * @param weights   The luminance weights, e.g. REC_709_WEIGHTS
+ * @param out       The PGM band to write to, with room for as many rows as the
+ * PPM band. Its height is set to that of the PPM band.
+ */
+void PpmToPgmWeightedBand(const PpmImage *band, LuminanceWeights weights,
+                          PgmImage *out) {
+    const int16_t fixed[3] = {QuantizeWeight(weights.r_),
+                              QuantizeWeight(weights.g_),
+                              QuantizeWeight(weights.b_)};
+    size_t size            = (size_t)band->width_ * band->height_;
+    size_t chunk           = 1 << 14;
+    out->height_           = band->height_;
+
+#pragma omp parallel for default(none) shared(band, out, fixed, size, chunk)
+    // Convert the pixels in chunks, regardless of row boundaries
+    for (size_t i = 0; i < size; i += chunk) {
+        WeightedLuminance(band->data_ + i, size - i < chunk ? size - i : chunk,
+                          fixed, out->data_ + i);
+    }
+}
+
+/**
+ * Convert one row of PPM pixels to luminance using built-in luminance weights,
+ * as in PpmToPgmWeighted.
+ *
+ * @param pixels    The pixels of the row.
+ * @param width     The number of pixels in the row.
+ * @param weights   The luminance weights, e.g. REC_709_WEIGHTS
+ * @param out       The luminance of each pixel.
+ */
+void PpmToPgmWeightedRow(const Pixel *pixels, uint32_t width,
+                         LuminanceWeights weights, uint8_t *out) {
+    const int16_t fixed[3] = {QuantizeWeight(weights.r_),
+                              QuantizeWeight(weights.g_),
+                              QuantizeWeight(weights.b_)};
+    WeightedLuminance(pixels, width, fixed, out);
+}
+
+/**
+ * Adapter that applies a per-pixel luminance function to a span of pixels.
+ * The luminance is truncated to an integer, as in PpmToPgm.
+ *
+ * @param pixels    The pixels.
+ * @param count     The number of pixels.
+ * @param x0        Unused
+ * @param y         Unused
+ * @param out       The luminance of each pixel.
+ * @param context   A pointer to the LuminanceFn to apply.
+ */
+void LuminanceFnRow(const Pixel *pixels, uint32_t count,
+                    __attribute__((unused)) uint32_t x0,
+                    __attribute__((unused)) uint32_t y, uint8_t *out,
+                    void *context) {
+    LuminanceFn luminance = *(LuminanceFn *)context;
+    for (uint32_t i = 0; i < count; i++)
+        out[i] = (uint8_t)luminance(&pixels[i]);
+}
+
+/**
+ * Span luminance function using built-in luminance weights, as in
+ * PpmToPgmWeighted.
+ *
+ * @param pixels    The pixels.
+ * @param count     The number of pixels.
+ * @param x0        Unused
+ * @param y         Unused
+ * @param out       The luminance of each pixel.
+ * @param context   A pointer to the LuminanceWeights to use.
+ */
+void WeightedLuminanceRow(const Pixel *pixels, uint32_t count,
+                          __attribute__((unused)) uint32_t x0,
+                          __attribute__((unused)) uint32_t y, uint8_t *out,
+                          void *context) {
+    PpmToPgmWeightedRow(pixels, count, *(const LuminanceWeights *)context,
+                        out);
+}
+
+/**
+ * Convert a PPM image to a PGM image using the given span luminance function,
+ * called for every row in parallel.
+ *
+ * @param image     Pointer to the original image
+ * @param luminance Reference to the span luminance function
+ * @param context   Passed on to every call of luminance
+ * @return          Pointer to the new image
+ */
+PgmImage *PpmToPgmRows(const PpmImage *image, LuminanceRowFn luminance,
+                       void *context) {
+    /* Allocate memory for PGM image */
+    PgmImage *pgm_image = AllocatePgm(image->width_, image->height_);
+    if (!pgm_image) {
+        fprintf(stderr, "Error: could not allocate memory for PGM image\n");
+        return NULL;
+    }
+
+    // Convert the whole image as a single band
+    PpmToPgmRowsBand(image, 0, luminance, context, pgm_image);
+    return pgm_image;
+}
+
+/**
+ * Convert a band of rows of a PPM image to PGM using the given span luminance
+ * function.
+ *
+ * @param band      The rows of the PPM image to convert.
+ * @param y_offset  The row of the whole image the band starts at.
+ * @param luminance Reference to the span luminance function
+ * @param context   Passed on to every call of luminance
+ * @param out       The PGM band to write to, with room for as many rows as the
+ * PPM band. Its height is set to that of the PPM band.
+ */
+void PpmToPgmRowsBand(const PpmImage *band, uint32_t y_offset,
+                      LuminanceRowFn luminance, void *context, PgmImage *out) {
+    out->height_ = band->height_;
+
+#pragma omp parallel for default(none) \
+    shared(band, y_offset, luminance, context, out)
+    // Convert the pixel data a row at a time
+    for (uint32_t y = 0; y < band->height_; y++) {
+        size_t offset = (size_t)y * band->width_;
+        luminance(band->data_ + offset, band->width_, 0, y_offset + y,
+                  out->data_ + offset, context);
+    }
+}
+
 /**
  * Convert a PBM image to a PGM image.
  *
@@ -138,48 +452,281 @@ PgmImage *PbmToPgm(const PbmImage *image) {
     }
 
 #pragma omp parallel for default(none) shared(pgm, image)
-    // Convert pixel data from PBM image to PGM image
-    for (uint32_t i = 0; i < image->height_ * image->width_; i++) {
-        // Set pixel value in PGM image
-        pgm->data_[i] = image->data_[i] ? 0 : PGM_MAX_GRAY;
+    // Convert pixel data from PBM image to PGM image row by row
+    for (uint32_t y = 0; y < image->height_; y++) {
+        // Unpack the bits to 0 (white) or 1 (black), then map to gray values
+        uint8_t *row = pgm->data_ + (size_t)y * image->width_;
+        UnpackPbmRow(image->data_ + (size_t)y * image->stride_, image->width_,
+                     row);
+        for (uint32_t x = 0; x < image->width_; x++)
+            row[x] = row[x] ? 0 : PGM_MAX_GRAY;
     }
 
     return pgm;
 }
 
+// Outputs per segment of a row in the horizontal pass of KasperBlur
+#define KASPER_SPAN 1024
+
+// Columns and rows per tile in the vertical pass of KasperBlur
+#define KASPER_TILE_WIDTH 512
+#define KASPER_TILE_HEIGHT 256
+
+/**
+ * Compute the prefix sums of a run of pixels, modulo 2^16.
+ *
+ * @param values    The pixels.
+ * @param count     The number of pixels.
+ * @param prefix    The count + 1 prefix sums, starting with 0.
+ */
+static void PrefixSum16(const uint8_t *values, uint32_t count,
+                        uint16_t *prefix) {
+    uint32_t i = 0;
+    prefix[0]  = 0;
+#if defined __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i carry      = zero;
+    for (; i + 8 <= count; i += 8) {
+        // Sum 8 pixels in log steps, then add the total of those before them
+        __m128i v = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(values + i)), zero);
+        v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+        v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi16(v, carry);
+        _mm_storeu_si128((__m128i *)(prefix + i + 1), v);
+        carry = _mm_shufflehi_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+        carry = _mm_unpackhi_epi64(carry, carry);
+    }
+#endif
+    for (; i < count; i++) prefix[i + 1] = (uint16_t)(prefix[i] + values[i]);
+}
+
+/**
+ * Sum the in-bounds pixels of a row up to radius away from a pixel.
+ *
+ * @param prefix    The prefix sums of the row, modulo 2^16.
+ * @param lo        The column of the first pixel in the prefix sums.
+ * @param x         The column of the pixel.
+ * @param width     The width of the row.
+ * @param radius    The radius of the window.
+ * @return          The sum of the window.
+ */
+static inline uint16_t WindowSum(const uint16_t *prefix, uint32_t lo,
+                                 uint32_t x, uint32_t width, uint32_t radius) {
+    uint32_t start = x > radius ? x - radius : 0;
+    uint32_t end   = width - x > radius ? x + radius + 1 : width;
+    return (uint16_t)(prefix[end - lo] - prefix[start - lo]);
+}
+
+/**
+ * Sum each pixel of a row with its in-bounds neighbours up to radius away.
+ * At most 255 pixels are summed, so the sums fit in 16 bits and differences
+ * of prefix sums modulo 2^16 are exact.
+ *
+ * @param row       The pixels of the row.
+ * @param width     The width of the row.
+ * @param radius    The radius of the window, at most INT8_MAX.
+ * @param sums      The sum of the window around each pixel.
+ */
+static void KasperRowSums(const uint8_t *row, uint32_t width, uint32_t radius,
+                          uint16_t *sums) {
+    uint16_t prefix[KASPER_SPAN + 2 * INT8_MAX + 1];
+    for (uint32_t x0 = 0; x0 < width; x0 += KASPER_SPAN) {
+        uint32_t x1 = width - x0 < KASPER_SPAN ? width : x0 + KASPER_SPAN;
+
+        // Prefix sums of every pixel the windows of this segment reach
+        uint32_t lo = x0 > radius ? x0 - radius : 0;
+        uint32_t hi = width - x1 > radius ? x1 + radius : width;
+        PrefixSum16(row + lo, hi - lo, prefix);
+
+        uint32_t x = x0;
+#if defined __SSE2__
+        // Windows clipped by the left edge one at a time, then those that
+        // lie entirely within the row 8 at a time
+        for (; x < x1 && x < radius; x++)
+            sums[x] = WindowSum(prefix, lo, x, width, radius);
+        for (; x + 8 <= x1 && (uint64_t)x + 7 + radius < width; x += 8) {
+            __m128i end = _mm_loadu_si128(
+                (const __m128i *)(prefix + x + radius + 1 - lo));
+            __m128i start =
+                _mm_loadu_si128((const __m128i *)(prefix + x - radius - lo));
+            _mm_storeu_si128((__m128i *)(sums + x), _mm_sub_epi16(end, start));
+        }
+#endif
+        for (; x < x1; x++) sums[x] = WindowSum(prefix, lo, x, width, radius);
+    }
+}
+
+/**
+ * Add or subtract a row of window sums to or from the running column sums.
+ *
+ * @param column_sums   The running column sums.
+ * @param row           The row of window sums.
+ * @param count         The number of columns.
+ * @param subtract      True to subtract the row, false to add it.
+ */
+static void AccumulateRow(uint32_t *column_sums, const uint16_t *row,
+                          uint32_t count, bool subtract) {
+    uint32_t i = 0;
+#if defined __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= count; i += 8) {
+        __m128i v    = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i lo   = _mm_unpacklo_epi16(v, zero);
+        __m128i hi   = _mm_unpackhi_epi16(v, zero);
+        __m128i *sum = (__m128i *)(column_sums + i);
+        __m128i s0   = _mm_loadu_si128(sum);
+        __m128i s1   = _mm_loadu_si128(sum + 1);
+        _mm_storeu_si128(sum, subtract ? _mm_sub_epi32(s0, lo)
+                                       : _mm_add_epi32(s0, lo));
+        _mm_storeu_si128(sum + 1, subtract ? _mm_sub_epi32(s1, hi)
+                                           : _mm_add_epi32(s1, hi));
+    }
+#endif
+    for (; i < count; i++)
+        column_sums[i] = subtract ? column_sums[i] - row[i]
+                                  : column_sums[i] + row[i];
+}
+
+/**
+ * Divide column sums by the number of pixels they cover.
+ * The sums are below 2^24 and the counts below 2^16, so the single precision
+ * quotient is never rounded up to the next integer and truncating it equals
+ * integer division.
+ *
+ * @param column_sums   The column sums.
+ * @param column_counts The number of in-bounds columns summed in each.
+ * @param row_count     The number of in-bounds rows summed in all of them.
+ * @param count         The number of columns.
+ * @param out           The averages.
+ */
+static void AverageRow(const uint32_t *column_sums,
+                       const uint32_t *column_counts, uint32_t row_count,
+                       uint32_t count, uint8_t *out) {
+    uint32_t i = 0;
+#if defined __SSE2__
+    const __m128 rows = _mm_set1_ps((float)row_count);
+    for (; i + 8 <= count; i += 8) {
+        __m128i averages[2];
+        for (int half = 0; half < 2; half++) {
+            __m128 sum = _mm_cvtepi32_ps(
+                _mm_loadu_si128((const __m128i *)(column_sums + i) + half));
+            __m128 pixels = _mm_mul_ps(
+                _mm_cvtepi32_ps(_mm_loadu_si128(
+                    (const __m128i *)(column_counts + i) + half)),
+                rows);
+            averages[half] = _mm_cvttps_epi32(_mm_div_ps(sum, pixels));
+        }
+        __m128i words = _mm_packs_epi32(averages[0], averages[1]);
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(words, words));
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = (uint8_t)(column_sums[i] / (column_counts[i] * row_count));
+}
+
+/**
+ * Sum the window sums of a tile of pixels over the height of the window and
+ * divide them by the number of in-bounds pixels.
+ *
+ * @param sums      The horizontal window sums of the whole image.
+ * @param width     The width of the image.
+ * @param height    The height of the image.
+ * @param radius    The radius of the window.
+ * @param x0        The first column of the tile.
+ * @param y0        The first row of the tile.
+ * @param out       The blurred image.
+ */
+static void KasperTile(const uint16_t *sums, uint32_t width, uint32_t height,
+                       uint32_t radius, uint32_t x0, uint32_t y0,
+                       uint8_t *out) {
+    uint32_t column_sums[KASPER_TILE_WIDTH]   = {0};
+    uint32_t column_counts[KASPER_TILE_WIDTH] = {0};
+    uint32_t columns =
+        width - x0 < KASPER_TILE_WIDTH ? width - x0 : KASPER_TILE_WIDTH;
+    uint32_t y1 =
+        height - y0 < KASPER_TILE_HEIGHT ? height : y0 + KASPER_TILE_HEIGHT;
+
+    // Number of in-bounds columns of each window
+    for (uint32_t i = 0; i < columns; i++) {
+        uint32_t x     = x0 + i;
+        uint32_t start = x > radius ? x - radius : 0;
+        uint32_t end   = width - x > radius ? x + radius + 1 : width;
+        column_counts[i] = end - start;
+    }
+
+    // Start with the rows of the window of the first row
+    uint32_t start = y0 > radius ? y0 - radius : 0;
+    uint32_t end   = height - y0 > radius ? y0 + radius + 1 : height;
+    for (uint32_t y = start; y < end; y++)
+        AccumulateRow(column_sums, sums + (size_t)y * width + x0, columns,
+                      false);
+
+    // Then slide the window down a row at a time
+    for (uint32_t y = y0; y < y1; y++) {
+        AverageRow(column_sums, column_counts, end - start, columns,
+                   out + (size_t)y * width + x0);
+        if (end < height) {
+            AccumulateRow(column_sums, sums + (size_t)end * width + x0,
+                          columns, false);
+            end++;
+        }
+        if (y >= radius) {
+            AccumulateRow(column_sums, sums + (size_t)start * width + x0,
+                          columns, true);
+            start++;
+        }
+    }
+}
+
 /**
  * Blur effect first designed by KaspervanM in Jan 22, 2021
  * Each pixel becomes the average of a square surrounding that pixel with side
- * 2r + 1.
+ * 2r + 1, counting only the pixels inside the image. The square is summed
+ * separably with running sums, so the cost per pixel does not depend on r.
  * @param image     Input PgmImage
  * @param radius    Radius of the square
- * @return          Pointer to the new image data
+ * @return          Pointer to the new image data, or NULL if an error
+ * occurred.
  */
 PgmImage *KasperBlur(const PgmImage *image, int8_t radius) {
-    // Allocate memory for new image data
-    PgmImage *new_image = AllocatePgm(image->width_, image->height_);
+    if (radius < 0) {
+        fprintf(stderr, "Error: negative blur radius %d\n", radius);
+        return NULL;
+    }
 
-#pragma omp parallel for default(none) shared(image, new_image, radius) \
-    collapse(2)
-    // Blur pixel data
-    for (uint32_t y = 0; y < image->height_; y++) {
-        for (uint32_t x = 0; x < image->width_; x++) {
-            uint64_t sum   = 0;
-            uint16_t count = 0;
-            for (int64_t ry = -radius; ry <= radius; ry++) {
-                for (int64_t rx = -radius; rx <= radius; rx++) {
-                    if (y + ry >= 0 && y + ry < image->height_ && x + rx >= 0 &&
-                        x + rx < image->width_) {
-                        sum +=
-                            image->data_[(y + ry) * image->width_ + (x + rx)];
-                        count++;
-                    }
-                }
-            }
-            new_image->data_[y * image->width_ + x] = (uint8_t)(sum / count);
+    // Allocate memory for new image data and the horizontal sums
+    uint32_t width      = image->width_;
+    uint32_t height     = image->height_;
+    uint32_t r          = (uint32_t)radius;
+    PgmImage *new_image = AllocatePgm(width, height);
+    if (!new_image) return NULL;
+    uint16_t *sums =
+        (uint16_t *)malloc((size_t)width * height * sizeof(uint16_t));
+    if (!sums) {
+        fprintf(stderr, "Error: out of memory\n");
+        FreePgm(new_image);
+        return NULL;
+    }
+
+#pragma omp parallel for default(none) shared(image, sums, width, height, r)
+    // Sum the square's width of pixels around every pixel of each row
+    for (uint32_t y = 0; y < height; y++) {
+        KasperRowSums(image->data_ + (size_t)y * width, width, r,
+                      sums + (size_t)y * width);
+    }
+
+#pragma omp parallel for default(none) \
+    shared(new_image, sums, width, height, r) collapse(2)
+    // Sum those over the square's height, a tile of columns at a time
+    for (uint32_t y0 = 0; y0 < height; y0 += KASPER_TILE_HEIGHT) {
+        for (uint32_t x0 = 0; x0 < width; x0 += KASPER_TILE_WIDTH) {
+            KasperTile(sums, width, height, r, x0, y0, new_image->data_);
         }
     }
 
+    free(sums);
     return new_image;
 }
 
@@ -217,6 +764,52 @@ PgmImage *BoxBlur(const SummedAreaTable *sat, int8_t radius) {
     return new_image;
 }
 
+/**
+ * Each pixel becomes the average of a box surrounding that pixel with side
+ * 2r + 1, as in BoxBlur, using a compact summed area table. The table must
+ * have been computed for areas of at least (2r + 1)^2.
+ *
+ * @param sat       Compact summed area table of the image
+ * @param radius    Radius of the square
+ * @return          Blurred image, or NULL if an error occurred.
+ */
+PgmImage *CompactBoxBlur(const CompactSat *sat, int8_t radius) {
+    // Get image dimensions for convenience
+    uint32_t width  = sat->width_;
+    uint32_t height = sat->height_;
+
+    // Every box must be small enough for its sum to be exact
+    uint64_t side = 2 * (uint64_t)radius + 1;
+    uint64_t area =
+        (side < width ? side : width) * (side < height ? side : height);
+    if (radius < 0 || area > sat->max_area_) {
+        fprintf(stderr, "Error: radius %d too large for the summed area "
+                        "table\n", radius);
+        return NULL;
+    }
+
+    // Allocate memory for new image data
+    PgmImage *new_image = AllocatePgm(width, height);
+    if (!new_image) return NULL;
+
+#pragma omp parallel for default(none) \
+    shared(new_image, sat, width, height, radius)
+    // Blur pixel data
+    for (int64_t y = 0; y < height; y++) {
+        for (int64_t x = 0; x < width; x++) {
+            uint32_t tlx   = (x - radius >= 0) ? x - radius : 0;
+            uint32_t tly   = (y - radius >= 0) ? y - radius : 0;
+            uint32_t brx   = (x + radius < width) ? x + radius : width - 1;
+            uint32_t bry   = (y + radius < height) ? y + radius : height - 1;
+            uint32_t sum   = CompactSatQuery(sat, tlx, tly, brx, bry);
+            uint16_t count = (brx - tlx + 1) * (bry - tly + 1);
+            new_image->data_[y * width + x] = (uint8_t)(sum / count);
+        }
+    }
+
+    return new_image;
+}
+
 /**
  * Difference between two pgm images expressed as an image itself.
  * Each pixel of the returned image is the absolute difference between the
@@ -239,6 +832,152 @@ PgmImage *PgmDiff(const PgmImage *image1, const PgmImage *image2) {
     return new_image;
 }
 
+/**
+ * Count the pixels of each value in an image, in a single pass.
+ * Each thread counts its share of the image into four interleaved sets of
+ * bins, so that runs of equal pixels do not serialise on one counter, and
+ * the sets are merged at the end.
+ *
+ * @param image     Image to count the pixels of
+ * @param histogram Histogram to fill
+ */
+void PgmToHistogram(const PgmImage *image, Histogram *histogram) {
+    size_t size = (size_t)image->width_ * image->height_;
+    size_t main = size & ~(size_t)3;
+    uint64_t lanes[4 * (PGM_MAX_GRAY + 1)] = {0};
+    const uint8_t *data = image->data_;
+
+#pragma omp parallel for default(none) shared(data, main) \
+    reduction(+ : lanes[:4 * (PGM_MAX_GRAY + 1)])
+    // Count four pixels at a time, one into each set of bins
+    for (size_t i = 0; i < main; i += 4) {
+        lanes[data[i]]++;
+        lanes[PGM_MAX_GRAY + 1 + data[i + 1]]++;
+        lanes[2 * (PGM_MAX_GRAY + 1) + data[i + 2]]++;
+        lanes[3 * (PGM_MAX_GRAY + 1) + data[i + 3]]++;
+    }
+    for (size_t i = main; i < size; i++) lanes[data[i]]++;
+
+    // Merge the sets of bins
+    for (uint32_t v = 0; v <= PGM_MAX_GRAY; v++) {
+        histogram->bins_[v] = lanes[v] + lanes[PGM_MAX_GRAY + 1 + v] +
+                              lanes[2 * (PGM_MAX_GRAY + 1) + v] +
+                              lanes[3 * (PGM_MAX_GRAY + 1) + v];
+    }
+    histogram->count_ = size;
+}
+
+/**
+ * Sum the pixel values of a histogram raised to some power p.
+ *
+ * @param histogram Histogram to sum
+ * @param p         Power to raise pixels to
+ * @return          Sum of pixels raised to p
+ */
+double HistogramSum(const Histogram *histogram, double p) {
+    double sum = 0;
+    for (uint32_t v = 0; v <= PGM_MAX_GRAY; v++) {
+        if (histogram->bins_[v]) {
+            sum += (double)histogram->bins_[v] * pow((double)v, p);
+        }
+    }
+
+    return sum;
+}
+
+/**
+ * Calculate the mean pixel value of a histogram.
+ *
+ * @param histogram Histogram to calculate the mean of
+ * @return          Mean pixel value, or 0 if the histogram is empty
+ */
+double HistogramMean(const Histogram *histogram) {
+    if (!histogram->count_) return 0;
+
+    uint64_t sum = 0;
+    for (uint32_t v = 0; v <= PGM_MAX_GRAY; v++) {
+        sum += histogram->bins_[v] * v;
+    }
+
+    return (double)sum / (double)histogram->count_;
+}
+
+/**
+ * Calculate the variance of the pixel values of a histogram.
+ *
+ * @param histogram Histogram to calculate the variance of
+ * @return          Variance of pixel values, or 0 if the histogram is empty
+ */
+double HistogramVariance(const Histogram *histogram) {
+    if (!histogram->count_) return 0;
+
+    // Sum differences from the mean squared, once per pixel value
+    double mean     = HistogramMean(histogram);
+    double variance = 0;
+    for (uint32_t v = 0; v <= PGM_MAX_GRAY; v++) {
+        double difference = (double)v - mean;
+        variance += (double)histogram->bins_[v] * difference * difference;
+    }
+
+    return variance / (double)histogram->count_;
+}
+
+/**
+ * Find the smallest pixel value of a histogram.
+ *
+ * @param histogram Histogram to search
+ * @return          Smallest pixel value, or 0 if the histogram is empty
+ */
+uint8_t HistogramMin(const Histogram *histogram) {
+    for (uint32_t v = 0; v <= PGM_MAX_GRAY; v++) {
+        if (histogram->bins_[v]) return (uint8_t)v;
+    }
+
+    return 0;
+}
+
+/**
+ * Find the largest pixel value of a histogram.
+ *
+ * @param histogram Histogram to search
+ * @return          Largest pixel value, or 0 if the histogram is empty
+ */
+uint8_t HistogramMax(const Histogram *histogram) {
+    for (uint32_t v = PGM_MAX_GRAY + 1; v-- > 0;) {
+        if (histogram->bins_[v]) return (uint8_t)v;
+    }
+
+    return 0;
+}
+
+/**
+ * Find a percentile of the pixel values of a histogram: the smallest value
+ * that at least the given fraction of the pixels are less than or equal to.
+ * A fraction of 0 gives the minimum, 0.5 the median and 1 the maximum.
+ *
+ * @param histogram Histogram to search
+ * @param fraction  Fraction of the pixels, between 0 and 1
+ * @return          Pixel value of the percentile, or 0 if the histogram is
+ *                  empty
+ */
+uint8_t HistogramPercentile(const Histogram *histogram, double fraction) {
+    if (!histogram->count_) return 0;
+
+    // The rank of the pixel to find, counting from 1
+    double rank     = ceil(fraction * (double)histogram->count_);
+    uint64_t target = histogram->count_;
+    if (rank < 1) target = 1;
+    else if (rank < (double)histogram->count_) target = (uint64_t)rank;
+
+    uint64_t seen = 0;
+    for (uint32_t v = 0; v <= PGM_MAX_GRAY; v++) {
+        seen += histogram->bins_[v];
+        if (seen >= target) return (uint8_t)v;
+    }
+
+    return PGM_MAX_GRAY;
+}
+
 /**
  * Sum the pixels of an image raised to some power p.
  *
@@ -247,15 +986,10 @@ PgmImage *PgmDiff(const PgmImage *image1, const PgmImage *image2) {
  * @return      Sum of pixels raised to p
  */
 double PgmSum(const PgmImage *image, double p) {
-    double sum = 0;
-
-#pragma omp parallel for default(none) shared(image, p) reduction(+ : sum)
-    // Sum pixels
-    for (uint32_t i = 0; i < image->height_ * image->width_; i++) {
-        sum += pow((double)image->data_[i], p);
-    }
+    Histogram histogram;
+    PgmToHistogram(image, &histogram);
 
-    return sum;
+    return HistogramSum(&histogram, p);
 }
 
 /**
@@ -265,21 +999,10 @@ double PgmSum(const PgmImage *image, double p) {
  * @return      Variance of pixel values
  */
 double PgmVariance(const PgmImage *image) {
-    // Calculate mean
-    double mean = (double)PgmSum(image, 1) / (image->width_ * image->height_);
-
-    // Calculate variance
-    double variance = 0;
-
-#pragma omp parallel for default(none) shared(image, mean) \
-    reduction(+ : variance)
-    // Sum differences from mean squared
-    for (uint32_t i = 0; i < image->height_ * image->width_; i++) {
-        variance += pow((double)image->data_[i] - mean, 2);
-    }
-    variance /= image->width_ * image->height_;
+    Histogram histogram;
+    PgmToHistogram(image, &histogram);
 
-    return variance;
+    return HistogramVariance(&histogram);
 }
 
 /**
@@ -321,11 +1044,12 @@ bool WritePgm(const PgmImage *image, const char *filename) {
 }
 
 /**
- * Free memory used by a PGM image.
+ * Free memory used by a PGM image, unmapping it if it was mapped.
  *
  * @param image     Image to free
  */
 void FreePgm(PgmImage *image) {
-    free(image->data_);
+    if (image->mapping_.data_) UnmapFile(&image->mapping_);
+    else free(image->data_);
     free(image);
 }
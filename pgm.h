@@ -26,6 +26,16 @@ extern PgmImage *AllocatePgm(uint32_t width, uint32_t height);
  */
 extern PgmImage *ReadPgm(const char *filename);
 
+/**
+ * Map a PGM image from a file without copying its pixel data.
+ * The returned image points into a read-only mapping of the file, so its
+ * pixels must not be modified. It is released with FreePgm as usual.
+ *
+ * @param filename  The name of the file to map.
+ * @return          A pointer to the image data, or NULL if an error occurred.
+ */
+extern PgmImage *MapPgm(const char *filename);
+
 /**
  * Convert an image to a new image using the given pixel conversion function.
  *
@@ -35,6 +45,114 @@ extern PgmImage *ReadPgm(const char *filename);
  */
 extern PgmImage *PpmToPgm(const PpmImage *image, LuminanceFn luminance);
 
+/**
+ * Convert a band of rows of a PPM image to PGM.
+ *
+ * @param band      The rows of the PPM image to convert.
+ * @param luminance Reference to the luminance function
+ * @param out       The PGM band to write to, with room for as many rows as the
+ * PPM band. Its height is set to that of the PPM band.
+ */
+extern void PpmToPgmBand(const PpmImage *band, LuminanceFn luminance,
+                         PgmImage *out);
+
+/**
+ * Convert a PPM image to a PGM image using built-in luminance weights.
+ * Each weight is rounded to a multiple of 2^-15 in [0, 1), and the luminance
+ * is computed in fixed point with SIMD where available. The result is
+ * bit-identical to evaluating the rounded weights in double precision and
+ * rounding half up.
+ *
+ * @param image     Pointer to the original image
+ * @param weights   The luminance weights, e.g. REC_709_WEIGHTS
+ * @return          Pointer to the new image
+ */
+extern PgmImage *PpmToPgmWeighted(const PpmImage *image,
+                                  LuminanceWeights weights);
+
+/**
+ * Convert a band of rows of a PPM image to PGM using built-in luminance
+ * weights, as in PpmToPgmWeighted.
+ *
+ * @param band      The rows of the PPM image to convert.
+ * @param weights   The luminance weights, e.g. REC_709_WEIGHTS
+ * @param out       The PGM band to write to, with room for as many rows as the
+ * PPM band. Its height is set to that of the PPM band.
+ */
+extern void PpmToPgmWeightedBand(const PpmImage *band,
+                                 LuminanceWeights weights, PgmImage *out);
+
+/**
+ * Convert one row of PPM pixels to luminance using built-in luminance weights,
+ * as in PpmToPgmWeighted.
+ *
+ * @param pixels    The pixels of the row.
+ * @param width     The number of pixels in the row.
+ * @param weights   The luminance weights, e.g. REC_709_WEIGHTS
+ * @param out       The luminance of each pixel.
+ */
+extern void PpmToPgmWeightedRow(const Pixel *pixels, uint32_t width,
+                                LuminanceWeights weights, uint8_t *out);
+
+/**
+ * Adapter that applies a per-pixel luminance function to a span of pixels.
+ * The luminance is truncated to an integer, as in PpmToPgm.
+ *
+ * @param pixels    The pixels.
+ * @param count     The number of pixels.
+ * @param x0        Unused
+ * @param y         Unused
+ * @param out       The luminance of each pixel.
+ * @param context   A pointer to the LuminanceFn to apply.
+ */
+extern void LuminanceFnRow(const Pixel *pixels, uint32_t count,
+                           __attribute__((unused)) uint32_t x0,
+                           __attribute__((unused)) uint32_t y, uint8_t *out,
+                           void *context);
+
+/**
+ * Span luminance function using built-in luminance weights, as in
+ * PpmToPgmWeighted.
+ *
+ * @param pixels    The pixels.
+ * @param count     The number of pixels.
+ * @param x0        Unused
+ * @param y         Unused
+ * @param out       The luminance of each pixel.
+ * @param context   A pointer to the LuminanceWeights to use.
+ */
+extern void WeightedLuminanceRow(const Pixel *pixels, uint32_t count,
+                                 __attribute__((unused)) uint32_t x0,
+                                 __attribute__((unused)) uint32_t y,
+                                 uint8_t *out, void *context);
+
+/**
+ * Convert a PPM image to a PGM image using the given span luminance function,
+ * called for every row in parallel.
+ *
+ * @param image     Pointer to the original image
+ * @param luminance Reference to the span luminance function
+ * @param context   Passed on to every call of luminance
+ * @return          Pointer to the new image
+ */
+extern PgmImage *PpmToPgmRows(const PpmImage *image, LuminanceRowFn luminance,
+                              void *context);
+
+/**
+ * Convert a band of rows of a PPM image to PGM using the given span luminance
+ * function.
+ *
+ * @param band      The rows of the PPM image to convert.
+ * @param y_offset  The row of the whole image the band starts at.
+ * @param luminance Reference to the span luminance function
+ * @param context   Passed on to every call of luminance
+ * @param out       The PGM band to write to, with room for as many rows as the
+ * PPM band. Its height is set to that of the PPM band.
+ */
+extern void PpmToPgmRowsBand(const PpmImage *band, uint32_t y_offset,
+                             LuminanceRowFn luminance, void *context,
+                             PgmImage *out);
+
 /**
  * Convert a PBM image to a PGM image.
  *
@@ -46,10 +164,12 @@ extern PgmImage *PbmToPgm(const PbmImage *image);
 /**
  * Blur effect first designed by KaspervanM in Jan 22, 2021
  * Each pixel becomes the average of a square surrounding that pixel with side
- * 2r + 1.
+ * 2r + 1, counting only the pixels inside the image. The square is summed
+ * separably with running sums, so the cost per pixel does not depend on r.
  * @param image     Input PgmImage
  * @param radius    Radius of the square
- * @return          Pointer to the new image data
+ * @return          Pointer to the new image data, or NULL if an error
+ * occurred.
  */
 extern PgmImage *KasperBlur(const PgmImage *image, int8_t radius);
 
@@ -63,6 +183,17 @@ extern PgmImage *KasperBlur(const PgmImage *image, int8_t radius);
  */
 extern PgmImage *BoxBlur(const SummedAreaTable *sat, int8_t radius);
 
+/**
+ * Each pixel becomes the average of a box surrounding that pixel with side
+ * 2r + 1, as in BoxBlur, using a compact summed area table. The table must
+ * have been computed for areas of at least (2r + 1)^2.
+ *
+ * @param sat       Compact summed area table of the image
+ * @param radius    Radius of the square
+ * @return          Blurred image, or NULL if an error occurred.
+ */
+extern PgmImage *CompactBoxBlur(const CompactSat *sat, int8_t radius);
+
 /**
  * Difference between two pgm images expressed as an image itself.
  * Each pixel of the returned image is the absolute difference between the
@@ -74,6 +205,71 @@ extern PgmImage *BoxBlur(const SummedAreaTable *sat, int8_t radius);
  */
 extern PgmImage *PgmDiff(const PgmImage *image1, const PgmImage *image2);
 
+/**
+ * Count the pixels of each value in an image, in a single pass.
+ * Each thread counts its share of the image into four interleaved sets of
+ * bins, so that runs of equal pixels do not serialise on one counter, and
+ * the sets are merged at the end.
+ *
+ * @param image     Image to count the pixels of
+ * @param histogram Histogram to fill
+ */
+extern void PgmToHistogram(const PgmImage *image, Histogram *histogram);
+
+/**
+ * Sum the pixel values of a histogram raised to some power p.
+ *
+ * @param histogram Histogram to sum
+ * @param p         Power to raise pixels to
+ * @return          Sum of pixels raised to p
+ */
+extern double HistogramSum(const Histogram *histogram, double p);
+
+/**
+ * Calculate the mean pixel value of a histogram.
+ *
+ * @param histogram Histogram to calculate the mean of
+ * @return          Mean pixel value, or 0 if the histogram is empty
+ */
+extern double HistogramMean(const Histogram *histogram);
+
+/**
+ * Calculate the variance of the pixel values of a histogram.
+ *
+ * @param histogram Histogram to calculate the variance of
+ * @return          Variance of pixel values, or 0 if the histogram is empty
+ */
+extern double HistogramVariance(const Histogram *histogram);
+
+/**
+ * Find the smallest pixel value of a histogram.
+ *
+ * @param histogram Histogram to search
+ * @return          Smallest pixel value, or 0 if the histogram is empty
+ */
+extern uint8_t HistogramMin(const Histogram *histogram);
+
+/**
+ * Find the largest pixel value of a histogram.
+ *
+ * @param histogram Histogram to search
+ * @return          Largest pixel value, or 0 if the histogram is empty
+ */
+extern uint8_t HistogramMax(const Histogram *histogram);
+
+/**
+ * Find a percentile of the pixel values of a histogram: the smallest value
+ * that at least the given fraction of the pixels are less than or equal to.
+ * A fraction of 0 gives the minimum, 0.5 the median and 1 the maximum.
+ *
+ * @param histogram Histogram to search
+ * @param fraction  Fraction of the pixels, between 0 and 1
+ * @return          Pixel value of the percentile, or 0 if the histogram is
+ *                  empty
+ */
+extern uint8_t HistogramPercentile(const Histogram *histogram,
+                                   double fraction);
+
 /**
  * Sum the pixels of an image raised to some power p.
  *
@@ -101,7 +297,7 @@ extern double PgmVariance(const PgmImage *image);
 extern bool WritePgm(const PgmImage *image, const char *filename);
 
 /**
- * Free memory used by a PGM image.
+ * Free memory used by a PGM image, unmapping it if it was mapped.
  *
  * @param image     Image to free
  */
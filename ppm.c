@@ -6,6 +6,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "mapping.h"
+
+#if defined __AVX2__
+#include <immintrin.h>
+#endif
+
 /**
  * Allocate memory for a PPM image.
  *
@@ -23,6 +29,7 @@ PpmImage *AllocatePpm(uint32_t width, uint32_t height) {
     image->width_     = width;
     image->height_    = height;
     image->max_color_ = PPM_MAX_COLOR;
+    image->mapping_   = (MappedFile){NULL, 0};
     image->data_      = (Pixel *)calloc(width * height, sizeof(Pixel));
     if (!image->data_) {
         fprintf(stderr, "Error: out of memory\n");
@@ -92,6 +99,43 @@ PpmImage *ReadPpm(const char *filename) {
     return image;
 }
 
+/**
+ * Map a PPM image from a file without copying its pixel data.
+ * The returned image points into a read-only mapping of the file, so its
+ * pixels must not be modified. It is released with FreePpm as usual.
+ *
+ * @param filename  The name of the file to map.
+ * @return          A pointer to the image data, or NULL if an error occurred.
+ */
+PpmImage *MapPpm(const char *filename) {
+    // Map the file and parse the header in place
+    MappedFile file;
+    NetpbmHeader header;
+    if (!MapNetpbm(filename, '6', sizeof(Pixel), &file, &header)) return NULL;
+
+    // Make sure the max color value is PPM_MAX_COLOR
+    if (header.max_value_ != PPM_MAX_COLOR) {
+        fprintf(stderr, "Error: max color value must be PPM_MAX_COLOR\n");
+        UnmapFile(&file);
+        return NULL;
+    }
+
+    // Allocate the image header only, the pixels stay in the mapping
+    PpmImage *image = (PpmImage *)malloc(sizeof(PpmImage));
+    if (!image) {
+        fprintf(stderr, "Error: out of memory\n");
+        UnmapFile(&file);
+        return NULL;
+    }
+    image->width_     = header.width_;
+    image->height_    = header.height_;
+    image->max_color_ = header.max_value_;
+    image->mapping_   = file;
+    image->data_      = (Pixel *)(file.data_ + header.offset_);
+
+    return image;
+}
+
 /**
  * Convert SRgb value to linear RGB value
  *
@@ -114,18 +158,59 @@ double SRgbValue(double linear_rgb) {
                                    : 1.055 * pow(linear_rgb, 1.0 / 2.4) - 0.055;
 }
 
+// Per-channel lookup tables for LinearRgb and SRgb, filled at load time.
+// Entries are 32 bits wide so they can be gathered by the AVX2 kernel.
+static uint32_t linear_rgb_table[PPM_MAX_COLOR + 1];
+static uint32_t s_rgb_table[PPM_MAX_COLOR + 1];
+
+/**
+ * Fill the per-channel gamma conversion tables.
+ * Each entry is computed exactly as the per-channel conversion used to be, so
+ * table lookups give bit-identical results to calling pow per channel.
+ */
+__attribute__((constructor)) static void InitGammaTables(void) {
+    for (uint32_t v = 0; v <= PPM_MAX_COLOR; v++) {
+        linear_rgb_table[v] = (uint8_t)(LinearRgbValue(v / PPM_MAX_COLOR_F) *
+                                        PPM_MAX_COLOR_F);
+        s_rgb_table[v] =
+            (uint8_t)(SRgbValue(v / PPM_MAX_COLOR_F) * PPM_MAX_COLOR_F);
+    }
+}
+
+/**
+ * Replace every byte of a buffer by its entry in a 256-entry table.
+ *
+ * @param table The lookup table, with entries 0-255.
+ * @param data  The bytes to convert in place.
+ * @param size  The number of bytes.
+ */
+static void LookupBytes(const uint32_t *table, uint8_t *data, size_t size) {
+    size_t i = 0;
+#if defined __AVX2__
+    // Gather 8 entries at a time and narrow them back to bytes
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    for (; i + 8 <= size; i += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *)(data + i)));
+        __m256i v = _mm256_i32gather_epi32((const int *)table, index, 4);
+        v         = _mm256_packus_epi32(v, v);
+        v         = _mm256_packus_epi16(v, v);
+        v         = _mm256_permutevar8x32_epi32(v, order);
+        _mm_storel_epi64((__m128i *)(data + i), _mm256_castsi256_si128(v));
+    }
+#endif
+    for (; i < size; i++) data[i] = (uint8_t)table[data[i]];
+}
+
 /**
  * Convert SRgb color to linear RGB color
  *
  * @param s_rgb SRgb Pixel
  */
 void LinearRgb(Pixel *s_rgb) {
-    s_rgb->r_ = (uint8_t)(LinearRgbValue(s_rgb->r_ / PPM_MAX_COLOR_F) *
-                          PPM_MAX_COLOR_F);
-    s_rgb->g_ = (uint8_t)(LinearRgbValue(s_rgb->g_ / PPM_MAX_COLOR_F) *
-                          PPM_MAX_COLOR_F);
-    s_rgb->b_ = (uint8_t)(LinearRgbValue(s_rgb->b_ / PPM_MAX_COLOR_F) *
-                          PPM_MAX_COLOR_F);
+    s_rgb->r_ = (uint8_t)linear_rgb_table[s_rgb->r_];
+    s_rgb->g_ = (uint8_t)linear_rgb_table[s_rgb->g_];
+    s_rgb->b_ = (uint8_t)linear_rgb_table[s_rgb->b_];
 }
 
 /**
@@ -134,12 +219,59 @@ void LinearRgb(Pixel *s_rgb) {
  * @param linear_rgb Linear RGB color
  */
 void SRgb(Pixel *linear_rgb) {
-    linear_rgb->r_ = (uint8_t)(SRgbValue(linear_rgb->r_ / PPM_MAX_COLOR_F) *
-                               PPM_MAX_COLOR_F);
-    linear_rgb->g_ = (uint8_t)(SRgbValue(linear_rgb->g_ / PPM_MAX_COLOR_F) *
-                               PPM_MAX_COLOR_F);
-    linear_rgb->b_ = (uint8_t)(SRgbValue(linear_rgb->b_ / PPM_MAX_COLOR_F) *
-                               PPM_MAX_COLOR_F);
+    linear_rgb->r_ = (uint8_t)s_rgb_table[linear_rgb->r_];
+    linear_rgb->g_ = (uint8_t)s_rgb_table[linear_rgb->g_];
+    linear_rgb->b_ = (uint8_t)s_rgb_table[linear_rgb->b_];
+}
+
+/**
+ * Convert a span of SRgb pixels to linear RGB in place, through the same
+ * lookup table as LinearRgb.
+ *
+ * @param pixels    The pixels to convert.
+ * @param count     The number of pixels.
+ * @param x0        Unused
+ * @param y         Unused
+ * @param context   Unused
+ */
+void LinearRgbRow(Pixel *pixels, uint32_t count,
+                  __attribute__((unused)) uint32_t x0,
+                  __attribute__((unused)) uint32_t y,
+                  __attribute__((unused)) void *context) {
+    LookupBytes(linear_rgb_table, (uint8_t *)pixels, (size_t)count * 3);
+}
+
+/**
+ * Convert a span of linear RGB pixels to SRgb in place, through the same
+ * lookup table as SRgb.
+ *
+ * @param pixels    The pixels to convert.
+ * @param count     The number of pixels.
+ * @param x0        Unused
+ * @param y         Unused
+ * @param context   Unused
+ */
+void SRgbRow(Pixel *pixels, uint32_t count,
+             __attribute__((unused)) uint32_t x0,
+             __attribute__((unused)) uint32_t y,
+             __attribute__((unused)) void *context) {
+    LookupBytes(s_rgb_table, (uint8_t *)pixels, (size_t)count * 3);
+}
+
+/**
+ * Adapter that applies a per-pixel conversion function to a span of pixels.
+ *
+ * @param pixels    The pixels to convert.
+ * @param count     The number of pixels.
+ * @param x0        Unused
+ * @param y         Unused
+ * @param context   A pointer to the PixelFn to apply.
+ */
+void PixelFnRow(Pixel *pixels, uint32_t count,
+                __attribute__((unused)) uint32_t x0,
+                __attribute__((unused)) uint32_t y, void *context) {
+    PixelFn conversion_fn = *(PixelFn *)context;
+    for (uint32_t i = 0; i < count; i++) conversion_fn(&pixels[i]);
 }
 
 /**
@@ -161,15 +293,75 @@ PpmImage *PpmPixelConvert(PpmImage *image, void (*conversion_fn)(Pixel *)) {
     memcpy(new_image->data_, image->data_,
            sizeof(Pixel) * new_image->width_ * new_image->height_);
 
-#pragma omp parallel for default(none) shared(new_image, conversion_fn)
-    // Convert the pixel data of the new image using the given conversion
-    // function
-    for (int i = 0; i < new_image->width_ * new_image->height_; i++)
-        conversion_fn(&new_image->data_[i]);
+    // Convert the copy in place as a single band
+    PpmPixelConvertBand(new_image, conversion_fn);
+    return new_image;
+}
+
+/**
+ * Convert a band of rows of a PPM image in place using the given pixel
+ * conversion function. LinearRgb and SRgb are recognised and applied to all
+ * channels at once through lookup tables.
+ *
+ * @param band          The rows of the PPM image to convert
+ * @param conversion_fn Reference to the pixel conversion function
+ */
+void PpmPixelConvertBand(PpmImage *band, void (*conversion_fn)(Pixel *)) {
+    // The gamma conversions have span versions, anything else goes through
+    // the adapter
+    PixelRowFn row_fn = conversion_fn == LinearRgb ? LinearRgbRow
+                        : conversion_fn == SRgb    ? SRgbRow
+                                                   : PixelFnRow;
+    PpmPixelConvertRowsBand(band, 0, row_fn, &conversion_fn);
+}
 
+/**
+ * Convert an image to a new image using the given span conversion function,
+ * called for every row in parallel.
+ *
+ * @param image         Pointer to the original image
+ * @param conversion_fn Reference to the span conversion function
+ * @param context       Passed on to every call of conversion_fn
+ * @return              Pointer to the new image
+ */
+PpmImage *PpmPixelConvertRows(const PpmImage *image,
+                              PixelRowFn conversion_fn, void *context) {
+    // Allocate memory for the new image
+    PpmImage *new_image = AllocatePpm(image->width_, image->height_);
+    if (!new_image) {
+        fprintf(stderr, "Error: could not allocate memory for new PPM image");
+        return NULL;
+    }
+
+    // Copy the pixel data of the original image to the new image
+    memcpy(new_image->data_, image->data_,
+           sizeof(Pixel) * new_image->width_ * new_image->height_);
+
+    // Convert the copy in place as a single band
+    PpmPixelConvertRowsBand(new_image, 0, conversion_fn, context);
     return new_image;
 }
 
+/**
+ * Convert a band of rows of a PPM image in place using the given span
+ * conversion function.
+ *
+ * @param band          The rows of the PPM image to convert
+ * @param y_offset      The row of the whole image the band starts at.
+ * @param conversion_fn Reference to the span conversion function
+ * @param context       Passed on to every call of conversion_fn
+ */
+void PpmPixelConvertRowsBand(PpmImage *band, uint32_t y_offset,
+                             PixelRowFn conversion_fn, void *context) {
+#pragma omp parallel for default(none) \
+    shared(band, y_offset, conversion_fn, context)
+    // Convert the pixel data of the band a row at a time
+    for (uint32_t y = 0; y < band->height_; y++) {
+        conversion_fn(band->data_ + (size_t)y * band->width_, band->width_, 0,
+                      y_offset + y, context);
+    }
+}
+
 /**
  * Calculate the LinearLuminance of a pixel.
  *
@@ -230,11 +422,12 @@ bool WritePpm(const PpmImage *image, const char *filename) {
 }
 
 /**
- * Free the memory used by an image.
+ * Free the memory used by an image, unmapping it if it was mapped.
  *
  * @param image The image to free.
  */
 void FreePpm(PpmImage *image) {
-    free(image->data_);
+    if (image->mapping_.data_) UnmapFile(&image->mapping_);
+    else free(image->data_);
     free(image);
 }
@@ -24,6 +24,16 @@ extern PpmImage *AllocatePpm(uint32_t width, uint32_t height);
  */
 extern PpmImage *ReadPpm(const char *filename);
 
+/**
+ * Map a PPM image from a file without copying its pixel data.
+ * The returned image points into a read-only mapping of the file, so its
+ * pixels must not be modified. It is released with FreePpm as usual.
+ *
+ * @param filename  The name of the file to map.
+ * @return          A pointer to the image data, or NULL if an error occurred.
+ */
+extern PpmImage *MapPpm(const char *filename);
+
 /**
  * Convert SRgb value to linear RGB value
  *
@@ -54,6 +64,49 @@ extern void LinearRgb(Pixel *s_rgb);
  */
 extern void SRgb(Pixel *linear_rgb);
 
+/**
+ * Convert a span of SRgb pixels to linear RGB in place, through the same
+ * lookup table as LinearRgb.
+ *
+ * @param pixels    The pixels to convert.
+ * @param count     The number of pixels.
+ * @param x0        Unused
+ * @param y         Unused
+ * @param context   Unused
+ */
+extern void LinearRgbRow(Pixel *pixels, uint32_t count,
+                         __attribute__((unused)) uint32_t x0,
+                         __attribute__((unused)) uint32_t y,
+                         __attribute__((unused)) void *context);
+
+/**
+ * Convert a span of linear RGB pixels to SRgb in place, through the same
+ * lookup table as SRgb.
+ *
+ * @param pixels    The pixels to convert.
+ * @param count     The number of pixels.
+ * @param x0        Unused
+ * @param y         Unused
+ * @param context   Unused
+ */
+extern void SRgbRow(Pixel *pixels, uint32_t count,
+                    __attribute__((unused)) uint32_t x0,
+                    __attribute__((unused)) uint32_t y,
+                    __attribute__((unused)) void *context);
+
+/**
+ * Adapter that applies a per-pixel conversion function to a span of pixels.
+ *
+ * @param pixels    The pixels to convert.
+ * @param count     The number of pixels.
+ * @param x0        Unused
+ * @param y         Unused
+ * @param context   A pointer to the PixelFn to apply.
+ */
+extern void PixelFnRow(Pixel *pixels, uint32_t count,
+                       __attribute__((unused)) uint32_t x0,
+                       __attribute__((unused)) uint32_t y, void *context);
+
 /**
  * Convert an image to a new image using the given pixel conversion function
  *
@@ -64,6 +117,41 @@ extern void SRgb(Pixel *linear_rgb);
 extern PpmImage *PpmPixelConvert(PpmImage *image,
                                  void (*conversion_fn)(Pixel *));
 
+/**
+ * Convert a band of rows of a PPM image in place using the given pixel
+ * conversion function. LinearRgb and SRgb are recognised and applied to all
+ * channels at once through lookup tables.
+ *
+ * @param band          The rows of the PPM image to convert
+ * @param conversion_fn Reference to the pixel conversion function
+ */
+extern void PpmPixelConvertBand(PpmImage *band,
+                                void (*conversion_fn)(Pixel *));
+
+/**
+ * Convert an image to a new image using the given span conversion function,
+ * called for every row in parallel.
+ *
+ * @param image         Pointer to the original image
+ * @param conversion_fn Reference to the span conversion function
+ * @param context       Passed on to every call of conversion_fn
+ * @return              Pointer to the new image
+ */
+extern PpmImage *PpmPixelConvertRows(const PpmImage *image,
+                                     PixelRowFn conversion_fn, void *context);
+
+/**
+ * Convert a band of rows of a PPM image in place using the given span
+ * conversion function.
+ *
+ * @param band          The rows of the PPM image to convert
+ * @param y_offset      The row of the whole image the band starts at.
+ * @param conversion_fn Reference to the span conversion function
+ * @param context       Passed on to every call of conversion_fn
+ */
+extern void PpmPixelConvertRowsBand(PpmImage *band, uint32_t y_offset,
+                                    PixelRowFn conversion_fn, void *context);
+
 /**
  * Calculate the LinearLuminance of a pixel.
  *
@@ -90,7 +178,7 @@ extern double SRgbLuminance(const Pixel *p);
 extern bool WritePpm(const PpmImage *image, const char *filename);
 
 /**
- * Free the memory used by an image.
+ * Free the memory used by an image, unmapping it if it was mapped.
  *
  * @param image The image to free.
  */
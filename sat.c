@@ -3,6 +3,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "types/pgm.h"
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Rows per band in the construction of a summed area table
+#define SAT_BAND_ROWS 64
+
+// Columns per strip in the column-wise sums of a summed area table
+#define SAT_STRIP_WIDTH 1024
+
 /**
  * Allocate memory for a summed area table.
  *
@@ -18,9 +30,10 @@ SummedAreaTable *AllocateSat(uint32_t width, uint32_t height) {
         fprintf(stderr, "Error: out of memory\n");
         return NULL;
     }
-    sat->width_  = width;
-    sat->height_ = height;
-    sat->data_   = (uint64_t *)calloc(width * height, sizeof(uint64_t));
+    sat->width_   = width;
+    sat->height_  = height;
+    sat->squares_ = NULL;
+    sat->data_ = (uint64_t *)calloc((size_t)width * height, sizeof(uint64_t));
     if (!sat->data_) {
         fprintf(stderr, "Error: out of memory\n");
         free(sat);
@@ -31,42 +44,228 @@ SummedAreaTable *AllocateSat(uint32_t width, uint32_t height) {
 }
 
 /**
- * Compute the summed area table of a PGM image.
+ * Compute the prefix sums of a row of pixels, optionally adding the sums of
+ * the row above.
+ *
+ * @param pixels    The pixels of the row.
+ * @param width     The width of the row.
+ * @param above     The sums of the row above, or NULL for the first row.
+ * @param sums      The sums of the row.
+ */
+static void SatRow(const uint8_t *pixels, uint32_t width, const uint64_t *above,
+                   uint64_t *sums) {
+    uint32_t x     = 0;
+    uint64_t total = 0;
+#if defined __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i carry      = zero;
+    for (; x + 8 <= width; x += 8) {
+        // Prefix sums of 8 pixels in 16-bit lanes, in log steps
+        __m128i v = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(pixels + x)), zero);
+        v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+        v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+
+        // Widen them to 64 bits and add the sums before and above them
+        __m128i lo       = _mm_unpacklo_epi16(v, zero);
+        __m128i hi       = _mm_unpackhi_epi16(v, zero);
+        __m128i pairs[4] = {_mm_unpacklo_epi32(lo, zero),
+                            _mm_unpackhi_epi32(lo, zero),
+                            _mm_unpacklo_epi32(hi, zero),
+                            _mm_unpackhi_epi32(hi, zero)};
+        for (int k = 0; k < 4; k++) {
+            __m128i sum = _mm_add_epi64(pairs[k], carry);
+            if (above)
+                sum = _mm_add_epi64(
+                    sum, _mm_loadu_si128((const __m128i *)(above + x) + k));
+            _mm_storeu_si128((__m128i *)(sums + x) + k, sum);
+        }
+        carry = _mm_add_epi64(carry, _mm_unpackhi_epi64(pairs[3], pairs[3]));
+    }
+    _mm_storel_epi64((__m128i *)&total, carry);
+#endif
+    for (; x < width; x++) {
+        total += pixels[x];
+        sums[x] = above ? total + above[x] : total;
+    }
+}
+
+/**
+ * Compute the prefix sums of the squares of a row of pixels, optionally
+ * adding the sums of the row above.
+ *
+ * @param pixels    The pixels of the row.
+ * @param width     The width of the row.
+ * @param above     The sums of the row above, or NULL for the first row.
+ * @param sums      The sums of the row.
+ */
+static void SatSquaresRow(const uint8_t *pixels, uint32_t width,
+                          const uint64_t *above, uint64_t *sums) {
+    uint32_t x     = 0;
+    uint64_t total = 0;
+#if defined __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i carry      = zero;
+    for (; x + 8 <= width; x += 8) {
+        // Squares of 8 pixels, which fit in 16 bits, widened to 32 bits
+        __m128i v = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(pixels + x)), zero);
+        v          = _mm_mullo_epi16(v, v);
+        __m128i lo = _mm_unpacklo_epi16(v, zero);
+        __m128i hi = _mm_unpackhi_epi16(v, zero);
+
+        // Prefix sums of each half in log steps, then across the halves
+        lo = _mm_add_epi32(lo, _mm_slli_si128(lo, 4));
+        lo = _mm_add_epi32(lo, _mm_slli_si128(lo, 8));
+        hi = _mm_add_epi32(hi, _mm_slli_si128(hi, 4));
+        hi = _mm_add_epi32(hi, _mm_slli_si128(hi, 8));
+        hi = _mm_add_epi32(hi, _mm_shuffle_epi32(lo, 0xFF));
+
+        // Widen them to 64 bits and add the sums before and above them
+        __m128i pairs[4] = {_mm_unpacklo_epi32(lo, zero),
+                            _mm_unpackhi_epi32(lo, zero),
+                            _mm_unpacklo_epi32(hi, zero),
+                            _mm_unpackhi_epi32(hi, zero)};
+        for (int k = 0; k < 4; k++) {
+            __m128i sum = _mm_add_epi64(pairs[k], carry);
+            if (above)
+                sum = _mm_add_epi64(
+                    sum, _mm_loadu_si128((const __m128i *)(above + x) + k));
+            _mm_storeu_si128((__m128i *)(sums + x) + k, sum);
+        }
+        carry = _mm_add_epi64(carry, _mm_unpackhi_epi64(pairs[3], pairs[3]));
+    }
+    _mm_storel_epi64((__m128i *)&total, carry);
+#endif
+    for (; x < width; x++) {
+        total += (uint32_t)pixels[x] * pixels[x];
+        sums[x] = above ? total + above[x] : total;
+    }
+}
+
+/**
+ * Fill a summed area table, and that of the squared pixels if it has one.
+ * The rows are split into bands whose tables are computed in parallel. The
+ * totals of the bands are then carried down through their last rows, and
+ * finally added to the other rows of the bands below, all in one parallel
+ * region.
  *
  * @param pgm   The PGM image.
- * @return      The summed area table, or NULL if an error occurred.
+ * @param sat   The summed area table to fill.
  */
-SummedAreaTable *PgmToSat(const PgmImage *pgm) {
+static void FillSat(const PgmImage *pgm, SummedAreaTable *sat) {
     uint32_t width  = pgm->width_;
     uint32_t height = pgm->height_;
+    uint32_t bands  = (height + SAT_BAND_ROWS - 1) / SAT_BAND_ROWS;
 
+#pragma omp parallel default(none) shared(sat, pgm, width, height, bands)
+    {
+#pragma omp for
+        // Summed area table of each band on its own
+        for (uint32_t b = 0; b < bands; b++) {
+            uint32_t y0 = b * SAT_BAND_ROWS;
+            uint32_t y1 = height - y0 < SAT_BAND_ROWS ? height
+                                                      : y0 + SAT_BAND_ROWS;
+            for (uint32_t y = y0; y < y1; y++) {
+                const uint8_t *pixels = pgm->data_ + (size_t)y * width;
+                uint64_t *row         = sat->data_ + (size_t)y * width;
+                SatRow(pixels, width, y > y0 ? row - width : NULL, row);
+                if (sat->squares_) {
+                    row = sat->squares_ + (size_t)y * width;
+                    SatSquaresRow(pixels, width, y > y0 ? row - width : NULL,
+                                  row);
+                }
+            }
+        }
+
+#pragma omp for
+        // Carry the totals down through the last row of every band, a strip
+        // of columns at a time
+        for (uint32_t x0 = 0; x0 < width; x0 += SAT_STRIP_WIDTH) {
+            uint32_t x1 = width - x0 < SAT_STRIP_WIDTH ? width
+                                                       : x0 + SAT_STRIP_WIDTH;
+            for (uint32_t b = 1; b < bands; b++) {
+                uint32_t last = b + 1 < bands ? (b + 1) * SAT_BAND_ROWS - 1
+                                              : height - 1;
+                uint64_t *row = sat->data_ + (size_t)last * width;
+                const uint64_t *carry =
+                    sat->data_ + ((size_t)b * SAT_BAND_ROWS - 1) * width;
+                for (uint32_t x = x0; x < x1; x++) row[x] += carry[x];
+                if (sat->squares_) {
+                    row   = sat->squares_ + (size_t)last * width;
+                    carry = sat->squares_ + ((size_t)b * SAT_BAND_ROWS - 1) *
+                                                width;
+                    for (uint32_t x = x0; x < x1; x++) row[x] += carry[x];
+                }
+            }
+        }
+
+#pragma omp for
+        // Add the totals of the bands above to the other rows of every band
+        for (uint32_t b = 1; b < bands; b++) {
+            uint32_t y0 = b * SAT_BAND_ROWS;
+            uint32_t y1 = height - y0 < SAT_BAND_ROWS ? height
+                                                      : y0 + SAT_BAND_ROWS;
+            const uint64_t *carry = sat->data_ + ((size_t)y0 - 1) * width;
+            for (uint32_t y = y0; y + 1 < y1; y++) {
+                uint64_t *row = sat->data_ + (size_t)y * width;
+                for (uint32_t x = 0; x < width; x++) row[x] += carry[x];
+            }
+            if (!sat->squares_) continue;
+            carry = sat->squares_ + ((size_t)y0 - 1) * width;
+            for (uint32_t y = y0; y + 1 < y1; y++) {
+                uint64_t *row = sat->squares_ + (size_t)y * width;
+                for (uint32_t x = 0; x < width; x++) row[x] += carry[x];
+            }
+        }
+    }
+}
+
+/**
+ * Compute the summed area table of a PGM image.
+ * The rows are split into bands whose tables are computed in parallel. The
+ * totals of the bands are then carried down through their last rows, and
+ * finally added to the other rows of the bands below, all in one parallel
+ * region.
+ *
+ * @param pgm   The PGM image.
+ * @return      The summed area table, or NULL if an error occurred.
+ */
+SummedAreaTable *PgmToSat(const PgmImage *pgm) {
     // Allocate memory for summed area table
-    SummedAreaTable *sat = AllocateSat(width, height);
+    SummedAreaTable *sat = AllocateSat(pgm->width_, pgm->height_);
     if (!sat) {
         return NULL;
     }
 
-#pragma omp parallel for default(none) shared(sat, pgm, width)
-    // Copy first row
-    for (uint32_t x = 0; x < width; x++) {
-        sat->data_[x] = (uint64_t)pgm->data_[x];
-    }
+    FillSat(pgm, sat);
+    return sat;
+}
 
-    // Column-wise sum
-    for (uint32_t y = 1; y < height; y++) {
-#pragma omp parallel for default(none) shared(sat, pgm, width, y)
-        for (uint32_t x = 0; x < width; x++) {
-            sat->data_[y * width + x] = (uint64_t)pgm->data_[y * width + x] +
-                                        sat->data_[(y - 1) * width + x];
-        }
+/**
+ * Compute the summed area table of a PGM image, and that of its squared
+ * pixels, in the same passes as PgmToSat.
+ *
+ * @param pgm   The PGM image.
+ * @return      The summed area table, with squares_ set, or NULL if an error
+ * occurred.
+ */
+SummedAreaTable *PgmToSatSquared(const PgmImage *pgm) {
+    // Allocate memory for both summed area tables
+    SummedAreaTable *sat = AllocateSat(pgm->width_, pgm->height_);
+    if (!sat) {
+        return NULL;
     }
-#pragma omp parallel for default(none) shared(sat, width, height)
-    //  Row-wise sum
-    for (uint32_t y = 0; y < height; y++) {
-        for (uint32_t x = 1; x < width; x++) {
-            sat->data_[y * width + x] += sat->data_[y * width + x - 1];
-        }
+    sat->squares_ = (uint64_t *)malloc((size_t)pgm->width_ * pgm->height_ *
+                                       sizeof(uint64_t));
+    if (!sat->squares_) {
+        fprintf(stderr, "Error: out of memory\n");
+        FreeSat(sat);
+        return NULL;
     }
+
+    FillSat(pgm, sat);
     return sat;
 }
 
@@ -91,12 +290,153 @@ uint64_t SatQuery(const SummedAreaTable *sat, uint32_t tlx, uint32_t tly,
     return res;
 }
 
+/**
+ * Query the sums of the squared pixels of a summed area table.
+ *
+ * @param sat   The summed area table, from PgmToSatSquared.
+ * @param tlx   Top-left x coordinate.
+ * @param tly   Top-left y coordinate.
+ * @param brx   Bottom-right x coordinate.
+ * @param bry   Bottom-right y coordinate.
+ * @return      The sum of the squared pixels in the rectangle defined by the
+ * given coordinates.
+ */
+uint64_t SatQuerySquares(const SummedAreaTable *sat, uint32_t tlx,
+                         uint32_t tly, uint32_t brx, uint32_t bry) {
+    const uint64_t *data = sat->squares_;
+    uint64_t res         = data[(size_t)bry * sat->width_ + brx];
+    if (tly > 0) res -= data[(size_t)(tly - 1) * sat->width_ + brx];
+    if (tlx > 0) res -= data[(size_t)bry * sat->width_ + tlx - 1];
+    if (tlx > 0 && tly > 0)
+        res += data[(size_t)(tly - 1) * sat->width_ + tlx - 1];
+    return res;
+}
+
 /**
  * Free memory for a summed area table.
  *
  * @param sat  The summed area table to free.
  */
 void FreeSat(SummedAreaTable *sat) {
+    free(sat->squares_);
     free(sat->data_);
     free(sat);
 }
+
+/**
+ * Allocate memory for a compact summed area table.
+ * The element size is the smallest one that keeps the sum of any rectangle of
+ * at most max_area pixels exact, given that the table never has to cover more
+ * than the whole image.
+ *
+ * @param width     The width of the image.
+ * @param height    The height of the image.
+ * @param max_area  The largest area that will be queried.
+ * @return          A pointer to the CompactSat, or NULL if an error occurred.
+ */
+CompactSat *AllocateCompactSat(uint32_t width, uint32_t height,
+                               uint64_t max_area) {
+    // No query can cover more than the whole image
+    uint64_t area = (uint64_t)width * height;
+    if (max_area > area) max_area = area;
+    if (max_area > UINT32_MAX / PGM_MAX_GRAY) {
+        fprintf(stderr, "Error: query area %lu too large for a compact summed "
+                        "area table\n", (unsigned long)max_area);
+        return NULL;
+    }
+
+    // Allocate memory for table data
+    CompactSat *sat = (CompactSat *)malloc(sizeof(CompactSat));
+    if (!sat) {
+        fprintf(stderr, "Error: out of memory\n");
+        return NULL;
+    }
+    sat->width_        = width;
+    sat->height_       = height;
+    sat->max_area_     = max_area;
+    sat->element_size_ = PGM_MAX_GRAY * max_area <= UINT16_MAX ? 2 : 4;
+    sat->data32_       = calloc(area, sat->element_size_);
+    if (!sat->data32_) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(sat);
+        return NULL;
+    }
+
+    return sat;
+}
+
+/**
+ * Compute the compact summed area table of a PGM image.
+ *
+ * @param pgm       The PGM image.
+ * @param max_area  The largest area that will be queried, e.g. (2r + 1)^2 for
+ * a box blur of radius r.
+ * @return          The compact summed area table, or NULL if an error
+ * occurred.
+ */
+CompactSat *PgmToCompactSat(const PgmImage *pgm, uint64_t max_area) {
+    uint32_t width  = pgm->width_;
+    uint32_t height = pgm->height_;
+
+    // Allocate memory for summed area table
+    CompactSat *sat = AllocateCompactSat(width, height, max_area);
+    if (!sat) {
+        return NULL;
+    }
+
+    if (sat->element_size_ == 2) {
+        uint16_t *data = sat->data16_;
+#pragma omp parallel for default(none) shared(data, pgm, width, height)
+        // Row-wise sum, wrapping around
+        for (uint32_t y = 0; y < height; y++) {
+            const uint8_t *row = pgm->data_ + (size_t)y * width;
+            uint16_t sum       = 0;
+            for (uint32_t x = 0; x < width; x++)
+                data[(size_t)y * width + x] = sum = (uint16_t)(sum + row[x]);
+        }
+#pragma omp parallel for default(none) shared(data, width, height)
+        // Column-wise sum, a strip of columns per iteration
+        for (uint32_t x0 = 0; x0 < width; x0 += SAT_STRIP_WIDTH) {
+            uint32_t x1 = width - x0 < SAT_STRIP_WIDTH ? width
+                                                       : x0 + SAT_STRIP_WIDTH;
+            for (uint32_t y = 1; y < height; y++) {
+                uint16_t *row       = data + (size_t)y * width;
+                const uint16_t *top = row - width;
+                for (uint32_t x = x0; x < x1; x++)
+                    row[x] = (uint16_t)(row[x] + top[x]);
+            }
+        }
+    } else {
+        uint32_t *data = sat->data32_;
+#pragma omp parallel for default(none) shared(data, pgm, width, height)
+        // Row-wise sum, wrapping around
+        for (uint32_t y = 0; y < height; y++) {
+            const uint8_t *row = pgm->data_ + (size_t)y * width;
+            uint32_t sum       = 0;
+            for (uint32_t x = 0; x < width; x++)
+                data[(size_t)y * width + x] = sum += row[x];
+        }
+#pragma omp parallel for default(none) shared(data, width, height)
+        // Column-wise sum, a strip of columns per iteration
+        for (uint32_t x0 = 0; x0 < width; x0 += SAT_STRIP_WIDTH) {
+            uint32_t x1 = width - x0 < SAT_STRIP_WIDTH ? width
+                                                       : x0 + SAT_STRIP_WIDTH;
+            for (uint32_t y = 1; y < height; y++) {
+                uint32_t *row       = data + (size_t)y * width;
+                const uint32_t *top = row - width;
+                for (uint32_t x = x0; x < x1; x++) row[x] += top[x];
+            }
+        }
+    }
+    return sat;
+}
+
+/**
+ * Free memory for a compact summed area table.
+ *
+ * @param sat  The compact summed area table to free.
+ */
+void FreeCompactSat(CompactSat *sat) {
+    free(sat->data32_);
+    free(sat);
+}
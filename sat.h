@@ -18,12 +18,26 @@ extern SummedAreaTable *AllocateSat(uint32_t width, uint32_t height);
 
 /**
  * Compute the summed area table of a PGM image.
+ * The rows are split into bands whose tables are computed in parallel. The
+ * totals of the bands are then carried down through their last rows, and
+ * finally added to the other rows of the bands below, all in one parallel
+ * region.
  *
  * @param pgm   The PGM image.
  * @return      The summed area table, or NULL if an error occurred.
  */
 extern SummedAreaTable *PgmToSat(const PgmImage *pgm);
 
+/**
+ * Compute the summed area table of a PGM image, and that of its squared
+ * pixels, in the same passes as PgmToSat.
+ *
+ * @param pgm   The PGM image.
+ * @return      The summed area table, with squares_ set, or NULL if an error
+ * occurred.
+ */
+extern SummedAreaTable *PgmToSatSquared(const PgmImage *pgm);
+
 /**
  * Query the summed area table.
  *
@@ -38,6 +52,20 @@ extern SummedAreaTable *PgmToSat(const PgmImage *pgm);
 extern uint64_t SatQuery(const SummedAreaTable *sat, uint32_t tlx, uint32_t tly,
                          uint32_t brx, uint32_t bry);
 
+/**
+ * Query the sums of the squared pixels of a summed area table.
+ *
+ * @param sat   The summed area table, from PgmToSatSquared.
+ * @param tlx   Top-left x coordinate.
+ * @param tly   Top-left y coordinate.
+ * @param brx   Bottom-right x coordinate.
+ * @param bry   Bottom-right y coordinate.
+ * @return      The sum of the squared pixels in the rectangle defined by the
+ * given coordinates.
+ */
+extern uint64_t SatQuerySquares(const SummedAreaTable *sat, uint32_t tlx,
+                                uint32_t tly, uint32_t brx, uint32_t bry);
+
 /**
  * Free memory for a summed area table.
  *
@@ -45,4 +73,70 @@ extern uint64_t SatQuery(const SummedAreaTable *sat, uint32_t tlx, uint32_t tly,
  */
 extern void FreeSat(SummedAreaTable *sat);
 
+/**
+ * Allocate memory for a compact summed area table.
+ * The element size is the smallest one that keeps the sum of any rectangle of
+ * at most max_area pixels exact, given that the table never has to cover more
+ * than the whole image.
+ *
+ * @param width     The width of the image.
+ * @param height    The height of the image.
+ * @param max_area  The largest area that will be queried.
+ * @return          A pointer to the CompactSat, or NULL if an error occurred.
+ */
+extern CompactSat *AllocateCompactSat(uint32_t width, uint32_t height,
+                                      uint64_t max_area);
+
+/**
+ * Compute the compact summed area table of a PGM image.
+ *
+ * @param pgm       The PGM image.
+ * @param max_area  The largest area that will be queried, e.g. (2r + 1)^2 for
+ * a box blur of radius r.
+ * @return          The compact summed area table, or NULL if an error
+ * occurred.
+ */
+extern CompactSat *PgmToCompactSat(const PgmImage *pgm, uint64_t max_area);
+
+/**
+ * Query the compact summed area table.
+ * The rectangle must be at most max_area_ pixels for the sum to be exact.
+ *
+ * @param sat   The compact summed area table.
+ * @param tlx   Top-left x coordinate.
+ * @param tly   Top-left y coordinate.
+ * @param brx   Bottom-right x coordinate.
+ * @param bry   Bottom-right y coordinate.
+ * @return      The sum of the pixels in the rectangle defined by the given
+ * coordinates.
+ */
+static inline uint32_t CompactSatQuery(const CompactSat *sat, uint32_t tlx,
+                                       uint32_t tly, uint32_t brx,
+                                       uint32_t bry) {
+    // The wrapped differences are exact since the true sum fits
+    if (sat->element_size_ == 2) {
+        const uint16_t *data = sat->data16_;
+        uint16_t res         = data[(size_t)bry * sat->width_ + brx];
+        if (tly > 0) res -= data[(size_t)(tly - 1) * sat->width_ + brx];
+        if (tlx > 0) res -= data[(size_t)bry * sat->width_ + tlx - 1];
+        if (tlx > 0 && tly > 0)
+            res += data[(size_t)(tly - 1) * sat->width_ + tlx - 1];
+        return res;
+    }
+    const uint32_t *data = sat->data32_;
+    uint32_t res         = data[(size_t)bry * sat->width_ + brx];
+    if (tly > 0) res -= data[(size_t)(tly - 1) * sat->width_ + brx];
+    if (tlx > 0) res -= data[(size_t)bry * sat->width_ + tlx - 1];
+    if (tlx > 0 && tly > 0)
+        res += data[(size_t)(tly - 1) * sat->width_ + tlx - 1];
+    return res;
+}
+
+/**
+ * Free memory for a compact summed area table.
+ *
+ * @param sat  The compact summed area table to free.
+ */
+extern void FreeCompactSat(CompactSat *sat);
+
 #endif// NETPBM__SAT_H_
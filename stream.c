@@ -0,0 +1,283 @@
+#include "stream.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mapping.h"
+
+// Longest header (including comments) accepted when opening a stream.
+#define STREAM_MAX_HEADER 4096
+
+/**
+ * Allocate a stream for a file.
+ *
+ * @param fp        The open file.
+ * @param header    The header of the file.
+ * @param writing   Whether the file is being written.
+ * @return          A pointer to the stream, or NULL if an error occurred.
+ */
+static NetpbmStream *AllocateStream(FILE *fp, const NetpbmHeader *header,
+                                    bool writing) {
+    NetpbmStream *stream = (NetpbmStream *)malloc(sizeof(NetpbmStream));
+    if (!stream) {
+        fprintf(stderr, "Error: out of memory\n");
+        return NULL;
+    }
+    stream->file_    = fp;
+    stream->header_  = *header;
+    stream->writing_ = writing;
+    stream->row_     = 0;
+    return stream;
+}
+
+/**
+ * Open a binary netpbm file (P4, P5 or P6) for reading band by band.
+ *
+ * @param filename  The name of the file to read.
+ * @return          A pointer to the stream, or NULL if an error occurred.
+ */
+NetpbmStream *OpenNetpbmStream(const char *filename) {
+    // Open file for reading
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: could not open file '%s'\n", filename);
+        return NULL;
+    }
+
+    // Parse the header from the start of the file, then seek to the pixels
+    uint8_t buffer[STREAM_MAX_HEADER];
+    size_t size = fread(buffer, 1, sizeof(buffer), fp);
+    NetpbmHeader header;
+    if (!ParseNetpbmHeader(buffer, size, &header) ||
+        fseek(fp, (long)header.offset_, SEEK_SET) != 0) {
+        fprintf(stderr, "Error: invalid header in file '%s'\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+
+    // Only 8-bit samples are supported
+    if (header.magic_ != '4' && header.max_value_ != PGM_MAX_GRAY) {
+        fprintf(stderr, "Error: max value must be PGM_MAX_GRAY\n");
+        fclose(fp);
+        return NULL;
+    }
+
+    NetpbmStream *stream = AllocateStream(fp, &header, false);
+    if (!stream) fclose(fp);
+    return stream;
+}
+
+/**
+ * Create a binary netpbm file for writing band by band, and write its header.
+ *
+ * @param filename  The name of the file to write.
+ * @param magic     The format digit ('4', '5' or '6').
+ * @param width     The width of the image.
+ * @param height    The height of the image.
+ * @return          A pointer to the stream, or NULL if an error occurred.
+ */
+NetpbmStream *CreateNetpbmStream(const char *filename, char magic,
+                                 uint32_t width, uint32_t height) {
+    if (magic < '4' || magic > '6') {
+        fprintf(stderr, "Error: unsupported file format P%c\n", magic);
+        return NULL;
+    }
+
+    // Open file for writing
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error: could not open file '%s' for writing\n",
+                filename);
+        return NULL;
+    }
+
+    // Write header (magic number, width, height, and max value)
+    NetpbmHeader header = {magic, width, height, magic == '4' ? 1 : 255, 0};
+    int written = magic == '4'
+                      ? fprintf(fp, "P4\n%u\n%u\n", width, height)
+                      : fprintf(fp, "P%c\n%u\n%u\n%hu\n", magic, width, height,
+                                header.max_value_);
+    if (written < 0) {
+        fprintf(stderr, "Error: could not write header to file '%s'\n",
+                filename);
+        fclose(fp);
+        return NULL;
+    }
+    header.offset_ = (size_t)written;
+
+    NetpbmStream *stream = AllocateStream(fp, &header, true);
+    if (!stream) fclose(fp);
+    return stream;
+}
+
+/**
+ * Check that a band can be transferred to or from a stream.
+ *
+ * @param stream    The stream.
+ * @param magic     The format digit the band type requires.
+ * @param writing   Whether the band is being written.
+ * @param width     The width of the band.
+ * @return          True if the band matches the stream, false otherwise.
+ */
+static bool CheckBand(const NetpbmStream *stream, char magic, bool writing,
+                      uint32_t width) {
+    if (stream->header_.magic_ != magic || stream->writing_ != writing) {
+        fprintf(stderr, "Error: stream is not a P%c %s stream\n", magic,
+                writing ? "output" : "input");
+        return false;
+    }
+    if (width != stream->header_.width_) {
+        fprintf(stderr, "Error: band width %u does not match image width %u\n",
+                width, stream->header_.width_);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Read the next band of rows as stored in the file.
+ *
+ * @param stream    The stream to read from.
+ * @param data      The band data.
+ * @param row_size  The size of a row in bytes.
+ * @param capacity  The maximum number of rows to read.
+ * @return          The number of rows read.
+ */
+static uint32_t ReadBand(NetpbmStream *stream, void *data, size_t row_size,
+                         uint32_t capacity) {
+    uint32_t rows = stream->header_.height_ - stream->row_;
+    if (rows > capacity) rows = capacity;
+    if (fread(data, row_size, rows, stream->file_) != rows) {
+        fprintf(stderr, "Error: could not read pixel data\n");
+        return 0;
+    }
+    stream->row_ += rows;
+    return rows;
+}
+
+/**
+ * Append a band of rows as stored in the file.
+ *
+ * @param stream    The stream to write to.
+ * @param data      The band data.
+ * @param row_size  The size of a row in bytes.
+ * @param rows      The number of rows to write.
+ * @return          True if successful, false otherwise.
+ */
+static bool WriteBand(NetpbmStream *stream, const void *data, size_t row_size,
+                      uint32_t rows) {
+    if (rows > stream->header_.height_ - stream->row_) {
+        fprintf(stderr, "Error: band extends past the bottom of the image\n");
+        return false;
+    }
+    if (fwrite(data, row_size, rows, stream->file_) != rows) {
+        fprintf(stderr, "Error: could not write pixel data\n");
+        return false;
+    }
+    stream->row_ += rows;
+    return true;
+}
+
+/**
+ * Read the next band of rows of a PPM stream.
+ *
+ * @param stream    The stream to read from.
+ * @param band      The band to read into, as wide as the image. Up to its
+ * height rows are read, and its height is set to the number of rows read.
+ * @return          The number of rows read, 0 at the end or on error.
+ */
+uint32_t ReadPpmBand(NetpbmStream *stream, PpmImage *band) {
+    if (!CheckBand(stream, '6', false, band->width_)) return 0;
+    band->height_ = ReadBand(stream, band->data_,
+                             (size_t)band->width_ * sizeof(Pixel),
+                             band->height_);
+    return band->height_;
+}
+
+/**
+ * Read the next band of rows of a PGM stream.
+ *
+ * @param stream    The stream to read from.
+ * @param band      The band to read into, as wide as the image. Up to its
+ * height rows are read, and its height is set to the number of rows read.
+ * @return          The number of rows read, 0 at the end or on error.
+ */
+uint32_t ReadPgmBand(NetpbmStream *stream, PgmImage *band) {
+    if (!CheckBand(stream, '5', false, band->width_)) return 0;
+    band->height_ = ReadBand(stream, band->data_, band->width_, band->height_);
+    return band->height_;
+}
+
+/**
+ * Read the next band of rows of a PBM stream.
+ *
+ * @param stream    The stream to read from.
+ * @param band      The band to read into, as wide as the image. Up to its
+ * height rows are read, and its height is set to the number of rows read.
+ * @return          The number of rows read, 0 at the end or on error.
+ */
+uint32_t ReadPbmBand(NetpbmStream *stream, PbmImage *band) {
+    if (!CheckBand(stream, '4', false, band->width_)) return 0;
+    band->height_ = ReadBand(stream, band->data_, band->stride_, band->height_);
+    return band->height_;
+}
+
+/**
+ * Append a band of rows to a PPM stream.
+ *
+ * @param stream    The stream to write to.
+ * @param band      The rows to write, as wide as the image.
+ * @return          True if successful, false otherwise.
+ */
+bool WritePpmBand(NetpbmStream *stream, const PpmImage *band) {
+    return CheckBand(stream, '6', true, band->width_) &&
+           WriteBand(stream, band->data_, (size_t)band->width_ * sizeof(Pixel),
+                     band->height_);
+}
+
+/**
+ * Append a band of rows to a PGM stream.
+ *
+ * @param stream    The stream to write to.
+ * @param band      The rows to write, as wide as the image.
+ * @return          True if successful, false otherwise.
+ */
+bool WritePgmBand(NetpbmStream *stream, const PgmImage *band) {
+    return CheckBand(stream, '5', true, band->width_) &&
+           WriteBand(stream, band->data_, band->width_, band->height_);
+}
+
+/**
+ * Append a band of rows to a PBM stream.
+ *
+ * @param stream    The stream to write to.
+ * @param band      The rows to write, as wide as the image.
+ * @return          True if successful, false otherwise.
+ */
+bool WritePbmBand(NetpbmStream *stream, const PbmImage *band) {
+    return CheckBand(stream, '4', true, band->width_) &&
+           WriteBand(stream, band->data_, band->stride_, band->height_);
+}
+
+/**
+ * Close a stream and free its memory.
+ *
+ * @param stream    The stream to close.
+ * @return          True if successful, false if a written image is incomplete
+ * or could not be flushed.
+ */
+bool CloseNetpbmStream(NetpbmStream *stream) {
+    bool success = true;
+    if (stream->writing_ && stream->row_ != stream->header_.height_) {
+        fprintf(stderr, "Error: only %u of %u rows were written\n",
+                stream->row_, stream->header_.height_);
+        success = false;
+    }
+    if (fclose(stream->file_) != 0) {
+        fprintf(stderr, "Error: could not close file\n");
+        success = false;
+    }
+    free(stream);
+    return success;
+}
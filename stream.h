@@ -0,0 +1,98 @@
+#ifndef NETPBM__STREAM_H_
+#define NETPBM__STREAM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "types/pbm.h"
+#include "types/pgm.h"
+#include "types/ppm.h"
+#include "types/stream.h"
+
+/**
+ * Open a binary netpbm file (P4, P5 or P6) for reading band by band.
+ *
+ * @param filename  The name of the file to read.
+ * @return          A pointer to the stream, or NULL if an error occurred.
+ */
+extern NetpbmStream *OpenNetpbmStream(const char *filename);
+
+/**
+ * Create a binary netpbm file for writing band by band, and write its header.
+ *
+ * @param filename  The name of the file to write.
+ * @param magic     The format digit ('4', '5' or '6').
+ * @param width     The width of the image.
+ * @param height    The height of the image.
+ * @return          A pointer to the stream, or NULL if an error occurred.
+ */
+extern NetpbmStream *CreateNetpbmStream(const char *filename, char magic,
+                                        uint32_t width, uint32_t height);
+
+/**
+ * Read the next band of rows of a PPM stream.
+ *
+ * @param stream    The stream to read from.
+ * @param band      The band to read into, as wide as the image. Up to its
+ * height rows are read, and its height is set to the number of rows read.
+ * @return          The number of rows read, 0 at the end or on error.
+ */
+extern uint32_t ReadPpmBand(NetpbmStream *stream, PpmImage *band);
+
+/**
+ * Read the next band of rows of a PGM stream.
+ *
+ * @param stream    The stream to read from.
+ * @param band      The band to read into, as wide as the image. Up to its
+ * height rows are read, and its height is set to the number of rows read.
+ * @return          The number of rows read, 0 at the end or on error.
+ */
+extern uint32_t ReadPgmBand(NetpbmStream *stream, PgmImage *band);
+
+/**
+ * Read the next band of rows of a PBM stream.
+ *
+ * @param stream    The stream to read from.
+ * @param band      The band to read into, as wide as the image. Up to its
+ * height rows are read, and its height is set to the number of rows read.
+ * @return          The number of rows read, 0 at the end or on error.
+ */
+extern uint32_t ReadPbmBand(NetpbmStream *stream, PbmImage *band);
+
+/**
+ * Append a band of rows to a PPM stream.
+ *
+ * @param stream    The stream to write to.
+ * @param band      The rows to write, as wide as the image.
+ * @return          True if successful, false otherwise.
+ */
+extern bool WritePpmBand(NetpbmStream *stream, const PpmImage *band);
+
+/**
+ * Append a band of rows to a PGM stream.
+ *
+ * @param stream    The stream to write to.
+ * @param band      The rows to write, as wide as the image.
+ * @return          True if successful, false otherwise.
+ */
+extern bool WritePgmBand(NetpbmStream *stream, const PgmImage *band);
+
+/**
+ * Append a band of rows to a PBM stream.
+ *
+ * @param stream    The stream to write to.
+ * @param band      The rows to write, as wide as the image.
+ * @return          True if successful, false otherwise.
+ */
+extern bool WritePbmBand(NetpbmStream *stream, const PbmImage *band);
+
+/**
+ * Close a stream and free its memory.
+ *
+ * @param stream    The stream to close.
+ * @return          True if successful, false if a written image is incomplete
+ * or could not be flushed.
+ */
+extern bool CloseNetpbmStream(NetpbmStream *stream);
+
+#endif// NETPBM__STREAM_H_
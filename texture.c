@@ -0,0 +1,57 @@
+#include "texture.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The built-in maps, generated from the textures directory by
+// cmake/EmbedTextures.cmake
+extern const PgmImage kTextureSlices[];
+extern const TextureSet kTextureSets[];
+extern const uint32_t kTextureSetCount;
+
+/**
+ * Find the set of built-in threshold maps of a kind and size.
+ *
+ * @param kind      The kind of the maps.
+ * @param size      The width and height of the maps.
+ * @return          A pointer to the set, or NULL if there is none.
+ */
+static const TextureSet *FindTextureSet(TextureKind kind, uint32_t size) {
+    for (uint32_t i = 0; i < kTextureSetCount; i++) {
+        const TextureSet *set = &kTextureSets[i];
+        if (set->kind_ == kind && set->volume_.width_ == size &&
+            set->volume_.height_ == size)
+            return set;
+    }
+    return NULL;
+}
+
+/**
+ * Look up a slice of a built-in threshold map. The maps are those of the
+ * textures directory, compiled into the library, so this needs no memory
+ * allocation or file I/O.
+ *
+ * @param kind      The kind of the map.
+ * @param size      The width and height of the map.
+ * @param slice     The slice of the map, 0 for kinds with one slice per size.
+ * @return          A read-only view of the map, which must not be freed, or
+ * NULL if there is no such map.
+ */
+const PgmImage *FindTexture(TextureKind kind, uint32_t size, uint32_t slice) {
+    const TextureSet *set = FindTextureSet(kind, size);
+    if (!set || slice >= set->volume_.depth_) return NULL;
+    return &kTextureSlices[set->first_slice_ + slice];
+}
+
+/**
+ * Look up all slices of a built-in threshold map, as for PgmToPbmSequence.
+ *
+ * @param kind      The kind of the map.
+ * @param size      The width and height of the map.
+ * @return          A read-only view of the slices, which must not be freed,
+ * or NULL if there is no such map.
+ */
+const ThresholdVolume *FindTextureVolume(TextureKind kind, uint32_t size) {
+    const TextureSet *set = FindTextureSet(kind, size);
+    return set ? &set->volume_ : NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef NETPBM__TEXTURE_H_
+#define NETPBM__TEXTURE_H_
+
+#include <stdint.h>
+
+#include "types/pbm.h"
+#include "types/pgm.h"
+#include "types/texture.h"
+
+/**
+ * Look up a slice of a built-in threshold map. The maps are those of the
+ * textures directory, compiled into the library, so this needs no memory
+ * allocation or file I/O.
+ *
+ * @param kind      The kind of the map.
+ * @param size      The width and height of the map.
+ * @param slice     The slice of the map, 0 for kinds with one slice per size.
+ * @return          A read-only view of the map, which must not be freed, or
+ * NULL if there is no such map.
+ */
+extern const PgmImage *FindTexture(TextureKind kind, uint32_t size,
+                                   uint32_t slice);
+
+/**
+ * Look up all slices of a built-in threshold map, as for PgmToPbmSequence.
+ *
+ * @param kind      The kind of the map.
+ * @param size      The width and height of the map.
+ * @return          A read-only view of the slices, which must not be freed,
+ * or NULL if there is no such map.
+ */
+extern const ThresholdVolume *FindTextureVolume(TextureKind kind,
+                                                uint32_t size);
+
+#endif// NETPBM__TEXTURE_H_
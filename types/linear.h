@@ -0,0 +1,26 @@
+#ifndef NETPBM_TYPES_LINEAR_H_
+#define NETPBM_TYPES_LINEAR_H_
+
+#include <stdint.h>
+
+/**
+ * A pixel in linear light.
+ */
+typedef struct {
+    float r_;// The red component of the pixel (0-1).
+    float g_;// The green component of the pixel (0-1).
+    float b_;// The blue component of the pixel (0-1).
+} LinearPixel;
+
+/**
+ * A color image in linear light.
+ * Keeping linear values in floating point avoids quantizing the dark tones
+ * between linearization and the final 8-bit image.
+ */
+typedef struct {
+    uint32_t width_;   // The width of the image.
+    uint32_t height_;  // The height of the image.
+    LinearPixel *data_;// The image data, stored in row-major order.
+} LinearImage;
+
+#endif// NETPBM_TYPES_LINEAR_H_
@@ -0,0 +1,26 @@
+#ifndef NETPBM_TYPES_MAPPING_H_
+#define NETPBM_TYPES_MAPPING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A read-only view of a whole file, memory-mapped where the platform allows.
+ */
+typedef struct {
+    uint8_t *data_;// The first byte of the file.
+    size_t size_;  // The size of the file in bytes.
+} MappedFile;
+
+/**
+ * The header of a binary netpbm file.
+ */
+typedef struct {
+    char magic_;        // The format digit following 'P' ('4', '5' or '6').
+    uint32_t width_;    // The width of the image.
+    uint32_t height_;   // The height of the image.
+    uint16_t max_value_;// The maximum sample value (1 for PBM).
+    size_t offset_;     // The offset of the first byte of pixel data.
+} NetpbmHeader;
+
+#endif// NETPBM_TYPES_MAPPING_H_
@@ -1,20 +1,96 @@
 #ifndef NETPBM_TYPES_PBM_H_
 #define NETPBM_TYPES_PBM_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "mapping.h"
+
 /**
  * A PBM image.
- * This is a black and white image.
- * We use a byte to represent a pixel of one bit, for ease of use.
+ * This is a black and white image, stored as in the PBM file format: one bit
+ * per pixel, most significant bit first, 1 for black, with each row padded to
+ * a whole byte.
  */
 typedef struct {
-    uint32_t width_; // The width of the image.
-    uint32_t height_;// The height of the image.
-    uint8_t *data_;  // The image data, stored in row-major order.
+    uint32_t width_;    // The width of the image.
+    uint32_t height_;   // The height of the image.
+    uint32_t stride_;   // The number of bytes per row, (width + 7) / 8.
+    uint8_t *data_;     // The packed image data, stored in row-major order.
+    MappedFile mapping_;// The file mapping data_ points into, if any.
 } PbmImage;
 
 // Threshold function
 typedef uint8_t (*ThresholdFn)(uint32_t x, uint32_t y);
 
+// Threshold function for a span of pixels: the thresholds of count pixels of
+// row y, starting at column x0
+typedef void (*ThresholdRowFn)(uint8_t *thresholds, uint32_t count,
+                               uint32_t x0, uint32_t y, void *context);
+
+/**
+ * A method of adaptive thresholding, which compares each pixel with the mean
+ * m, and standard deviation s, of a window around it.
+ */
+typedef enum {
+    BRADLEY,// Black below (1 - k) m.
+    SAUVOLA,// Black below m (1 + k (s / 128 - 1)).
+    NIBLACK // Black below m + k s.
+} AdaptiveMethod;
+
+/**
+ * An error diffusion kernel.
+ */
+typedef enum {
+    FLOYD_STEINBERG,    // Floyd–Steinberg, error spread over 2 rows.
+    ATKINSON,           // Atkinson, 3/4 of the error spread over 3 rows.
+    JARVIS_JUDICE_NINKE,// Jarvis, Judice, and Ninke, error spread over 3 rows.
+    STUCKI,             // Stucki, error spread over 3 rows.
+    BURKES,             // Burkes, error spread over 2 rows.
+    SIERRA,             // Sierra, error spread over 3 rows.
+    TWO_ROW_SIERRA,     // Two-row Sierra, error spread over 2 rows.
+    SIERRA_LITE         // Sierra Lite, error spread over 2 rows.
+} DiffusionKernel;
+
+/**
+ * A class matrix for dot diffusion, which orders the pixels of each tile.
+ */
+typedef enum {
+    KNUTH_8X8,// Knuth's 8x8 matrix, whose dots cluster slightly.
+    DOT_16X16 // A 16x16 matrix optimized for a dispersed texture.
+} ClassMatrix;
+
+/**
+ * The state of an error diffusion ditherer that is fed an image band by band.
+ * It carries the error that the rows processed so far diffuse into the rows
+ * below them, so its size is proportional to the width of the image only.
+ */
+typedef struct {
+    DiffusionKernel kernel_;// The error diffusion kernel.
+    bool serpentine_;       // Whether odd rows are scanned right to left.
+    uint32_t width_;        // The width of the image.
+    uint32_t row_;          // The number of rows dithered so far.
+    int32_t *errors_;       // Ring of 3 rows of diffused error, in fixed point.
+} DiffusionState;
+
+/**
+ * A stack of threshold maps of the same size, stored contiguously, such as the
+ * slices of a spatiotemporal blue noise texture.
+ */
+typedef struct {
+    uint32_t width_; // The width of each slice.
+    uint32_t height_;// The height of each slice.
+    uint32_t depth_; // The number of slices.
+    uint8_t *data_;  // The slices one after another, each in row-major order.
+} ThresholdVolume;
+
+/**
+ * How the frames of a sequence pick their thresholds from a ThresholdVolume.
+ */
+typedef enum {
+    SEQUENCE_SLICES,     // Frame n uses slice n % depth.
+    SEQUENCE_GOLDEN_RATIO// As SEQUENCE_SLICES, with the thresholds of frame n
+                         // also offset by n times the golden ratio conjugate.
+} SequenceOrder;
+
 #endif// NETPBM_TYPES_PBM_H_
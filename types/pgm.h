@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 
+#include "mapping.h"
 #include "pixel.h"
 
 /**
@@ -13,13 +14,45 @@
  * This is a grayscale image.
  */
 typedef struct {
-    uint32_t width_;   // The width of the image.
-    uint32_t height_;  // The height of the image.
-    uint16_t max_gray_;// The maximum gray value.
-    uint8_t *data_;    // The image data, stored in row-major order.
+    uint32_t width_;    // The width of the image.
+    uint32_t height_;   // The height of the image.
+    uint16_t max_gray_; // The maximum gray value.
+    uint8_t *data_;     // The image data, stored in row-major order.
+    MappedFile mapping_;// The file mapping data_ points into, if any.
 } PgmImage;
 
+/**
+ * A histogram of the pixel values of a PGM image.
+ * Any statistic of the distribution of pixel values can be derived from it
+ * without revisiting the image.
+ */
+typedef struct {
+    uint64_t bins_[PGM_MAX_GRAY + 1];// The number of pixels of each value.
+    uint64_t count_;                 // The total number of pixels.
+} Histogram;
+
 // Luminance function
 typedef double (*LuminanceFn)(const Pixel *);
 
+// Luminance function for a span of pixels: count pixels of row y, starting at
+// column x0, with their luminance written to out
+typedef void (*LuminanceRowFn)(const Pixel *pixels, uint32_t count,
+                               uint32_t x0, uint32_t y, uint8_t *out,
+                               void *context);
+
+/**
+ * Weights of the red, green and blue channels in a luminance.
+ */
+typedef struct {
+    double r_;// The weight of the red channel.
+    double g_;// The weight of the green channel.
+    double b_;// The weight of the blue channel.
+} LuminanceWeights;
+
+// Rec. 709 luma weights, as used by SRgbLuminance
+#define REC_709_WEIGHTS ((LuminanceWeights){.2126, .7152, .0722})
+
+// Rec. 601 luma weights, as used by LinearLuminance
+#define REC_601_WEIGHTS ((LuminanceWeights){.299, .587, .114})
+
 #endif// NETPBM_TYPES_PGM_H_
@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 
+#include "mapping.h"
 #include "pixel.h"
 
 /**
@@ -17,6 +18,15 @@ typedef struct {
     uint32_t height_;   // The height of the image.
     uint16_t max_color_;// The maximum color value.
     Pixel *data_;       // The image data, stored in row-major order.
+    MappedFile mapping_;// The file mapping data_ points into, if any.
 } PpmImage;
 
+// Pixel conversion function
+typedef void (*PixelFn)(Pixel *);
+
+// Pixel conversion function for a span of pixels: count pixels of row y,
+// starting at column x0, converted in place
+typedef void (*PixelRowFn)(Pixel *pixels, uint32_t count, uint32_t x0,
+                           uint32_t y, void *context);
+
 #endif// NETPBM_TYPES_PPM_H_
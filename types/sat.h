@@ -8,12 +8,33 @@
  * This is a table of the sum of all pixels above and to the left of the current
  * pixel. This allows for fast calculation of the sum of any rectangular area.
  * See https://en.wikipedia.org/wiki/Summed-area_table for more information.
- * This is particularly useful for computing the box blur.
+ * This is particularly useful for computing the box blur. A table of the sums
+ * of the squared pixels can be kept alongside, for the variance of any
+ * rectangular area.
  */
 typedef struct {
-    uint32_t width_; // The width of the table
-    uint32_t height_;// The height of the table
-    uint64_t *data_; // The data of the table, stored in row-major order
+    uint32_t width_;    // The width of the table
+    uint32_t height_;   // The height of the table
+    uint64_t *data_;    // The data of the table, stored in row-major order
+    uint64_t *squares_; // The sums of the squared pixels, or NULL
 } SummedAreaTable;
 
+/**
+ * A compact summed area table
+ * This is a summed area table whose sums are kept modulo 2^16 or 2^32. The sum
+ * of a rectangle is still exact as long as it fits in the element type, which
+ * holds for every rectangle of at most max_area_ pixels. Elements are 16 bits
+ * wide when 255 * max_area_ < 2^16 and 32 bits wide otherwise.
+ */
+typedef struct {
+    uint32_t width_;      // The width of the table
+    uint32_t height_;     // The height of the table
+    uint64_t max_area_;   // The largest area whose sum is exact
+    uint8_t element_size_;// The size of an element in bytes, 2 or 4
+    union {
+        uint16_t *data16_;// The data if element_size_ is 2
+        uint32_t *data32_;// The data if element_size_ is 4
+    };
+} CompactSat;
+
 #endif// NETPBM_TYPES_SAT_H_
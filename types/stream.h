@@ -0,0 +1,22 @@
+#ifndef NETPBM_TYPES_STREAM_H_
+#define NETPBM_TYPES_STREAM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mapping.h"
+
+/**
+ * A binary netpbm file read or written a band of rows at a time.
+ * Only one band needs to be in memory at once, so images larger than the
+ * available memory can be processed.
+ */
+typedef struct {
+    FILE *file_;         // The file being read or written.
+    NetpbmHeader header_;// The header of the file.
+    bool writing_;       // Whether the file is being written.
+    uint32_t row_;       // The number of rows read or written so far.
+} NetpbmStream;
+
+#endif// NETPBM_TYPES_STREAM_H_
@@ -0,0 +1,26 @@
+#ifndef NETPBM_TYPES_TEXTURE_H_
+#define NETPBM_TYPES_TEXTURE_H_
+
+#include <stdint.h>
+
+#include "pbm.h"
+
+/**
+ * A kind of threshold map built into the library from the textures directory.
+ */
+typedef enum {
+    TEXTURE_BAYER,     // Bayer matrices, one slice per size.
+    TEXTURE_BLUE_NOISE // Blue noise, a sequence of slices per size.
+} TextureKind;
+
+/**
+ * A set of built-in threshold maps of one kind and size.
+ * The pixels of all sets are compiled into one read-only array.
+ */
+typedef struct {
+    TextureKind kind_;      // The kind of the maps.
+    uint32_t first_slice_;  // The index of the first slice in kTextureSlices.
+    ThresholdVolume volume_;// The slices of the set, one after another.
+} TextureSet;
+
+#endif// NETPBM_TYPES_TEXTURE_H_